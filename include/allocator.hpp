@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+namespace search_trees
+{
+
+// Node allocator policies. A policy is a class template over the block type T
+// providing allocate()/deallocate() for single blocks. If releases_all is set, the
+// allocator gives all of its memory back when destroyed, so a tree does not have
+// to free its nodes one by one.
+
+template<typename T>
+class HeapAllocator
+{
+public:
+	using value_type = T;
+
+	static constexpr bool releases_all = false;
+
+	T *allocate()
+	{
+		return static_cast<T *>(::operator new(sizeof(T)));
+	}
+
+	void deallocate(T *block)
+	{
+		::operator delete(block);
+	}
+};
+
+template<typename T>
+class PoolAllocator
+{
+	union Block
+	{
+		Block *next;
+		alignas(T) unsigned char storage[sizeof(T)];
+	};
+
+	static constexpr std::size_t chunk_bytes = 64 * 1024;
+	static constexpr std::size_t blocks_per_chunk = chunk_bytes / sizeof(Block) > 16 ? chunk_bytes / sizeof(Block) : 16;
+
+	struct Chunk
+	{
+		Chunk *next;
+		Block blocks[blocks_per_chunk];
+	};
+
+	Chunk *chunks;
+	Block *free_list;
+	std::size_t chunk_used;
+
+	void release()
+	{
+		while (chunks) {
+			auto next = chunks->next;
+			::operator delete(chunks);
+			chunks = next;
+		}
+	}
+
+public:
+	using value_type = T;
+
+	static constexpr bool releases_all = true;
+
+	PoolAllocator()
+		: chunks(nullptr)
+		, free_list(nullptr)
+		, chunk_used(blocks_per_chunk)
+	{}
+
+	PoolAllocator(const PoolAllocator &) = delete;
+	PoolAllocator &operator=(const PoolAllocator &) = delete;
+
+	PoolAllocator(PoolAllocator &&other)
+		: chunks(std::exchange(other.chunks, nullptr))
+		, free_list(std::exchange(other.free_list, nullptr))
+		, chunk_used(other.chunk_used)
+	{
+		other.chunk_used = blocks_per_chunk;
+	}
+
+	PoolAllocator &operator=(PoolAllocator &&other)
+	{
+		if (this != &other) {
+			release();
+			chunks = std::exchange(other.chunks, nullptr);
+			free_list = std::exchange(other.free_list, nullptr);
+			chunk_used = other.chunk_used;
+			other.chunk_used = blocks_per_chunk;
+		}
+		return *this;
+	}
+
+	~PoolAllocator()
+	{
+		release();
+	}
+
+	T *allocate()
+	{
+		if (free_list) {
+			auto block = free_list;
+			free_list = block->next;
+			return reinterpret_cast<T *>(block->storage);
+		}
+
+		if (chunk_used == blocks_per_chunk) {
+			auto chunk = static_cast<Chunk *>(::operator new(sizeof(Chunk)));
+			chunk->next = chunks;
+			chunks = chunk;
+			chunk_used = 0;
+		}
+
+		return reinterpret_cast<T *>(chunks->blocks[chunk_used++].storage);
+	}
+
+	void deallocate(T *pointer)
+	{
+		auto block = reinterpret_cast<Block *>(pointer);
+		block->next = free_list;
+		free_list = block;
+	}
+};
+
+template<typename Allocator, typename ...Args>
+typename Allocator::value_type *construct(Allocator &allocator, Args &&...args)
+{
+	using T = typename Allocator::value_type;
+	return new (allocator.allocate()) T(std::forward<Args>(args)...);
+}
+
+template<typename Allocator>
+void destroy(Allocator &allocator, typename Allocator::value_type *object)
+{
+	using T = typename Allocator::value_type;
+	object->~T();
+	allocator.deallocate(object);
+}
+
+} // namespace search_trees
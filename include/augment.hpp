@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <type_traits>
+
+namespace search_trees
+{
+
+// Subtree augmentations. Unless the tree is given NoAugment, every node keeps the
+// number of entries in its subtree and the aggregate of their values under a monoid,
+// which makes rank, select and range queries O(log n). A monoid names its result
+// type and provides the identity, lift() of a single value and an associative combine().
+
+struct NoAugment
+{
+	struct type {};
+
+	static type identity()
+	{
+		return type();
+	}
+
+	template<typename Value>
+	static type lift(const Value &)
+	{
+		return type();
+	}
+
+	static type combine(const type &, const type &)
+	{
+		return type();
+	}
+};
+
+// Subtree sizes without any aggregate over values
+struct CountOnly: NoAugment
+{};
+
+template<typename T>
+struct Sum
+{
+	using type = T;
+
+	static type identity()
+	{
+		return T();
+	}
+
+	static type lift(const T &value)
+	{
+		return value;
+	}
+
+	static type combine(const type &a, const type &b)
+	{
+		return a + b;
+	}
+};
+
+template<typename T>
+struct Minimum
+{
+	using type = T;
+
+	static type identity()
+	{
+		return std::numeric_limits<T>::max();
+	}
+
+	static type lift(const T &value)
+	{
+		return value;
+	}
+
+	static type combine(const type &a, const type &b)
+	{
+		return std::min(a, b);
+	}
+};
+
+template<typename T>
+struct Maximum
+{
+	using type = T;
+
+	static type identity()
+	{
+		return std::numeric_limits<T>::lowest();
+	}
+
+	static type lift(const T &value)
+	{
+		return value;
+	}
+
+	static type combine(const type &a, const type &b)
+	{
+		return std::max(a, b);
+	}
+};
+
+template<typename Augment>
+struct is_augmented: std::true_type
+{};
+
+template<>
+struct is_augmented<NoAugment>: std::false_type
+{};
+
+// Per-node augmented fields, empty when the tree is not augmented
+template<typename Augment, bool = is_augmented<Augment>::value>
+struct SubtreeSummary
+{
+	std::size_t size;
+	typename Augment::type value;
+};
+
+template<typename Augment>
+struct SubtreeSummary<Augment, false>
+{};
+
+} // namespace search_trees
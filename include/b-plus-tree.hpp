@@ -0,0 +1,905 @@
+#pragma once
+
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "search-tree.hpp"
+#include "allocator.hpp"
+#include "memory-usage.hpp"
+#include "stats.hpp"
+#include "util.hpp"
+
+#ifdef min
+#undef min
+#endif
+
+#ifdef max
+#undef max
+#endif
+
+namespace search_trees
+{
+
+// B+tree whose nodes take about NodeBytes bytes. Entries are kept in the leaves only, which
+// are chained in key order, and inner nodes hold as many separator keys as fit. A lookup
+// touches a few cache lines per level and iteration walks the leaves sequentially.
+// Key and Value must be default constructible and move assignable.
+template<typename Key, typename Value, std::size_t NodeBytes = 256, template<typename> class Allocator = HeapAllocator,
+		typename Compare = ThreeWayCompare>
+class BPlusTree final: public OrderedTree<BPlusTree<Key, Value, NodeBytes, Allocator, Compare>, Key, Value, Compare>
+{
+	friend class OrderedTree<BPlusTree, Key, Value, Compare>;
+	friend class TreeIterator<BPlusTree, Key, Value>;
+	friend class TreeIterator<BPlusTree, Key, const Value>;
+	friend class SearchTreeAdapter<BPlusTree>;
+
+	struct Inner;
+
+	struct Node
+	{
+		Inner *parent;
+		unsigned count; // Entries of a leaf, keys of an inner node
+		bool leaf;
+
+		Node(bool leaf)
+			: parent(nullptr)
+			, count(0)
+			, leaf(leaf)
+		{}
+	};
+
+	static constexpr std::size_t header_bytes = sizeof(Node) + 2 * sizeof(void *);
+	static constexpr std::size_t entry_bytes = sizeof(Key) + sizeof(Value);
+	static constexpr std::size_t link_bytes = sizeof(Key) + sizeof(Node *);
+
+	// Nodes never get below four slots, whatever NodeBytes says
+	static constexpr std::size_t leaf_capacity =
+			NodeBytes >= header_bytes + 4 * entry_bytes ? (NodeBytes - header_bytes) / entry_bytes : 4;
+	static constexpr std::size_t fanout =
+			NodeBytes >= header_bytes + 4 * link_bytes ? (NodeBytes - header_bytes) / link_bytes : 4;
+
+	static constexpr std::size_t min_leaf_count = leaf_capacity / 2;
+	static constexpr std::size_t min_inner_count = (fanout - 1) / 2;
+
+	struct Leaf: Node
+	{
+		Leaf *prev, *next;
+		Key keys[leaf_capacity];
+		Value values[leaf_capacity];
+
+		Leaf()
+			: Node(true)
+			, prev(nullptr)
+			, next(nullptr)
+		{}
+	};
+
+	struct Inner: Node
+	{
+		// Everything under children[i] is below keys[i], everything under children[i + 1] is not
+		Key keys[fanout - 1];
+		Node *children[fanout];
+
+		Inner()
+			: Node(false)
+		{}
+
+		void set_child(unsigned index, Node *child)
+		{
+			child->parent = this;
+			children[index] = child;
+		}
+
+		unsigned index_of(const Node *child) const
+		{
+			unsigned index = 0;
+			for (; children[index] != child; ++index);
+			return index;
+		}
+	};
+
+	Node *root;
+	Allocator<Leaf> leaf_allocator;
+	Allocator<Inner> inner_allocator;
+	mutable OperationCounters counters;
+
+	template<typename K, typename Less = CompareLess<Compare>>
+	static unsigned lower_index(const Key *keys, unsigned count, const K &key, Less less = Less())
+	{
+		return std::lower_bound(keys, keys + count, key, less) - keys;
+	}
+
+	template<typename K, typename Less = CompareLess<Compare>>
+	static unsigned upper_index(const Key *keys, unsigned count, const K &key, Less less = Less())
+	{
+		return std::upper_bound(keys, keys + count, key, less) - keys;
+	}
+
+	// Same as lower_index, setting found when the key there equals key
+	template<typename K>
+	unsigned search_index(const Key *keys, unsigned count, const K &key, bool &found) const
+	{
+		auto index = lower_index(keys, count, key, counters.less<Compare>());
+		found = index < count && Compare::compare(key, keys[index]) == 0;
+		counters.compared(index < count);
+		return index;
+	}
+
+	void destroy_subtree(Node *node)
+	{
+		if (node->leaf) {
+			destroy(leaf_allocator, static_cast<Leaf *>(node));
+			return;
+		}
+
+		auto inner = static_cast<Inner *>(node);
+		for (unsigned i = 0; i <= inner->count; ++i)
+			destroy_subtree(inner->children[i]);
+		destroy(inner_allocator, inner);
+	}
+
+	// Unused slots and the separators of inner nodes, with what they own, count as overhead
+	static void add_usage(const Node *node, MemoryUsage &usage)
+	{
+		if (node->leaf) {
+			auto leaf = static_cast<const Leaf *>(node);
+			for (unsigned i = 0; i < leaf->count; ++i)
+				usage.add_entry(leaf->keys[i], leaf->values[i], false);
+			usage.add_node(sizeof(Leaf), leaf->count * (sizeof(Key) + sizeof(Value)));
+			return;
+		}
+
+		auto inner = static_cast<const Inner *>(node);
+		usage.add_node(sizeof(Inner), 0);
+		for (unsigned i = 0; i < inner->count; ++i)
+			usage.overhead_bytes += heap_size(inner->keys[i]);
+		for (unsigned i = 0; i <= inner->count; ++i)
+			add_usage(inner->children[i], usage);
+	}
+
+	// Tree of the next count entries from it, which must be in key order. Leaves are filled
+	// level by level from the left, every node of a level taking as many entries as the
+	// others give or take one, which keeps them all at or above the minimum.
+	template<typename Iterator>
+	Node *build(Iterator it, std::size_t count)
+	{
+		if (!count)
+			return nullptr;
+
+		// Nodes of the level being built and the smallest key under each
+		std::vector<Node *> level, parents;
+		std::vector<Key> lows, parent_lows;
+
+		auto leaves = (count + leaf_capacity - 1) / leaf_capacity;
+		Leaf *prev = nullptr;
+		for (std::size_t i = 0; i < leaves; ++i) {
+			auto leaf = construct(leaf_allocator);
+			leaf->count = count / leaves + (i < count % leaves);
+			for (unsigned j = 0; j < leaf->count; ++j, ++it) {
+				leaf->keys[j] = (*it).first;
+				leaf->values[j] = (*it).second;
+			}
+
+			leaf->prev = prev;
+			if (prev)
+				prev->next = leaf;
+			prev = leaf;
+			level.push_back(leaf);
+			lows.push_back(leaf->keys[0]);
+		}
+
+		while (level.size() > 1) {
+			auto nodes = (level.size() + fanout - 1) / fanout;
+			std::size_t next = 0;
+			for (std::size_t i = 0; i < nodes; ++i) {
+				auto inner = construct(inner_allocator);
+				unsigned children = level.size() / nodes + (i < level.size() % nodes);
+				inner->count = children - 1;
+				inner->set_child(0, level[next]);
+				parent_lows.push_back(std::move(lows[next]));
+				for (unsigned j = 1; j < children; ++j) {
+					inner->keys[j - 1] = std::move(lows[next + j]);
+					inner->set_child(j, level[next + j]);
+				}
+
+				next += children;
+				parents.push_back(inner);
+			}
+
+			level.swap(parents);
+			lows.swap(parent_lows);
+			parents.clear();
+			parent_lows.clear();
+		}
+
+		return level[0];
+	}
+
+	// Leaf whose key range holds key, root must not be null. bound is set to the separator
+	// the range ends before, null for the last leaf.
+	template<typename K>
+	Leaf *find_leaf(const K &key, const Key *&bound) const
+	{
+		bound = nullptr;
+		auto node = root;
+		while (!node->leaf) {
+			counters.visited();
+			auto inner = static_cast<Inner *>(node);
+			auto index = upper_index(inner->keys, inner->count, key, counters.less<Compare>());
+			if (index < inner->count)
+				bound = &inner->keys[index];
+			node = inner->children[index];
+		}
+
+		counters.visited();
+		return static_cast<Leaf *>(node);
+	}
+
+	template<typename K>
+	Leaf *find_leaf(const K &key) const
+	{
+		const Key *bound;
+		return find_leaf(key, bound);
+	}
+
+	Leaf *leftmost() const
+	{
+		auto node = root;
+		while (!node->leaf)
+			node = static_cast<Inner *>(node)->children[0];
+		return static_cast<Leaf *>(node);
+	}
+
+	Leaf *rightmost() const
+	{
+		auto node = root;
+		while (!node->leaf)
+			node = static_cast<Inner *>(node)->children[node->count];
+		return static_cast<Leaf *>(node);
+	}
+
+	template<typename K>
+	Value *find_impl(const K &key) const
+	{
+		if (!root)
+			return nullptr;
+
+		auto leaf = find_leaf(key);
+		bool found;
+		auto index = search_index(leaf->keys, leaf->count, key, found);
+		if (found)
+			return &leaf->values[index];
+
+		return nullptr;
+	}
+
+	Value *min_impl() const
+	{
+		return root ? &leftmost()->values[0] : nullptr;
+	}
+
+	Value *max_impl() const
+	{
+		if (!root)
+			return nullptr;
+
+		auto leaf = rightmost();
+		return &leaf->values[leaf->count - 1];
+	}
+
+	template<typename KeyT, typename ValueT>
+	static void insert_entry(Leaf *leaf, unsigned index, KeyT &&key, ValueT &&value)
+	{
+		std::move_backward(leaf->keys + index, leaf->keys + leaf->count, leaf->keys + leaf->count + 1);
+		std::move_backward(leaf->values + index, leaf->values + leaf->count, leaf->values + leaf->count + 1);
+		leaf->keys[index] = std::forward<KeyT>(key);
+		leaf->values[index] = std::forward<ValueT>(value);
+		++leaf->count;
+	}
+
+	// Vacated slots are reset so they do not hold on to resources of removed entries
+	static void erase_entry(Leaf *leaf, unsigned index)
+	{
+		std::move(leaf->keys + index + 1, leaf->keys + leaf->count, leaf->keys + index);
+		std::move(leaf->values + index + 1, leaf->values + leaf->count, leaf->values + index);
+		--leaf->count;
+		leaf->keys[leaf->count] = Key();
+		leaf->values[leaf->count] = Value();
+	}
+
+	// Removes keys[index] and children[index + 1]
+	static void erase_child(Inner *inner, unsigned index)
+	{
+		std::move(inner->keys + index + 1, inner->keys + inner->count, inner->keys + index);
+		std::move(inner->children + index + 2, inner->children + inner->count + 1, inner->children + index + 1);
+		--inner->count;
+		inner->keys[inner->count] = Key();
+	}
+
+	template<typename KeyT, typename ValueT>
+	void insert_impl(KeyT &&key, ValueT &&value)
+	{
+		if (!root) {
+			auto leaf = construct(leaf_allocator);
+			insert_entry(leaf, 0, std::forward<KeyT>(key), std::forward<ValueT>(value));
+			root = leaf;
+			return;
+		}
+
+		insert_into_leaf(find_leaf(key), std::forward<KeyT>(key), std::forward<ValueT>(value));
+	}
+
+	// Inserts into leaf, whose key range must hold key. Returns false if the leaf was split.
+	template<typename KeyT, typename ValueT>
+	bool insert_into_leaf(Leaf *leaf, KeyT &&key, ValueT &&value)
+	{
+		bool found;
+		auto index = search_index(leaf->keys, leaf->count, key, found);
+		if (found) {
+			leaf->values[index] = std::forward<ValueT>(value);
+			return true;
+		}
+
+		if (leaf->count < leaf_capacity) {
+			insert_entry(leaf, index, std::forward<KeyT>(key), std::forward<ValueT>(value));
+			return true;
+		}
+
+		// The upper half moves to a new right sibling, the entry goes to whichever half it belongs
+		counters.split();
+		unsigned left_count = (leaf_capacity + 1) / 2;
+		unsigned split = index < left_count ? left_count - 1 : left_count;
+
+		auto right = construct(leaf_allocator);
+		std::move(leaf->keys + split, leaf->keys + leaf->count, right->keys);
+		std::move(leaf->values + split, leaf->values + leaf->count, right->values);
+		right->count = leaf->count - split;
+		leaf->count = split;
+
+		if (index < left_count)
+			insert_entry(leaf, index, std::forward<KeyT>(key), std::forward<ValueT>(value));
+		else
+			insert_entry(right, index - split, std::forward<KeyT>(key), std::forward<ValueT>(value));
+
+		right->next = leaf->next;
+		if (right->next)
+			right->next->prev = right;
+		right->prev = leaf;
+		leaf->next = right;
+
+		insert_into_parent(leaf, right->keys[0], right);
+		return false;
+	}
+
+	// Puts right into the parent of left, just after it, splitting full inner nodes on the way up
+	void insert_into_parent(Node *left, Key separator, Node *right)
+	{
+		// The split of left was the first step
+		for (std::uint64_t steps = 1;; ++steps) {
+			auto parent = left->parent;
+			if (!parent) {
+				auto inner = construct(inner_allocator);
+				inner->keys[0] = std::move(separator);
+				inner->count = 1;
+				inner->set_child(0, left);
+				inner->set_child(1, right);
+				root = inner;
+				counters.cascaded(steps);
+				return;
+			}
+
+			auto index = parent->index_of(left);
+			if (parent->count < fanout - 1) {
+				std::move_backward(parent->keys + index, parent->keys + parent->count, parent->keys + parent->count + 1);
+				std::move_backward(parent->children + index + 1, parent->children + parent->count + 1,
+						parent->children + parent->count + 2);
+				parent->keys[index] = std::move(separator);
+				parent->set_child(index + 1, right);
+				++parent->count;
+				counters.cascaded(steps);
+				return;
+			}
+
+			// Lay out the overfull node, then keep the lower half and move the middle key up
+			counters.split();
+			Key keys[fanout];
+			Node *children[fanout + 1];
+			std::move(parent->keys, parent->keys + index, keys);
+			keys[index] = std::move(separator);
+			std::move(parent->keys + index, parent->keys + parent->count, keys + index + 1);
+			std::copy(parent->children, parent->children + index + 1, children);
+			children[index + 1] = right;
+			std::copy(parent->children + index + 1, parent->children + parent->count + 1, children + index + 2);
+
+			unsigned middle = fanout / 2;
+			auto sibling = construct(inner_allocator);
+
+			std::move(keys, keys + middle, parent->keys);
+			std::fill(parent->keys + middle, parent->keys + parent->count, Key());
+			for (unsigned i = 0; i <= middle; ++i)
+				parent->set_child(i, children[i]);
+			parent->count = middle;
+
+			std::move(keys + middle + 1, keys + fanout, sibling->keys);
+			for (unsigned i = middle + 1; i <= fanout; ++i)
+				sibling->set_child(i - middle - 1, children[i]);
+			sibling->count = fanout - middle - 1;
+
+			separator = std::move(keys[middle]);
+			left = parent;
+			right = sibling;
+		}
+	}
+
+	// Refills a leaf that dropped below half from a sibling or merges it with one
+	void rebalance_leaf(Leaf *leaf)
+	{
+		auto parent = leaf->parent;
+		auto index = parent->index_of(leaf);
+
+		auto left = index > 0 ? static_cast<Leaf *>(parent->children[index - 1]) : nullptr;
+		if (left && left->count > min_leaf_count) {
+			insert_entry(leaf, 0, std::move(left->keys[left->count - 1]), std::move(left->values[left->count - 1]));
+			erase_entry(left, left->count - 1);
+			parent->keys[index - 1] = leaf->keys[0];
+			counters.cascaded(1);
+			return;
+		}
+
+		auto right = index < parent->count ? static_cast<Leaf *>(parent->children[index + 1]) : nullptr;
+		if (right && right->count > min_leaf_count) {
+			insert_entry(leaf, leaf->count, std::move(right->keys[0]), std::move(right->values[0]));
+			erase_entry(right, 0);
+			parent->keys[index] = right->keys[0];
+			counters.cascaded(1);
+			return;
+		}
+
+		if (left) {
+			right = leaf;
+			--index;
+		} else {
+			left = leaf;
+		}
+
+		std::move(right->keys, right->keys + right->count, left->keys + left->count);
+		std::move(right->values, right->values + right->count, left->values + left->count);
+		left->count += right->count;
+		left->next = right->next;
+		if (left->next)
+			left->next->prev = left;
+		destroy(leaf_allocator, right);
+		counters.merged();
+
+		erase_child(parent, index);
+		rebalance_inner(parent, 1);
+	}
+
+	// Same for inner nodes, rotating keys through the parent; merges may cascade to the root.
+	// steps is how many the remove has taken already.
+	void rebalance_inner(Inner *node, std::uint64_t steps)
+	{
+		for (;; ++steps) {
+			auto parent = node->parent;
+			if (!parent) {
+				if (!node->count) {
+					root = node->children[0];
+					root->parent = nullptr;
+					destroy(inner_allocator, node);
+				}
+				counters.cascaded(steps);
+				return;
+			}
+
+			if (node->count >= min_inner_count) {
+				counters.cascaded(steps);
+				return;
+			}
+
+			auto index = parent->index_of(node);
+
+			auto left = index > 0 ? static_cast<Inner *>(parent->children[index - 1]) : nullptr;
+			if (left && left->count > min_inner_count) {
+				std::move_backward(node->keys, node->keys + node->count, node->keys + node->count + 1);
+				std::move_backward(node->children, node->children + node->count + 1, node->children + node->count + 2);
+				node->keys[0] = std::move(parent->keys[index - 1]);
+				node->set_child(0, left->children[left->count]);
+				++node->count;
+
+				parent->keys[index - 1] = std::move(left->keys[left->count - 1]);
+				--left->count;
+				left->keys[left->count] = Key();
+				counters.cascaded(steps + 1);
+				return;
+			}
+
+			auto right = index < parent->count ? static_cast<Inner *>(parent->children[index + 1]) : nullptr;
+			if (right && right->count > min_inner_count) {
+				node->keys[node->count] = std::move(parent->keys[index]);
+				node->set_child(node->count + 1, right->children[0]);
+				++node->count;
+
+				parent->keys[index] = std::move(right->keys[0]);
+				std::move(right->keys + 1, right->keys + right->count, right->keys);
+				std::move(right->children + 1, right->children + right->count + 1, right->children);
+				--right->count;
+				right->keys[right->count] = Key();
+				counters.cascaded(steps + 1);
+				return;
+			}
+
+			if (left) {
+				right = node;
+				--index;
+			} else {
+				left = node;
+			}
+
+			left->keys[left->count] = std::move(parent->keys[index]);
+			std::move(right->keys, right->keys + right->count, left->keys + left->count + 1);
+			for (unsigned i = 0; i <= right->count; ++i)
+				left->set_child(left->count + 1 + i, right->children[i]);
+			left->count += right->count + 1;
+			destroy(inner_allocator, right);
+			counters.merged();
+
+			erase_child(parent, index);
+			node = parent;
+		}
+	}
+
+	bool remove_impl(const Key &key)
+	{
+		if (!root)
+			return false;
+
+		auto leaf = find_leaf(key);
+		bool found;
+		auto index = search_index(leaf->keys, leaf->count, key, found);
+		if (!found)
+			return false;
+
+		erase_entry(leaf, index);
+
+		if (!leaf->parent) {
+			if (!leaf->count) {
+				destroy(leaf_allocator, leaf);
+				root = nullptr;
+			}
+		} else if (leaf->count < min_leaf_count) {
+			rebalance_leaf(leaf);
+		}
+
+		return true;
+	}
+
+	// Each key goes straight into the leaf of the one before while it stays below the separator
+	// ending that leaf's range. The tree is descended again only after a split or past it.
+	template<typename Iterator>
+	void insert_batch_impl(Iterator pairs, const std::vector<std::size_t> &order)
+	{
+		Leaf *leaf = nullptr;
+		const Key *bound = nullptr;
+		for (auto i : order) {
+			if (!root) {
+				insert_impl(pairs[i].first, pairs[i].second);
+				continue;
+			}
+
+			if (leaf && bound) {
+				counters.compared();
+				if (!Compare::less(pairs[i].first, *bound))
+					leaf = nullptr;
+			}
+			if (!leaf)
+				leaf = find_leaf(pairs[i].first, bound);
+			if (!insert_into_leaf(leaf, pairs[i].first, pairs[i].second))
+				leaf = nullptr;
+		}
+	}
+
+	// Splits the run of keys, which is in key order, by the children of node: one search among
+	// the separators for the child of the first key, one search of the run for the keys that
+	// share that child. Each leaf is then searched from where the previous key was found.
+	void find_sorted(Node *node, const Key *keys, const std::size_t *first, const std::size_t *last, Value **out) const
+	{
+		counters.visited();
+		if (node->leaf) {
+			auto leaf = static_cast<Leaf *>(node);
+			unsigned index = 0;
+			for (; first != last; ++first) {
+				bool found;
+				index += search_index(leaf->keys + index, leaf->count - index, keys[*first], found);
+				if (found)
+					out[*first] = &leaf->values[index];
+			}
+			return;
+		}
+
+		auto inner = static_cast<Inner *>(node);
+		while (first != last) {
+			auto child = upper_index(inner->keys, inner->count, keys[*first], counters.less<Compare>());
+			auto end = last;
+			if (child < inner->count) {
+				auto &separator = inner->keys[child];
+				end = std::partition_point(first + 1, last, [&](std::size_t i) {
+					counters.compared();
+					return Compare::less(keys[i], separator);
+				});
+			}
+
+			find_sorted(inner->children[child], keys, first, end, out);
+			first = end;
+		}
+	}
+
+	void print_node(std::ostream &stream, const Node *node, const std::string &prefix, bool tail) const
+	{
+	#ifdef _WIN32
+		static const std::string prefix1 = { (char)192, (char)196, (char)196, (char) 32, 0 }; // "└── "
+		static const std::string prefix2 = { (char)195, (char)196, (char)196, (char) 32, 0 }; // "├── "
+		static const std::string prefix3 = { (char) 32, (char) 32, (char) 32, (char) 32, 0 }; // "    "
+		static const std::string prefix4 = { (char)179, (char) 32, (char) 32, (char) 32, 0 }; // "│   "
+	#else
+		static const std::string prefix1 = "└── ";
+		static const std::string prefix2 = "├── ";
+		static const std::string prefix3 = "    ";
+		static const std::string prefix4 = "│   ";
+	#endif
+
+		auto keys = node->leaf ? static_cast<const Leaf *>(node)->keys : static_cast<const Inner *>(node)->keys;
+		stream << prefix << (tail ? prefix1 : prefix2);
+		for (unsigned i = 0; i < node->count; ++i)
+			stream << (i ? "|" : "") << keys[i];
+		stream << '\n';
+
+		if (node->leaf)
+			return;
+
+		auto inner = static_cast<const Inner *>(node);
+		for (unsigned i = inner->count + 1; i-- > 0; )
+			print_node(stream, inner->children[i], prefix + (tail ? prefix3 : prefix4), i == 0);
+	}
+
+	using typename OrderedTree<BPlusTree, Key, Value, Compare>::Position;
+
+	Position first_position() const
+	{
+		return Position{root ? leftmost() : nullptr, 0};
+	}
+
+	template<typename K>
+	Position lower_bound_position(const K &key) const
+	{
+		if (!root)
+			return Position{nullptr, 0};
+
+		auto leaf = find_leaf(key);
+		auto index = lower_index(leaf->keys, leaf->count, key);
+		if (index == leaf->count)
+			return Position{leaf->next, 0};
+
+		return Position{leaf, index};
+	}
+
+	template<typename K>
+	Position upper_bound_position(const K &key) const
+	{
+		if (!root)
+			return Position{nullptr, 0};
+
+		auto leaf = find_leaf(key);
+		auto index = upper_index(leaf->keys, leaf->count, key);
+		if (index == leaf->count)
+			return Position{leaf->next, 0};
+
+		return Position{leaf, index};
+	}
+
+	void next_position(Position &position) const
+	{
+		auto leaf = static_cast<Leaf *>(position.node);
+		if (++position.index == leaf->count)
+			position = Position{leaf->next, 0};
+	}
+
+	void prev_position(Position &position) const
+	{
+		auto leaf = static_cast<Leaf *>(position.node);
+		if (!leaf)
+			leaf = root ? rightmost() : nullptr;
+		else if (position.index > 0) {
+			--position.index;
+			return;
+		} else {
+			leaf = leaf->prev;
+		}
+
+		position = Position{leaf, leaf ? leaf->count - 1 : 0};
+	}
+
+	const Key &key_at(const Position &position) const
+	{
+		return static_cast<Leaf *>(position.node)->keys[position.index];
+	}
+
+	Value &value_at(const Position &position) const
+	{
+		return static_cast<Leaf *>(position.node)->values[position.index];
+	}
+
+public:
+	using key_type = Key;
+	using mapped_type = Value;
+	using key_compare = Compare;
+
+	BPlusTree()
+		: root(nullptr)
+	{}
+
+	BPlusTree(const BPlusTree &) = delete;
+	BPlusTree &operator=(const BPlusTree &) = delete;
+
+	~BPlusTree()
+	{
+		// Pooled nodes go away together with their chunks, only keys and values may need destructors
+		if (root && (!Allocator<Leaf>::releases_all || !std::is_trivially_destructible<Key>::value
+				|| !std::is_trivially_destructible<Value>::value))
+			destroy_subtree(root);
+	}
+
+	static SearchTreePtr<Key, Value, Compare> create()
+	{
+		return std::unique_ptr<SearchTreeAdapter<BPlusTree>>(new SearchTreeAdapter<BPlusTree>());
+	}
+
+	// Replaces the contents with a snapshot written by save(), in linear time. Returns false
+	// and keeps the current contents if the file is missing, damaged or out of key order.
+	bool load(const std::string &path)
+	{
+		SnapshotReader<Key, Value> reader(path);
+		if (!reader.ok())
+			return false;
+
+		auto old_root = root;
+		root = build(reader.begin(), reader.size());
+		if (!reader.finished() || !keys_strictly_increasing<Compare>(this->begin(), this->end())) {
+			if (root)
+				destroy_subtree(root);
+			root = old_root;
+			return false;
+		}
+
+		if (old_root)
+			destroy_subtree(old_root);
+		return true;
+	}
+
+	void insert(const Key &key, const Value &value)
+	{
+		insert_impl(key, value);
+	}
+
+	void insert(const Key &key, Value &&value)
+	{
+		insert_impl(key, std::move(value));
+	}
+
+	void insert(Key &&key, const Value &value)
+	{
+		insert_impl(std::move(key), value);
+	}
+
+	void insert(Key &&key, Value &&value)
+	{
+		insert_impl(std::move(key), std::move(value));
+	}
+
+	Value *find(const Key &key)
+	{
+		return find_impl(key);
+	}
+
+	const Value *find(const Key &key) const
+	{
+		return find_impl(key);
+	}
+
+	// Lookup by any type Compare orders against Key, when Compare is transparent
+	template<typename K, typename C = Compare, typename = typename C::is_transparent>
+	Value *find(const K &key)
+	{
+		return find_impl(key);
+	}
+
+	template<typename K, typename C = Compare, typename = typename C::is_transparent>
+	const Value *find(const K &key) const
+	{
+		return find_impl(key);
+	}
+
+	void insert_batch(const std::vector<std::pair<Key, Value>> &pairs)
+	{
+		insert_batch_impl(pairs.begin(), sorted_order(pairs, KeyLess<Compare>()));
+	}
+
+	void insert_batch(std::vector<std::pair<Key, Value>> &&pairs)
+	{
+		insert_batch_impl(std::make_move_iterator(pairs.begin()), sorted_order(pairs, KeyLess<Compare>()));
+	}
+
+	void find_batch(const std::vector<Key> &keys, std::vector<Value *> &out)
+	{
+		auto order = sorted_order(keys, CompareLess<Compare>());
+		out.assign(keys.size(), nullptr);
+		if (root)
+			find_sorted(root, keys.data(), order.data(), order.data() + order.size(), out.data());
+	}
+
+	Value *min()
+	{
+		return min_impl();
+	}
+
+	const Value *min() const
+	{
+		return min_impl();
+	}
+
+	Value *max()
+	{
+		return max_impl();
+	}
+
+	const Value *max() const
+	{
+		return max_impl();
+	}
+
+	bool remove(const Key &key)
+	{
+		return remove_impl(key);
+	}
+
+	// Counters since creation or the last reset_stats(), see stats.hpp
+	TreeStats stats() const
+	{
+		auto result = counters.get();
+		for (auto node = root; node; node = node->leaf ? nullptr : static_cast<Inner *>(node)->children[0])
+			++result.height;
+		return result;
+	}
+
+	void reset_stats()
+	{
+		counters.reset();
+	}
+
+	// Walks the whole tree, see memory-usage.hpp
+	MemoryUsage memory_usage() const
+	{
+		MemoryUsage usage;
+		if (root)
+			add_usage(root, usage);
+		return usage;
+	}
+
+	void print(std::ostream &stream) const
+	{
+		if (root)
+			print_node(stream, root, "", true);
+		else
+			stream << "Empty tree";
+		stream << '\n';
+	}
+};
+
+} // namespace search_trees
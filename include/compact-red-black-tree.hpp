@@ -0,0 +1,779 @@
+#pragma once
+
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "search-tree.hpp"
+#include "memory-usage.hpp"
+#include "node-vector.hpp"
+#include "snapshot.hpp"
+#include "stats.hpp"
+#include "util.hpp"
+
+#ifdef min
+#undef min
+#endif
+
+#ifdef max
+#undef max
+#endif
+
+namespace search_trees
+{
+
+// Red-black tree whose nodes sit in one vector and link to each other by 32-bit indices,
+// with the color in the top bit of the parent index. A node is its key, its value and 12
+// bytes, where a RedBlackTree node spends 32 on a 64-bit machine. Links are not addresses,
+// so copying the tree copies one vector, byte for byte with trivially copyable keys and
+// values. Keys and values must be default-constructible; up to 2^31 - 1 entries.
+//
+// An insert may move every entry, so the pointers find(), min() and max() return only last
+// until the next insert. Iterators stay valid until their entry is removed.
+template<typename Key, typename Value, typename Compare = ThreeWayCompare>
+class CompactRedBlackTree final: public OrderedTree<CompactRedBlackTree<Key, Value, Compare>, Key, Value, Compare>
+{
+	friend class OrderedTree<CompactRedBlackTree, Key, Value, Compare>;
+	friend class TreeIterator<CompactRedBlackTree, Key, Value>;
+	friend class TreeIterator<CompactRedBlackTree, Key, const Value>;
+	friend class SearchTreeAdapter<CompactRedBlackTree>;
+
+	using Index = std::uint32_t;
+
+	static constexpr Index none = 0;
+	static constexpr Index red_bit = Index(1) << 31;
+
+	struct Node
+	{
+		Key key;
+		Value value;
+		Index left, right;
+
+		// Parent, with red_bit set for a red node
+		Index parent_color;
+
+		Node()
+			: key()
+			, value()
+			, left(none)
+			, right(none)
+			, parent_color(none)
+		{}
+
+		template<typename KeyT, typename ValueT>
+		Node(KeyT &&key, ValueT &&value)
+			: key(std::forward<KeyT>(key))
+			, value(std::forward<ValueT>(value))
+			, left(none)
+			, right(none)
+			, parent_color(red_bit)
+		{}
+
+		Index parent() const
+		{
+			return parent_color & ~red_bit;
+		}
+
+		void set_parent(Index node)
+		{
+			parent_color = (parent_color & red_bit) | node;
+		}
+
+		// The sentinel is black, so missing children count as black
+		bool is_red() const
+		{
+			return parent_color & red_bit;
+		}
+
+		void set_red(bool red)
+		{
+			parent_color = red ? parent_color | red_bit : parent_color & ~red_bit;
+		}
+	};
+
+	NodeVector<Node, red_bit - 1> nodes;
+	Index root;
+	mutable OperationCounters counters;
+
+	void set_left(Index node, Index child)
+	{
+		nodes[node].left = child;
+		if (child != none)
+			nodes[child].set_parent(node);
+	}
+
+	void set_right(Index node, Index child)
+	{
+		nodes[node].right = child;
+		if (child != none)
+			nodes[child].set_parent(node);
+	}
+
+	// Puts the subtree of replacement where the subtree of node was. The parent is set even
+	// on the sentinel, which remove_double_blackness() climbs from when a leaf goes.
+	void transplant(Index node, Index replacement)
+	{
+		auto parent = nodes[node].parent();
+		if (parent == none)
+			root = replacement;
+		else if (node == nodes[parent].left)
+			nodes[parent].left = replacement;
+		else
+			nodes[parent].right = replacement;
+		nodes[replacement].set_parent(parent);
+	}
+
+	void rotate_left(Index node)
+	{
+		counters.rotated();
+		auto right = nodes[node].right;
+		set_right(node, nodes[right].left);
+		transplant(node, right);
+		set_left(right, node);
+	}
+
+	void rotate_right(Index node)
+	{
+		counters.rotated();
+		auto left = nodes[node].left;
+		set_left(node, nodes[left].right);
+		transplant(node, left);
+		set_right(left, node);
+	}
+
+	Index min_of(Index node) const
+	{
+		while (nodes[node].left != none)
+			node = nodes[node].left;
+		return node;
+	}
+
+	Index max_of(Index node) const
+	{
+		while (nodes[node].right != none)
+			node = nodes[node].right;
+		return node;
+	}
+
+	Index successor(Index node) const
+	{
+		if (nodes[node].right != none)
+			return min_of(nodes[node].right);
+
+		auto parent = nodes[node].parent();
+		for (; parent != none && node == nodes[parent].right; node = parent, parent = nodes[node].parent());
+		return parent;
+	}
+
+	Index predecessor(Index node) const
+	{
+		if (nodes[node].left != none)
+			return max_of(nodes[node].left);
+
+		auto parent = nodes[node].parent();
+		for (; parent != none && node == nodes[parent].left; node = parent, parent = nodes[node].parent());
+		return parent;
+	}
+
+	template<typename K>
+	Index find_node(const K &key) const
+	{
+		auto node = root;
+		while (node != none) {
+			counters.visited();
+			counters.compared();
+			auto order = Compare::compare(key, nodes[node].key);
+			if (order == 0)
+				return node;
+			node = order < 0 ? nodes[node].left : nodes[node].right;
+		}
+
+		return none;
+	}
+
+	template<typename K>
+	Value *find_impl(const K &key) const
+	{
+		auto node = find_node(key);
+		return node != none ? value_of(node) : nullptr;
+	}
+
+	Value *value_of(Index node) const
+	{
+		return &const_cast<CompactRedBlackTree *>(this)->nodes[node].value;
+	}
+
+	template<typename KeyT, typename ValueT>
+	void insert_impl(KeyT &&key, ValueT &&value)
+	{
+		insert_impl(std::forward<KeyT>(key), std::forward<ValueT>(value), root);
+	}
+
+	// Inserts with the descent starting at start, whose subtree must span key.
+	// Returns the node now holding key.
+	template<typename KeyT, typename ValueT>
+	Index insert_impl(KeyT &&key, ValueT &&value, Index start)
+	{
+		Index parent = none;
+		bool left = false;
+		for (auto node = start; node != none;) {
+			counters.visited();
+			counters.compared();
+			auto order = Compare::compare(key, nodes[node].key);
+			if (order == 0) {
+				nodes[node].value = std::forward<ValueT>(value);
+				return node;
+			}
+			parent = node;
+			left = order < 0;
+			node = left ? nodes[node].left : nodes[node].right;
+		}
+
+		auto node = nodes.allocate(std::forward<KeyT>(key), std::forward<ValueT>(value));
+		if (parent == none) {
+			root = node;
+		} else if (left) {
+			set_left(parent, node);
+		} else {
+			set_right(parent, node);
+		}
+		resolve_red_red_violation(node);
+		return node;
+	}
+
+	// Lowest ancestor of node whose subtree spans key, given that key is above everything left of node
+	Index ancestor_spanning(Index node, const Key &key) const
+	{
+		for (auto parent = nodes[node].parent(); parent != none; node = parent, parent = nodes[parent].parent()) {
+			if (node == nodes[parent].left && Compare::less(key, nodes[parent].key))
+				break;
+		}
+
+		return node;
+	}
+
+	template<typename Iterator>
+	void insert_batch_impl(Iterator pairs, const std::vector<std::size_t> &order)
+	{
+		Index finger = none;
+		for (auto i : order) {
+			auto start = finger != none ? ancestor_spanning(finger, pairs[i].first) : root;
+			finger = insert_impl(pairs[i].first, pairs[i].second, start);
+		}
+	}
+
+	// Splits the run of keys at every node while more than one key shares the way down.
+	// Single keys are left in descents to finish afterwards.
+	void find_sorted(Index node, const Key *keys, const std::size_t *first, const std::size_t *last, Value **out,
+			std::vector<std::pair<Index, std::size_t>> &descents) const
+	{
+		while (node != none && last - first > 1) {
+			auto equal = equal_run<Compare>(keys, first, last, nodes[node].key);
+			for (auto it = equal.first; it != equal.second; ++it)
+				out[*it] = value_of(node);
+
+			if (first != equal.first)
+				find_sorted(nodes[node].left, keys, first, equal.first, out, descents);
+			node = nodes[node].right;
+			first = equal.second;
+		}
+
+		if (node != none && first != last)
+			descents.emplace_back(node, *first);
+	}
+
+	// Walks all descents down together, one level per round, so that the cache misses of
+	// independent lookups overlap instead of following one another
+	void find_interleaved(std::vector<std::pair<Index, std::size_t>> &descents, const Key *keys, Value **out) const
+	{
+		while (!descents.empty()) {
+			std::size_t active = 0;
+			for (auto &descent : descents) {
+				auto node = descent.first;
+				auto &key = keys[descent.second];
+				auto order = Compare::compare(key, nodes[node].key);
+				if (order == 0) {
+					out[descent.second] = value_of(node);
+					continue;
+				}
+
+				node = order < 0 ? nodes[node].left : nodes[node].right;
+				if (node != none)
+					descents[active++] = std::make_pair(node, descent.second);
+			}
+			descents.resize(active);
+		}
+	}
+
+	void resolve_red_red_violation(Index node)
+	{
+		std::uint64_t steps = 0;
+		for (;;) {
+			auto parent = nodes[node].parent();
+			if (!nodes[parent].is_red())
+				break;
+
+			// A red parent is not the root
+			auto grandparent = nodes[parent].parent();
+			bool left = parent == nodes[grandparent].left;
+			auto uncle = left ? nodes[grandparent].right : nodes[grandparent].left;
+			++steps;
+			if (nodes[uncle].is_red()) {
+				counters.red_red_fixed();
+				nodes[parent].set_red(false);
+				nodes[uncle].set_red(false);
+				nodes[grandparent].set_red(true);
+				node = grandparent;
+				continue;
+			}
+
+			if (left && node == nodes[parent].right) {
+				rotate_left(parent);
+				std::swap(node, parent);
+			} else if (!left && node == nodes[parent].left) {
+				rotate_right(parent);
+				std::swap(node, parent);
+			}
+
+			nodes[parent].set_red(false);
+			nodes[grandparent].set_red(true);
+			if (left)
+				rotate_right(grandparent);
+			else
+				rotate_left(grandparent);
+			break;
+		}
+
+		nodes[root].set_red(false);
+		counters.cascaded(steps);
+	}
+
+	bool remove_impl(const Key &key)
+	{
+		auto node = find_node(key);
+		if (node == none)
+			return false;
+
+		// Child is what takes the place of the node leaving its position, the sentinel if none
+		Index child;
+		bool removed_red;
+		if (nodes[node].left == none || nodes[node].right == none) {
+			child = nodes[node].left != none ? nodes[node].left : nodes[node].right;
+			removed_red = nodes[node].is_red();
+			transplant(node, child);
+		} else {
+			auto successor = min_of(nodes[node].right);
+			child = nodes[successor].right;
+			removed_red = nodes[successor].is_red();
+			if (nodes[successor].parent() == node) {
+				nodes[child].set_parent(successor);
+			} else {
+				transplant(successor, child);
+				set_right(successor, nodes[node].right);
+			}
+			transplant(node, successor);
+			set_left(successor, nodes[node].left);
+			nodes[successor].set_red(nodes[node].is_red());
+		}
+
+		nodes.deallocate(node);
+		if (!removed_red)
+			remove_double_blackness(child);
+		return true;
+	}
+
+	// Node carries an extra black, which moves up until a red node or a rotation takes it
+	void remove_double_blackness(Index node)
+	{
+		std::uint64_t steps = 0;
+		while (node != root && !nodes[node].is_red()) {
+			counters.double_black_fixed();
+			++steps;
+
+			auto parent = nodes[node].parent();
+			bool left = node == nodes[parent].left;
+			auto sibling = left ? nodes[parent].right : nodes[parent].left;
+			if (nodes[sibling].is_red()) {
+				nodes[sibling].set_red(false);
+				nodes[parent].set_red(true);
+				if (left)
+					rotate_left(parent);
+				else
+					rotate_right(parent);
+				sibling = left ? nodes[parent].right : nodes[parent].left;
+			}
+
+			auto near = left ? nodes[sibling].left : nodes[sibling].right;
+			auto far = left ? nodes[sibling].right : nodes[sibling].left;
+			if (!nodes[near].is_red() && !nodes[far].is_red()) {
+				nodes[sibling].set_red(true);
+				node = parent;
+				continue;
+			}
+
+			if (!nodes[far].is_red()) {
+				nodes[near].set_red(false);
+				nodes[sibling].set_red(true);
+				if (left)
+					rotate_right(sibling);
+				else
+					rotate_left(sibling);
+				far = sibling;
+				sibling = near;
+			}
+
+			nodes[sibling].set_red(nodes[parent].is_red());
+			nodes[parent].set_red(false);
+			nodes[far].set_red(false);
+			if (left)
+				rotate_left(parent);
+			else
+				rotate_right(parent);
+			node = root;
+		}
+
+		nodes[node].set_red(false);
+		counters.cascaded(steps);
+	}
+
+	// Perfectly balanced subtree of the next count entries from it, with only the last and
+	// incomplete level red, the same shape RedBlackTree builds. Nodes go into the vector in
+	// key order, so a scan reads it front to back.
+	template<typename Iterator>
+	Index build_subtree(Iterator &it, std::size_t count, unsigned depth, unsigned red_depth)
+	{
+		if (!count)
+			return none;
+
+		auto left = build_subtree(it, (count - 1) / 2, depth + 1, red_depth);
+		auto node = nodes.allocate((*it).first, (*it).second);
+		++it;
+		nodes[node].set_red(depth == red_depth);
+		set_left(node, left);
+		set_right(node, build_subtree(it, count - 1 - (count - 1) / 2, depth + 1, red_depth));
+		return node;
+	}
+
+	template<typename Iterator>
+	void build(Iterator it, std::size_t count)
+	{
+		unsigned red_depth = 0;
+		while ((std::size_t(2) << red_depth) - 1 <= count)
+			++red_depth;
+
+		nodes.reserve(count);
+		root = build_subtree(it, count, 0, red_depth);
+	}
+
+	unsigned height_of(Index node) const
+	{
+		return node != none ? 1 + std::max(height_of(nodes[node].left), height_of(nodes[node].right)) : 0;
+	}
+
+	void add_usage(Index node, MemoryUsage &usage) const
+	{
+		if (node == none)
+			return;
+
+		usage.add_entry(nodes[node].key, nodes[node].value, false);
+		usage.add_node(sizeof(Node), sizeof(Key) + sizeof(Value));
+		add_usage(nodes[node].left, usage);
+		add_usage(nodes[node].right, usage);
+	}
+
+	void print_node(std::ostream &stream, Index node) const
+	{
+		if (nodes[node].is_red()) {
+			if (&stream == &std::cout) {
+			#ifdef _WIN32
+				HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+				SetConsoleTextAttribute(hConsole, 12);
+				stream << nodes[node].key;
+				SetConsoleTextAttribute(hConsole, 15);
+			#else
+				stream << "\033[31m" << nodes[node].key << "\033[0m";
+			#endif
+			} else {
+				stream << nodes[node].key << " (red)";
+			}
+		} else {
+			stream << nodes[node].key;
+		}
+	}
+
+	void print(std::ostream &stream, Index node, const std::string &prefix, bool tail) const
+	{
+	#ifdef _WIN32
+		static const std::string prefix1 = { (char)192, (char)196, (char)196, (char) 32, 0 }; // "└── "
+		static const std::string prefix2 = { (char)195, (char)196, (char)196, (char) 32, 0 }; // "├── "
+		static const std::string prefix3 = { (char) 32, (char) 32, (char) 32, (char) 32, 0 }; // "    "
+		static const std::string prefix4 = { (char)179, (char) 32, (char) 32, (char) 32, 0 }; // "│   "
+	#else
+		static const std::string prefix1 = "└── ";
+		static const std::string prefix2 = "├── ";
+		static const std::string prefix3 = "    ";
+		static const std::string prefix4 = "│   ";
+	#endif
+
+		stream << prefix << (tail ? prefix1 : prefix2);
+		print_node(stream, node);
+		stream << '\n';
+
+		auto left = nodes[node].left, right = nodes[node].right;
+		if (right != none)
+			print(stream, right, prefix + (tail ? prefix3 : prefix4), left == none);
+		if (left != none)
+			print(stream, left, prefix + (tail ? prefix3 : prefix4), true);
+	}
+
+	using typename OrderedTree<CompactRedBlackTree, Key, Value, Compare>::Position;
+
+	// The index of the node goes into the position, which stays put when the vector moves
+	Position position_of(Index node) const
+	{
+		return node != none ? Position{const_cast<CompactRedBlackTree *>(this), node} : Position{nullptr, 0};
+	}
+
+	Position first_position() const
+	{
+		return root != none ? position_of(min_of(root)) : Position{nullptr, 0};
+	}
+
+	template<typename K>
+	Position lower_bound_position(const K &key) const
+	{
+		Index bound = none;
+		for (auto node = root; node != none;) {
+			if (Compare::less(nodes[node].key, key)) {
+				node = nodes[node].right;
+			} else {
+				bound = node;
+				node = nodes[node].left;
+			}
+		}
+
+		return position_of(bound);
+	}
+
+	template<typename K>
+	Position upper_bound_position(const K &key) const
+	{
+		Index bound = none;
+		for (auto node = root; node != none;) {
+			if (Compare::less(key, nodes[node].key)) {
+				bound = node;
+				node = nodes[node].left;
+			} else {
+				node = nodes[node].right;
+			}
+		}
+
+		return position_of(bound);
+	}
+
+	void next_position(Position &position) const
+	{
+		position = position_of(successor(position.index));
+	}
+
+	void prev_position(Position &position) const
+	{
+		if (position.node)
+			position = position_of(predecessor(position.index));
+		else if (root != none)
+			position = position_of(max_of(root));
+	}
+
+	const Key &key_at(const Position &position) const
+	{
+		return nodes[position.index].key;
+	}
+
+	Value &value_at(const Position &position) const
+	{
+		return *value_of(position.index);
+	}
+
+public:
+	using key_type = Key;
+	using mapped_type = Value;
+	using key_compare = Compare;
+	using typename OrderedTree<CompactRedBlackTree, Key, Value, Compare>::iterator;
+
+	CompactRedBlackTree()
+		: root(none)
+	{}
+
+	static SearchTreePtr<Key, Value, Compare> create()
+	{
+		return std::unique_ptr<SearchTreeAdapter<CompactRedBlackTree>>(new SearchTreeAdapter<CompactRedBlackTree>());
+	}
+
+	// Replaces the contents with (key, value) pairs in linear time. Input that is not sorted
+	// by key, or repeats a key, is sorted and deduplicated into a temporary copy first.
+	template<typename ForwardIterator>
+	void assign_sorted(ForwardIterator begin, ForwardIterator end)
+	{
+		nodes.clear();
+		if (keys_strictly_increasing<Compare>(begin, end)) {
+			build(begin, std::distance(begin, end));
+		} else {
+			auto entries = sorted_by_key<Key, Value, Compare>(begin, end);
+			build(std::make_move_iterator(entries.begin()), entries.size());
+		}
+	}
+
+	template<typename ForwardIterator>
+	static SearchTreePtr<Key, Value, Compare> build_from_sorted(ForwardIterator begin, ForwardIterator end)
+	{
+		std::unique_ptr<SearchTreeAdapter<CompactRedBlackTree>> tree(new SearchTreeAdapter<CompactRedBlackTree>());
+		tree->get().assign_sorted(begin, end);
+		return tree;
+	}
+
+	// Replaces the contents with a snapshot written by save(), in linear time. Returns false
+	// and keeps the current contents if the file is missing, damaged or out of key order.
+	bool load(const std::string &path)
+	{
+		SnapshotReader<Key, Value> reader(path);
+		if (!reader.ok())
+			return false;
+
+		CompactRedBlackTree loaded;
+		loaded.build(reader.begin(), reader.size());
+		if (!reader.finished() || !keys_strictly_increasing<Compare>(loaded.begin(), loaded.end()))
+			return false;
+
+		nodes.swap(loaded.nodes);
+		root = loaded.root;
+		return true;
+	}
+
+	void insert(const Key &key, const Value &value)
+	{
+		insert_impl(key, value);
+	}
+
+	void insert(const Key &key, Value &&value)
+	{
+		insert_impl(key, std::move(value));
+	}
+
+	void insert(Key &&key, const Value &value)
+	{
+		insert_impl(std::move(key), value);
+	}
+
+	void insert(Key &&key, Value &&value)
+	{
+		insert_impl(std::move(key), std::move(value));
+	}
+
+	Value *find(const Key &key)
+	{
+		return find_impl(key);
+	}
+
+	const Value *find(const Key &key) const
+	{
+		return find_impl(key);
+	}
+
+	// Lookup by any type Compare orders against Key, when Compare is transparent
+	template<typename K, typename C = Compare, typename = typename C::is_transparent>
+	Value *find(const K &key)
+	{
+		return find_impl(key);
+	}
+
+	template<typename K, typename C = Compare, typename = typename C::is_transparent>
+	const Value *find(const K &key) const
+	{
+		return find_impl(key);
+	}
+
+	void insert_batch(const std::vector<std::pair<Key, Value>> &pairs)
+	{
+		insert_batch_impl(pairs.begin(), sorted_order(pairs, KeyLess<Compare>()));
+	}
+
+	void insert_batch(std::vector<std::pair<Key, Value>> &&pairs)
+	{
+		insert_batch_impl(std::make_move_iterator(pairs.begin()), sorted_order(pairs, KeyLess<Compare>()));
+	}
+
+	void find_batch(const std::vector<Key> &keys, std::vector<Value *> &out)
+	{
+		auto order = sorted_order(keys, CompareLess<Compare>());
+		out.assign(keys.size(), nullptr);
+		std::vector<std::pair<Index, std::size_t>> descents;
+		find_sorted(root, keys.data(), order.data(), order.data() + order.size(), out.data(), descents);
+		find_interleaved(descents, keys.data(), out.data());
+	}
+
+	Value *min()
+	{
+		return root != none ? value_of(min_of(root)) : nullptr;
+	}
+
+	const Value *min() const
+	{
+		return root != none ? value_of(min_of(root)) : nullptr;
+	}
+
+	Value *max()
+	{
+		return root != none ? value_of(max_of(root)) : nullptr;
+	}
+
+	const Value *max() const
+	{
+		return root != none ? value_of(max_of(root)) : nullptr;
+	}
+
+	bool remove(const Key &key)
+	{
+		return remove_impl(key);
+	}
+
+	// Counters since creation or the last reset_stats(), see stats.hpp. The height takes
+	// a walk over the whole tree.
+	TreeStats stats() const
+	{
+		auto result = counters.get();
+		result.height = height_of(root);
+		return result;
+	}
+
+	void reset_stats()
+	{
+		counters.reset();
+	}
+
+	// Walks the whole tree, see memory-usage.hpp. Slots freed by removes and waiting to be
+	// reused are not counted, like pool blocks.
+	MemoryUsage memory_usage() const
+	{
+		MemoryUsage usage;
+		add_usage(root, usage);
+		return usage;
+	}
+
+	void print(std::ostream &stream) const
+	{
+		if (root != none)
+			print(stream, root, "", true);
+		else
+			stream << "Empty tree";
+		stream << '\n';
+	}
+};
+
+} // namespace search_trees
@@ -0,0 +1,992 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "search-tree.hpp"
+#include "memory-usage.hpp"
+#include "node-vector.hpp"
+#include "snapshot.hpp"
+#include "stats.hpp"
+#include "util.hpp"
+
+#ifdef min
+#undef min
+#endif
+
+#ifdef max
+#undef max
+#endif
+
+namespace search_trees
+{
+
+// 2-3 tree whose nodes sit in one vector and link to each other by 32-bit indices, with the
+// 3-node flag in the top bit of the parent index. A node is room for two entries and 16
+// bytes, where a TwoThreeTree node spends 40 on a 64-bit machine. Links are not addresses,
+// so copying the tree copies one vector, byte for byte with trivially copyable keys and
+// values. Keys and values must be default-constructible; up to 2^31 - 1 nodes.
+//
+// An insert may move every entry, so the pointers find(), min() and max() return only last
+// until the next insert. Inserts and removes move entries between nodes, so they
+// invalidate iterators.
+template<typename Key, typename Value, typename Compare = ThreeWayCompare>
+class CompactTwoThreeTree final: public OrderedTree<CompactTwoThreeTree<Key, Value, Compare>, Key, Value, Compare>
+{
+	friend class OrderedTree<CompactTwoThreeTree, Key, Value, Compare>;
+	friend class TreeIterator<CompactTwoThreeTree, Key, Value>;
+	friend class TreeIterator<CompactTwoThreeTree, Key, const Value>;
+	friend class SearchTreeAdapter<CompactTwoThreeTree>;
+
+	using Index = std::uint32_t;
+	using Entry = std::pair<Key, Value>;
+
+	static constexpr Index none = 0;
+	static constexpr Index three_bit = Index(1) << 31;
+
+	// Keys side by side, so that a descent reads both from one cache line
+	struct Node
+	{
+		Key lkey, rkey;
+		Value lvalue, rvalue;
+		Index left, middle, right;
+
+		// Parent, with three_bit set for a 3-node. The right entry of a 2-node is unused.
+		Index parent_three;
+
+		Node()
+			: lkey()
+			, rkey()
+			, lvalue()
+			, rvalue()
+			, left(none)
+			, middle(none)
+			, right(none)
+			, parent_three(none)
+		{}
+
+		explicit Node(Entry &&entry)
+			: lkey(std::move(entry.first))
+			, rkey()
+			, lvalue(std::move(entry.second))
+			, rvalue()
+			, left(none)
+			, middle(none)
+			, right(none)
+			, parent_three(none)
+		{}
+
+		Index parent() const
+		{
+			return parent_three & ~three_bit;
+		}
+
+		void set_parent(Index node)
+		{
+			parent_three = (parent_three & three_bit) | node;
+		}
+
+		bool is_three() const
+		{
+			return parent_three & three_bit;
+		}
+
+		bool is_leaf() const
+		{
+			return left == none;
+		}
+
+		Entry take_ldata()
+		{
+			return Entry(std::move(lkey), std::move(lvalue));
+		}
+
+		void set_ldata(Entry &&entry)
+		{
+			lkey = std::move(entry.first);
+			lvalue = std::move(entry.second);
+		}
+
+		Entry take_rdata()
+		{
+			parent_three &= ~three_bit;
+			return Entry(std::move(rkey), std::move(rvalue));
+		}
+
+		void set_rdata(Entry &&entry)
+		{
+			rkey = std::move(entry.first);
+			rvalue = std::move(entry.second);
+			parent_three |= three_bit;
+		}
+
+		const Key &last_key() const
+		{
+			return is_three() ? rkey : lkey;
+		}
+	};
+
+	NodeVector<Node, three_bit - 1> nodes;
+	Index root;
+	mutable OperationCounters counters;
+
+	// An entry is a node with true for the left (ldata) entry, false for the right one
+	using EntryRef = std::pair<Index, bool>;
+
+	// Past the last entry
+	static EntryRef no_entry()
+	{
+		return EntryRef(Index(none), false);
+	}
+
+	void set_left(Index node, Index child)
+	{
+		nodes[node].left = child;
+		if (child != none)
+			nodes[child].set_parent(node);
+	}
+
+	void set_middle(Index node, Index child)
+	{
+		nodes[node].middle = child;
+		if (child != none)
+			nodes[child].set_parent(node);
+	}
+
+	void set_right(Index node, Index child)
+	{
+		nodes[node].right = child;
+		if (child != none)
+			nodes[child].set_parent(node);
+	}
+
+	// Empties link, returning the child it held
+	static Index unlink(Index &link)
+	{
+		auto child = link;
+		link = none;
+		return child;
+	}
+
+	Index min_of(Index node) const
+	{
+		while (nodes[node].left != none)
+			node = nodes[node].left;
+		return node;
+	}
+
+	Index max_of(Index node) const
+	{
+		while (nodes[node].right != none)
+			node = nodes[node].right;
+		return node;
+	}
+
+	EntryRef max_entry(Index node) const
+	{
+		node = max_of(node);
+		return EntryRef(node, !nodes[node].is_three());
+	}
+
+	// In-order neighbours of an entry, in the form find_entry() returns
+	EntryRef successor(EntryRef entry) const
+	{
+		auto node = entry.first;
+		auto ldata = entry.second;
+		auto &n = nodes[node];
+		if (!n.is_leaf())
+			return EntryRef(min_of(ldata && n.is_three() ? n.middle : n.right), true);
+		if (ldata && n.is_three())
+			return EntryRef(node, false);
+
+		auto parent = n.parent();
+		for (; parent != none && node == nodes[parent].right; node = parent, parent = nodes[node].parent());
+		if (parent == none)
+			return no_entry();
+		return EntryRef(parent, node == nodes[parent].left);
+	}
+
+	EntryRef predecessor(EntryRef entry) const
+	{
+		auto node = entry.first;
+		auto ldata = entry.second;
+		auto &n = nodes[node];
+		if (!n.is_leaf())
+			return max_entry(ldata ? n.left : n.middle);
+		if (!ldata)
+			return EntryRef(node, true);
+
+		auto parent = n.parent();
+		for (; parent != none && node == nodes[parent].left; node = parent, parent = nodes[node].parent());
+		if (parent == none)
+			return no_entry();
+		if (node == nodes[parent].right)
+			return EntryRef(parent, !nodes[parent].is_three());
+		return EntryRef(parent, true);
+	}
+
+	// Node and entry holding key, comparing key once with each entry on the way
+	template<typename K>
+	EntryRef find_entry(const K &key) const
+	{
+		auto node = root;
+		while (node != none) {
+			auto &n = nodes[node];
+			counters.visited();
+			counters.compared();
+			auto order = Compare::compare(key, n.lkey);
+			if (order == 0)
+				return EntryRef(node, true);
+			if (order < 0) {
+				node = n.left;
+				continue;
+			}
+			if (!n.is_three()) {
+				node = n.right;
+				continue;
+			}
+
+			counters.compared();
+			order = Compare::compare(key, n.rkey);
+			if (order == 0)
+				return EntryRef(node, false);
+			node = order < 0 ? n.middle : n.right;
+		}
+
+		return no_entry();
+	}
+
+	Value *value_of(EntryRef entry) const
+	{
+		auto &node = const_cast<CompactTwoThreeTree *>(this)->nodes[entry.first];
+		return entry.second ? &node.lvalue : &node.rvalue;
+	}
+
+	template<typename K>
+	Value *find_impl(const K &key) const
+	{
+		auto entry = find_entry(key);
+		return entry.first != none ? value_of(entry) : nullptr;
+	}
+
+	template<typename KeyT, typename ValueT>
+	void insert_impl(KeyT &&key, ValueT &&value)
+	{
+		insert_impl(std::forward<KeyT>(key), std::forward<ValueT>(value), root);
+	}
+
+	// Inserts with the descent starting at start, whose subtree must span key. Returns the node
+	// the descent ended in, which stays in the tree and has nothing but keys below key to its left.
+	template<typename KeyT, typename ValueT>
+	Index insert_impl(KeyT &&key, ValueT &&value, Index start)
+	{
+		if (root == none) {
+			root = nodes.allocate(Entry(std::forward<KeyT>(key), std::forward<ValueT>(value)));
+			return root;
+		}
+
+		auto node = start;
+		for (;;) {
+			auto &n = nodes[node];
+			Index child;
+			counters.visited();
+			counters.compared();
+			auto order = Compare::compare(key, n.lkey);
+			if (order == 0) {
+				n.lvalue = std::forward<ValueT>(value);
+				return node;
+			} else if (order < 0) {
+				child = n.left;
+			} else if (!n.is_three()) {
+				child = n.right;
+			} else {
+				counters.compared();
+				order = Compare::compare(key, n.rkey);
+				if (order == 0) {
+					n.rvalue = std::forward<ValueT>(value);
+					return node;
+				}
+				child = order < 0 ? n.middle : n.right;
+			}
+
+			if (child == none)
+				break;
+			node = child;
+		}
+
+		insert_into_subtree(node, Entry(std::forward<KeyT>(key), std::forward<ValueT>(value)), none);
+		return node;
+	}
+
+	// Lowest ancestor of node whose subtree spans key, given that key is above everything left of node
+	Index ancestor_spanning(Index node, const Key &key) const
+	{
+		for (auto parent = nodes[node].parent(); parent != none; node = parent, parent = nodes[parent].parent()) {
+			auto &p = nodes[parent];
+			if (node == p.left && Compare::less(key, p.lkey))
+				break;
+			if (node == p.middle && Compare::less(key, p.rkey))
+				break;
+		}
+
+		return node;
+	}
+
+	template<typename Iterator>
+	void insert_batch_impl(Iterator pairs, const std::vector<std::size_t> &order)
+	{
+		Index finger = none;
+		for (auto i : order) {
+			auto start = finger != none ? ancestor_spanning(finger, pairs[i].first) : root;
+			finger = insert_impl(pairs[i].first, pairs[i].second, start);
+		}
+	}
+
+	// Splits the run of keys at every node while more than one key shares the way down.
+	// Single keys are left in descents to finish afterwards.
+	void find_sorted(Index node, const Key *keys, const std::size_t *first, const std::size_t *last, Value **out,
+			std::vector<std::pair<Index, std::size_t>> &descents) const
+	{
+		while (node != none && last - first > 1) {
+			auto &n = nodes[node];
+			auto equal = equal_run<Compare>(keys, first, last, n.lkey);
+			for (auto it = equal.first; it != equal.second; ++it)
+				out[*it] = value_of(EntryRef(node, true));
+
+			if (first != equal.first)
+				find_sorted(n.left, keys, first, equal.first, out, descents);
+			first = equal.second;
+
+			if (n.is_three()) {
+				equal = equal_run<Compare>(keys, first, last, n.rkey);
+				for (auto it = equal.first; it != equal.second; ++it)
+					out[*it] = value_of(EntryRef(node, false));
+
+				if (first != equal.first)
+					find_sorted(n.middle, keys, first, equal.first, out, descents);
+				first = equal.second;
+			}
+
+			node = n.right;
+		}
+
+		if (node != none && first != last)
+			descents.emplace_back(node, *first);
+	}
+
+	// Walks all descents down together, one level per round, so that the cache misses of
+	// independent lookups overlap instead of following one another
+	void find_interleaved(std::vector<std::pair<Index, std::size_t>> &descents, const Key *keys, Value **out) const
+	{
+		while (!descents.empty()) {
+			std::size_t active = 0;
+			for (auto &descent : descents) {
+				auto node = descent.first;
+				auto &n = nodes[node];
+				auto &key = keys[descent.second];
+				auto order = Compare::compare(key, n.lkey);
+				if (order == 0) {
+					out[descent.second] = value_of(EntryRef(node, true));
+					continue;
+				} else if (order < 0) {
+					node = n.left;
+				} else if (!n.is_three()) {
+					node = n.right;
+				} else if ((order = Compare::compare(key, n.rkey)) == 0) {
+					out[descent.second] = value_of(EntryRef(node, false));
+					continue;
+				} else {
+					node = order < 0 ? n.middle : n.right;
+				}
+
+				if (node != none)
+					descents[active++] = std::make_pair(node, descent.second);
+			}
+			descents.resize(active);
+		}
+	}
+
+	// Puts entry into node, right after the child it was promoted from. If node overflows,
+	// its middle entry moves on to the parent together with a new right sibling. Nodes are
+	// named by index throughout, since allocating one may move the others.
+	void insert_into_subtree(Index node, Entry &&entry, Index right_child)
+	{
+		for (std::uint64_t steps = 0;; ++steps) {
+			if (!nodes[node].is_three()) {
+				auto &n = nodes[node];
+				if (Compare::less(entry.first, n.lkey)) {
+					n.set_rdata(n.take_ldata());
+					n.set_ldata(std::move(entry));
+					set_middle(node, right_child);
+				} else {
+					n.set_rdata(std::move(entry));
+					set_middle(node, n.right);
+					set_right(node, right_child);
+				}
+				counters.cascaded(steps);
+				return;
+			}
+
+			counters.split();
+			Index sibling;
+			if (Compare::less(entry.first, nodes[node].lkey)) {
+				Entry promoted(nodes[node].take_ldata());
+				nodes[node].set_ldata(std::move(entry));
+				sibling = nodes.allocate(nodes[node].take_rdata());
+				set_left(sibling, nodes[node].middle);
+				set_right(sibling, nodes[node].right);
+				set_right(node, right_child);
+				entry = std::move(promoted);
+			} else if (Compare::less(entry.first, nodes[node].rkey)) {
+				sibling = nodes.allocate(nodes[node].take_rdata());
+				set_left(sibling, right_child);
+				set_right(sibling, nodes[node].right);
+				set_right(node, nodes[node].middle);
+			} else {
+				sibling = nodes.allocate(std::move(entry));
+				set_left(sibling, nodes[node].right);
+				set_right(sibling, right_child);
+				set_right(node, nodes[node].middle);
+				entry = nodes[node].take_rdata();
+			}
+			nodes[node].middle = none;
+
+			auto parent = nodes[node].parent();
+			if (parent == none) {
+				root = nodes.allocate(std::move(entry));
+				set_left(root, node);
+				set_right(root, sibling);
+				counters.cascaded(steps + 1);
+				return;
+			}
+
+			node = parent;
+			right_child = sibling;
+		}
+	}
+
+	// Hole is a node left without entries and with its only child on the left. Merges it
+	// with a sibling or borrows an entry from one, climbing while the parent runs out.
+	void remove_hole(Index hole)
+	{
+		for (std::uint64_t steps = 1;; ++steps) {
+			auto parent = nodes[hole].parent();
+			if (parent == none) {
+				root = nodes[hole].left;
+				nodes.deallocate(hole);
+				if (root != none)
+					nodes[root].set_parent(none);
+				counters.cascaded(steps);
+				return;
+			}
+
+			// Nothing is allocated from here on, so references stay valid
+			auto &p = nodes[parent];
+			auto &h = nodes[hole];
+			if (!p.is_three()) {
+				if (hole == p.left) {
+					auto sibling = p.right;
+					auto &s = nodes[sibling];
+					if (!s.is_three()) {
+						s.set_rdata(s.take_ldata());
+						s.set_ldata(p.take_ldata());
+						set_middle(sibling, unlink(s.left));
+						set_left(sibling, h.left);
+						nodes.deallocate(hole);
+						counters.merged();
+						set_left(parent, unlink(p.right));
+						hole = parent;
+						continue;
+					}
+					h.set_ldata(p.take_ldata());
+					set_right(hole, unlink(s.left));
+					p.set_ldata(s.take_ldata());
+					s.set_ldata(s.take_rdata());
+					set_left(sibling, unlink(s.middle));
+				} else {
+					auto sibling = p.left;
+					auto &s = nodes[sibling];
+					if (!s.is_three()) {
+						s.set_rdata(p.take_ldata());
+						set_middle(sibling, unlink(s.right));
+						set_right(sibling, h.left);
+						nodes.deallocate(hole);
+						counters.merged();
+						p.right = none;
+						hole = parent;
+						continue;
+					}
+					h.set_ldata(p.take_ldata());
+					set_right(hole, unlink(h.left));
+					set_left(hole, unlink(s.right));
+					p.set_ldata(s.take_rdata());
+					set_right(sibling, unlink(s.middle));
+				}
+			} else if (hole == p.left) {
+				auto sibling = p.middle;
+				auto &s = nodes[sibling];
+				if (!s.is_three()) {
+					s.set_rdata(s.take_ldata());
+					s.set_ldata(p.take_ldata());
+					set_middle(sibling, unlink(s.left));
+					set_left(sibling, h.left);
+					nodes.deallocate(hole);
+					counters.merged();
+					p.set_ldata(p.take_rdata());
+					set_left(parent, unlink(p.middle));
+				} else {
+					h.set_ldata(p.take_ldata());
+					set_right(hole, unlink(s.left));
+					p.set_ldata(s.take_ldata());
+					s.set_ldata(s.take_rdata());
+					set_left(sibling, unlink(s.middle));
+				}
+			} else if (hole == p.middle) {
+				auto sibling = p.left;
+				auto &s = nodes[sibling];
+				if (!s.is_three()) {
+					s.set_rdata(p.take_ldata());
+					set_middle(sibling, unlink(s.right));
+					set_right(sibling, h.left);
+					nodes.deallocate(hole);
+					counters.merged();
+					p.set_ldata(p.take_rdata());
+					p.middle = none;
+				} else {
+					h.set_ldata(p.take_ldata());
+					set_right(hole, unlink(h.left));
+					set_left(hole, unlink(s.right));
+					p.set_ldata(s.take_rdata());
+					set_right(sibling, unlink(s.middle));
+				}
+			} else {
+				auto sibling = p.middle;
+				auto &s = nodes[sibling];
+				if (!s.is_three()) {
+					s.set_rdata(p.take_rdata());
+					set_middle(sibling, unlink(s.right));
+					set_right(sibling, h.left);
+					nodes.deallocate(hole);
+					counters.merged();
+					set_right(parent, unlink(p.middle));
+				} else {
+					h.set_ldata(p.take_rdata());
+					set_right(hole, unlink(h.left));
+					set_left(hole, unlink(s.right));
+					p.set_rdata(s.take_rdata());
+					set_right(sibling, unlink(s.middle));
+				}
+			}
+
+			counters.cascaded(steps);
+			return;
+		}
+	}
+
+	bool remove_impl(const Key &key)
+	{
+		auto entry = find_entry(key);
+		auto node = entry.first;
+		if (node == none)
+			return false;
+
+		auto &n = nodes[node];
+		if (!n.is_leaf()) {
+			if (entry.second) {
+				auto predecessor = max_of(n.left);
+				if (nodes[predecessor].is_three()) {
+					n.set_ldata(nodes[predecessor].take_rdata());
+				} else {
+					n.set_ldata(nodes[predecessor].take_ldata());
+					remove_hole(predecessor);
+				}
+			} else {
+				auto successor = min_of(n.right);
+				n.set_rdata(nodes[successor].take_ldata());
+				if (nodes[successor].is_three())
+					nodes[successor].set_ldata(nodes[successor].take_rdata());
+				else
+					remove_hole(successor);
+			}
+		} else if (n.is_three()) {
+			if (entry.second)
+				n.set_ldata(n.take_rdata());
+			else
+				n.take_rdata();
+		} else {
+			remove_hole(node);
+		}
+
+		return true;
+	}
+
+	// Most entries a subtree of the given height can hold, every node a 3-node
+	static std::size_t capacity(unsigned height)
+	{
+		std::size_t count = 1;
+		for (unsigned i = 0; i < height; ++i)
+			count *= 3;
+		return count - 1;
+	}
+
+	// Subtree of the given height holding the next count entries from it, the same shape
+	// TwoThreeTree builds. Nodes go into the vector in key order of their left entries.
+	template<typename Iterator>
+	Index build_subtree(Iterator &it, std::size_t count, unsigned height)
+	{
+		Index left = none;
+		std::size_t children = 0, rest = 0;
+		if (height > 1) {
+			children = count - 1 <= 2 * capacity(height - 1) ? 2 : 3;
+			rest = count - (children - 1);
+			left = build_subtree(it, rest / children + (rest % children > 0), height - 1);
+		}
+
+		auto node = nodes.allocate(next_entry(it));
+		set_left(node, left);
+
+		if (children == 3)
+			set_middle(node, build_subtree(it, rest / children + (rest % children > 1), height - 1));
+
+		if (children == 3 || (!children && count == 2))
+			nodes[node].set_rdata(next_entry(it));
+
+		if (children)
+			set_right(node, build_subtree(it, rest / children, height - 1));
+
+		return node;
+	}
+
+	template<typename Iterator>
+	static Entry next_entry(Iterator &it)
+	{
+		Entry entry((*it).first, (*it).second);
+		++it;
+		return entry;
+	}
+
+	template<typename Iterator>
+	void build(Iterator it, std::size_t count)
+	{
+		unsigned height = 0;
+		while (capacity(height) < count)
+			++height;
+
+		nodes.reserve(count);
+		root = count ? build_subtree(it, count, height) : none;
+	}
+
+	unsigned height_of(Index node) const
+	{
+		unsigned height = 0;
+		for (; node != none; node = nodes[node].left)
+			++height;
+		return height;
+	}
+
+	// A 2-node's unused right entry counts as overhead
+	void add_usage(Index node, MemoryUsage &usage) const
+	{
+		if (node == none)
+			return;
+
+		auto &n = nodes[node];
+		usage.add_entry(n.lkey, n.lvalue, false);
+		if (n.is_three())
+			usage.add_entry(n.rkey, n.rvalue, false);
+		usage.add_node(sizeof(Node), (n.is_three() ? 2 : 1) * (sizeof(Key) + sizeof(Value)));
+		add_usage(n.left, usage);
+		add_usage(n.middle, usage);
+		add_usage(n.right, usage);
+	}
+
+	void print(std::ostream &stream, Index node, const std::string &prefix, bool tail) const
+	{
+	#ifdef _WIN32
+		static const std::string prefix1 = { (char)192, (char)196, (char)196, (char) 32, 0 }; // "└── "
+		static const std::string prefix2 = { (char)195, (char)196, (char)196, (char) 32, 0 }; // "├── "
+		static const std::string prefix3 = { (char) 32, (char) 32, (char) 32, (char) 32, 0 }; // "    "
+		static const std::string prefix4 = { (char)179, (char) 32, (char) 32, (char) 32, 0 }; // "│   "
+	#else
+		static const std::string prefix1 = "└── ";
+		static const std::string prefix2 = "├── ";
+		static const std::string prefix3 = "    ";
+		static const std::string prefix4 = "│   ";
+	#endif
+
+		auto &n = nodes[node];
+		stream << prefix << (tail ? prefix1 : prefix2) << n.lkey;
+		if (n.is_three())
+			stream << '|' << n.rkey;
+		stream << '\n';
+
+		if (n.right != none)
+			print(stream, n.right, prefix + (tail ? prefix3 : prefix4), n.middle == none && n.left == none);
+		if (n.middle != none)
+			print(stream, n.middle, prefix + (tail ? prefix3 : prefix4), n.left == none);
+		if (n.left != none)
+			print(stream, n.left, prefix + (tail ? prefix3 : prefix4), true);
+	}
+
+	using typename OrderedTree<CompactTwoThreeTree, Key, Value, Compare>::Position;
+
+	// Node index and entry go into the position, which stays put when the vector moves
+	Position to_position(EntryRef entry) const
+	{
+		if (entry.first == none)
+			return Position{nullptr, 0};
+		return Position{const_cast<CompactTwoThreeTree *>(this), entry.first << 1 | !entry.second};
+	}
+
+	static EntryRef to_entry(const Position &position)
+	{
+		return EntryRef(position.index >> 1, !(position.index & 1));
+	}
+
+	Position first_position() const
+	{
+		return root != none ? to_position(EntryRef(min_of(root), true)) : Position{nullptr, 0};
+	}
+
+	template<typename K>
+	Position lower_bound_position(const K &key) const
+	{
+		auto bound = no_entry();
+		for (auto node = root; node != none;) {
+			auto &n = nodes[node];
+			if (!Compare::less(n.lkey, key)) {
+				bound = EntryRef(node, true);
+				node = n.left;
+			} else if (n.is_three() && !Compare::less(n.rkey, key)) {
+				bound = EntryRef(node, false);
+				node = n.middle;
+			} else {
+				node = n.right;
+			}
+		}
+
+		return to_position(bound);
+	}
+
+	template<typename K>
+	Position upper_bound_position(const K &key) const
+	{
+		auto bound = no_entry();
+		for (auto node = root; node != none;) {
+			auto &n = nodes[node];
+			if (Compare::less(key, n.lkey)) {
+				bound = EntryRef(node, true);
+				node = n.left;
+			} else if (n.is_three() && Compare::less(key, n.rkey)) {
+				bound = EntryRef(node, false);
+				node = n.middle;
+			} else {
+				node = n.right;
+			}
+		}
+
+		return to_position(bound);
+	}
+
+	void next_position(Position &position) const
+	{
+		position = to_position(successor(to_entry(position)));
+	}
+
+	void prev_position(Position &position) const
+	{
+		if (position.node)
+			position = to_position(predecessor(to_entry(position)));
+		else if (root != none)
+			position = to_position(max_entry(root));
+	}
+
+	const Key &key_at(const Position &position) const
+	{
+		auto entry = to_entry(position);
+		return entry.second ? nodes[entry.first].lkey : nodes[entry.first].rkey;
+	}
+
+	Value &value_at(const Position &position) const
+	{
+		return *value_of(to_entry(position));
+	}
+
+public:
+	using key_type = Key;
+	using mapped_type = Value;
+	using key_compare = Compare;
+	using typename OrderedTree<CompactTwoThreeTree, Key, Value, Compare>::iterator;
+
+	CompactTwoThreeTree()
+		: root(none)
+	{}
+
+	static SearchTreePtr<Key, Value, Compare> create()
+	{
+		return std::unique_ptr<SearchTreeAdapter<CompactTwoThreeTree>>(new SearchTreeAdapter<CompactTwoThreeTree>());
+	}
+
+	// Replaces the contents with (key, value) pairs in linear time. Input that is not sorted
+	// by key, or repeats a key, is sorted and deduplicated into a temporary copy first.
+	template<typename ForwardIterator>
+	void assign_sorted(ForwardIterator begin, ForwardIterator end)
+	{
+		nodes.clear();
+		if (keys_strictly_increasing<Compare>(begin, end)) {
+			build(begin, std::distance(begin, end));
+		} else {
+			auto entries = sorted_by_key<Key, Value, Compare>(begin, end);
+			build(std::make_move_iterator(entries.begin()), entries.size());
+		}
+	}
+
+	template<typename ForwardIterator>
+	static SearchTreePtr<Key, Value, Compare> build_from_sorted(ForwardIterator begin, ForwardIterator end)
+	{
+		std::unique_ptr<SearchTreeAdapter<CompactTwoThreeTree>> tree(new SearchTreeAdapter<CompactTwoThreeTree>());
+		tree->get().assign_sorted(begin, end);
+		return tree;
+	}
+
+	// Replaces the contents with a snapshot written by save(), in linear time. Returns false
+	// and keeps the current contents if the file is missing, damaged or out of key order.
+	bool load(const std::string &path)
+	{
+		SnapshotReader<Key, Value> reader(path);
+		if (!reader.ok())
+			return false;
+
+		CompactTwoThreeTree loaded;
+		loaded.build(reader.begin(), reader.size());
+		if (!reader.finished() || !keys_strictly_increasing<Compare>(loaded.begin(), loaded.end()))
+			return false;
+
+		nodes.swap(loaded.nodes);
+		root = loaded.root;
+		return true;
+	}
+
+	void insert(const Key &key, const Value &value)
+	{
+		insert_impl(key, value);
+	}
+
+	void insert(const Key &key, Value &&value)
+	{
+		insert_impl(key, std::move(value));
+	}
+
+	void insert(Key &&key, const Value &value)
+	{
+		insert_impl(std::move(key), value);
+	}
+
+	void insert(Key &&key, Value &&value)
+	{
+		insert_impl(std::move(key), std::move(value));
+	}
+
+	Value *find(const Key &key)
+	{
+		return find_impl(key);
+	}
+
+	const Value *find(const Key &key) const
+	{
+		return find_impl(key);
+	}
+
+	// Lookup by any type Compare orders against Key, when Compare is transparent
+	template<typename K, typename C = Compare, typename = typename C::is_transparent>
+	Value *find(const K &key)
+	{
+		return find_impl(key);
+	}
+
+	template<typename K, typename C = Compare, typename = typename C::is_transparent>
+	const Value *find(const K &key) const
+	{
+		return find_impl(key);
+	}
+
+	void insert_batch(const std::vector<std::pair<Key, Value>> &pairs)
+	{
+		insert_batch_impl(pairs.begin(), sorted_order(pairs, KeyLess<Compare>()));
+	}
+
+	void insert_batch(std::vector<std::pair<Key, Value>> &&pairs)
+	{
+		insert_batch_impl(std::make_move_iterator(pairs.begin()), sorted_order(pairs, KeyLess<Compare>()));
+	}
+
+	void find_batch(const std::vector<Key> &keys, std::vector<Value *> &out)
+	{
+		auto order = sorted_order(keys, CompareLess<Compare>());
+		out.assign(keys.size(), nullptr);
+		std::vector<std::pair<Index, std::size_t>> descents;
+		find_sorted(root, keys.data(), order.data(), order.data() + order.size(), out.data(), descents);
+		find_interleaved(descents, keys.data(), out.data());
+	}
+
+	Value *min()
+	{
+		return root != none ? value_of(EntryRef(min_of(root), true)) : nullptr;
+	}
+
+	const Value *min() const
+	{
+		return root != none ? value_of(EntryRef(min_of(root), true)) : nullptr;
+	}
+
+	Value *max()
+	{
+		return root != none ? value_of(max_entry(root)) : nullptr;
+	}
+
+	const Value *max() const
+	{
+		return root != none ? value_of(max_entry(root)) : nullptr;
+	}
+
+	bool remove(const Key &key)
+	{
+		return remove_impl(key);
+	}
+
+	// Counters since creation or the last reset_stats(), see stats.hpp
+	TreeStats stats() const
+	{
+		auto result = counters.get();
+		result.height = height_of(root);
+		return result;
+	}
+
+	void reset_stats()
+	{
+		counters.reset();
+	}
+
+	// Walks the whole tree, see memory-usage.hpp. Slots freed by removes and waiting to be
+	// reused are not counted, like pool blocks.
+	MemoryUsage memory_usage() const
+	{
+		MemoryUsage usage;
+		add_usage(root, usage);
+		return usage;
+	}
+
+	void print(std::ostream &stream) const
+	{
+		if (root != none)
+			print(stream, root, "", true);
+		else
+			stream << "Empty tree";
+		stream << '\n';
+	}
+};
+
+} // namespace search_trees
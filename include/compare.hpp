@@ -0,0 +1,139 @@
+#pragma once
+
+#include <string>
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#define SEARCH_TREES_STRING_VIEW
+#include <string_view>
+#endif
+
+namespace search_trees
+{
+
+// Key ordering policies. A policy provides less(a, b) and a three-way compare(a, b) that is
+// negative, zero or positive as a is ordered before, with or after b. The trees descend with
+// one compare() per key instead of testing == and then <, which for strings halves the work.
+// A policy defining is_transparent accepts any type it can compare with Key, so find() and the
+// bounds take, say, a std::string_view or a C string without building a temporary Key.
+
+namespace detail
+{
+
+// Tests == first, as the trees used to, which keeps descents over arithmetic keys down to
+// one compare and a conditional move per node
+template<typename A, typename B>
+int three_way(const A &a, const B &b)
+{
+	return a == b ? 0 : a < b ? -1 : 1;
+}
+
+// Same ordering with the operands swapped
+inline int reversed(int order)
+{
+	return (order < 0) - (order > 0);
+}
+
+template<typename Char, typename Traits, typename Alloc>
+int three_way(const std::basic_string<Char, Traits, Alloc> &a, const std::basic_string<Char, Traits, Alloc> &b)
+{
+	return a.compare(b);
+}
+
+template<typename Char, typename Traits, typename Alloc>
+int three_way(const std::basic_string<Char, Traits, Alloc> &a, const Char *b)
+{
+	return a.compare(b);
+}
+
+template<typename Char, typename Traits, typename Alloc>
+int three_way(const Char *a, const std::basic_string<Char, Traits, Alloc> &b)
+{
+	return reversed(b.compare(a));
+}
+
+#ifdef SEARCH_TREES_STRING_VIEW
+template<typename Char, typename Traits>
+int three_way(std::basic_string_view<Char, Traits> a, std::basic_string_view<Char, Traits> b)
+{
+	return a.compare(b);
+}
+
+template<typename Char, typename Traits, typename Alloc>
+int three_way(const std::basic_string<Char, Traits, Alloc> &a, std::basic_string_view<Char, Traits> b)
+{
+	return a.compare(b);
+}
+
+template<typename Char, typename Traits, typename Alloc>
+int three_way(std::basic_string_view<Char, Traits> a, const std::basic_string<Char, Traits, Alloc> &b)
+{
+	return reversed(b.compare(a));
+}
+#endif
+
+template<typename T>
+struct make_void
+{
+	using type = void;
+};
+
+template<typename Less, typename = void>
+struct TransparentIf
+{};
+
+template<typename Less>
+struct TransparentIf<Less, typename make_void<typename Less::is_transparent>::type>
+{
+	using is_transparent = void;
+};
+
+} // namespace detail
+
+// Natural order of the keys, with string comparisons done once per key
+struct ThreeWayCompare
+{
+	using is_transparent = void;
+
+	template<typename A, typename B>
+	static bool less(const A &a, const B &b)
+	{
+		return a < b;
+	}
+
+	template<typename A, typename B>
+	static int compare(const A &a, const B &b)
+	{
+		return detail::three_way(a, b);
+	}
+};
+
+// Order given by a default constructible less-than function object such as std::greater<>.
+// compare() costs two calls of it. Transparent when Less is.
+template<typename Less>
+struct LessCompare: detail::TransparentIf<Less>
+{
+	template<typename A, typename B>
+	static bool less(const A &a, const B &b)
+	{
+		return Less()(a, b);
+	}
+
+	template<typename A, typename B>
+	static int compare(const A &a, const B &b)
+	{
+		return Less()(a, b) ? -1 : Less()(b, a);
+	}
+};
+
+// Function object calling Compare::less, for the standard algorithms
+template<typename Compare>
+struct CompareLess
+{
+	template<typename A, typename B>
+	bool operator()(const A &a, const B &b) const
+	{
+		return Compare::less(a, b);
+	}
+};
+
+} // namespace search_trees
@@ -0,0 +1,319 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "red-black-tree.hpp"
+
+namespace search_trees
+{
+
+// Lock traffic of one shard. A wait is an acquisition that found the lock taken.
+struct ShardStats
+{
+	std::uint64_t reads;
+	std::uint64_t writes;
+	std::uint64_t read_waits;
+	std::uint64_t write_waits;
+};
+
+// Search tree that can be shared between threads. Keys are spread by hash over independent
+// shards, each a Tree behind its own reader-writer lock, so threads working on different
+// shards do not contend. Values are copied out since no reference into a shard outlives
+// its lock. Scans lock all shards for reading and merge them in key order.
+template<typename Key, typename Value, typename Tree = RedBlackTree<Key, Value>>
+class ConcurrentSearchTree
+{
+	using Compare = typename Tree::key_compare;
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+	using SharedMutex = std::shared_mutex;
+#else
+	using SharedMutex = std::shared_timed_mutex;
+#endif
+
+	struct Shard
+	{
+		mutable SharedMutex mutex;
+		Tree tree;
+
+		mutable std::atomic<std::uint64_t> reads;
+		mutable std::atomic<std::uint64_t> writes;
+		mutable std::atomic<std::uint64_t> read_waits;
+		mutable std::atomic<std::uint64_t> write_waits;
+
+		// Keeps the counters of neighbouring shards off each other's cache lines
+		char padding[64];
+
+		Shard()
+			: reads(0)
+			, writes(0)
+			, read_waits(0)
+			, write_waits(0)
+		{}
+
+		void lock_shared() const
+		{
+			reads.fetch_add(1, std::memory_order_relaxed);
+			if (!mutex.try_lock_shared()) {
+				read_waits.fetch_add(1, std::memory_order_relaxed);
+				mutex.lock_shared();
+			}
+		}
+
+		void unlock_shared() const
+		{
+			mutex.unlock_shared();
+		}
+
+		void lock() const
+		{
+			writes.fetch_add(1, std::memory_order_relaxed);
+			if (!mutex.try_lock()) {
+				write_waits.fetch_add(1, std::memory_order_relaxed);
+				mutex.lock();
+			}
+		}
+
+		void unlock() const
+		{
+			mutex.unlock();
+		}
+	};
+
+	// Holds a shard's lock for reading
+	class ReadGuard
+	{
+		const Shard *shard;
+
+	public:
+		explicit ReadGuard(const Shard &shard)
+			: shard(&shard)
+		{
+			shard.lock_shared();
+		}
+
+		ReadGuard(ReadGuard &&other)
+			: shard(other.shard)
+		{
+			other.shard = nullptr;
+		}
+
+		ReadGuard(const ReadGuard &) = delete;
+		ReadGuard &operator=(const ReadGuard &) = delete;
+
+		~ReadGuard()
+		{
+			if (shard)
+				shard->unlock_shared();
+		}
+	};
+
+	std::vector<std::unique_ptr<Shard>> shards;
+
+	std::size_t shard_index(const Key &key) const
+	{
+		// Fibonacci hashing spreads the weak low bits of std::hash over all shards
+		auto hash = static_cast<std::uint64_t>(std::hash<Key>()(key)) * 0x9e3779b97f4a7c15ull;
+		return (hash >> 32) % shards.size();
+	}
+
+	Shard &shard_of(const Key &key)
+	{
+		return *shards[shard_index(key)];
+	}
+
+	const Shard &shard_of(const Key &key) const
+	{
+		return *shards[shard_index(key)];
+	}
+
+	// Locks every shard for reading, in shard order, so the caller sees one consistent state
+	std::vector<ReadGuard> lock_all() const
+	{
+		std::vector<ReadGuard> guards;
+		guards.reserve(shards.size());
+		for (auto &shard : shards)
+			guards.emplace_back(*shard);
+		return guards;
+	}
+
+	// Calls f(key, value) for the entries of all shards in key order, starting from the given
+	// position in each shard and stopping before a key above hi if bounded
+	template<typename Start, typename Function>
+	void merge(Start start, const Key *hi, Function &&f) const
+	{
+		auto guards = lock_all();
+
+		using Iterator = typename Tree::const_iterator;
+		std::vector<std::pair<Iterator, Iterator>> heads;
+		for (auto &shard : shards) {
+			const Tree &tree = shard->tree;
+			auto it = start(tree);
+			if (it != tree.end())
+				heads.emplace_back(it, tree.end());
+		}
+
+		// Min-heap on the key at each shard's head
+		auto later = [](const std::pair<Iterator, Iterator> &a, const std::pair<Iterator, Iterator> &b) {
+			return Compare::less(b.first.key(), a.first.key());
+		};
+		std::make_heap(heads.begin(), heads.end(), later);
+
+		while (!heads.empty()) {
+			std::pop_heap(heads.begin(), heads.end(), later);
+			auto &head = heads.back();
+			if (hi && Compare::less(*hi, head.first.key()))
+				break;
+
+			f(head.first.key(), head.first.value());
+			if (++head.first == head.second)
+				heads.pop_back();
+			else
+				std::push_heap(heads.begin(), heads.end(), later);
+		}
+	}
+
+public:
+	// Zero shards means one per hardware thread
+	explicit ConcurrentSearchTree(std::size_t shard_count = 0)
+	{
+		if (!shard_count)
+			shard_count = std::max(1u, std::thread::hardware_concurrency());
+
+		shards.reserve(shard_count);
+		for (std::size_t i = 0; i < shard_count; ++i)
+			shards.emplace_back(new Shard());
+	}
+
+	ConcurrentSearchTree(const ConcurrentSearchTree &) = delete;
+	ConcurrentSearchTree &operator=(const ConcurrentSearchTree &) = delete;
+
+	std::size_t shard_count() const
+	{
+		return shards.size();
+	}
+
+	template<typename KeyT, typename ValueT>
+	void insert(KeyT &&key, ValueT &&value)
+	{
+		auto &shard = shard_of(key);
+		std::lock_guard<const Shard> lock(shard);
+		shard.tree.insert(std::forward<KeyT>(key), std::forward<ValueT>(value));
+	}
+
+	// Copies the value of key into value, false if there is no such key
+	bool find(const Key &key, Value &value) const
+	{
+		auto &shard = shard_of(key);
+		ReadGuard guard(shard);
+		auto found = shard.tree.find(key);
+		if (!found)
+			return false;
+
+		value = *found;
+		return true;
+	}
+
+	bool contains(const Key &key) const
+	{
+		auto &shard = shard_of(key);
+		ReadGuard guard(shard);
+		return shard.tree.find(key) != nullptr;
+	}
+
+	bool remove(const Key &key)
+	{
+		auto &shard = shard_of(key);
+		std::lock_guard<const Shard> lock(shard);
+		return shard.tree.remove(key);
+	}
+
+	// Value of the smallest key over all shards, false if the tree is empty
+	bool min(Value &value) const
+	{
+		auto guards = lock_all();
+
+		const Tree *min_tree = nullptr;
+		for (auto &shard : shards) {
+			const Tree &tree = shard->tree;
+			if (tree.begin() != tree.end()
+					&& (!min_tree || Compare::less(tree.begin().key(), min_tree->begin().key())))
+				min_tree = &tree;
+		}
+
+		if (!min_tree)
+			return false;
+
+		value = *min_tree->min();
+		return true;
+	}
+
+	// Value of the largest key over all shards, false if the tree is empty
+	bool max(Value &value) const
+	{
+		auto guards = lock_all();
+
+		const Tree *max_tree = nullptr;
+		for (auto &shard : shards) {
+			const Tree &tree = shard->tree;
+			if (tree.begin() != tree.end()
+					&& (!max_tree || Compare::less((--max_tree->end()).key(), (--tree.end()).key())))
+				max_tree = &tree;
+		}
+
+		if (!max_tree)
+			return false;
+
+		value = *max_tree->max();
+		return true;
+	}
+
+	// Calls f(key, value) for every entry in key order while holding every shard for reading
+	template<typename Function>
+	void for_each(Function &&f) const
+	{
+		merge([](const Tree &tree) { return tree.begin(); }, nullptr, f);
+	}
+
+	// Same for the entries with keys in [lo, hi]
+	template<typename Function>
+	void for_each(const Key &lo, const Key &hi, Function &&f) const
+	{
+		merge([&](const Tree &tree) { return tree.lower_bound(lo); }, &hi, f);
+	}
+
+	std::vector<ShardStats> stats() const
+	{
+		std::vector<ShardStats> result;
+		for (auto &shard : shards) {
+			result.push_back(ShardStats{shard->reads.load(std::memory_order_relaxed),
+					shard->writes.load(std::memory_order_relaxed),
+					shard->read_waits.load(std::memory_order_relaxed),
+					shard->write_waits.load(std::memory_order_relaxed)});
+		}
+
+		return result;
+	}
+
+	void reset_stats()
+	{
+		for (auto &shard : shards) {
+			shard->reads.store(0, std::memory_order_relaxed);
+			shard->writes.store(0, std::memory_order_relaxed);
+			shard->read_waits.store(0, std::memory_order_relaxed);
+			shard->write_waits.store(0, std::memory_order_relaxed);
+		}
+	}
+};
+
+} // namespace search_trees
@@ -1,6 +1,10 @@
 #pragma once
 
 #include <memory>
+#include <new>
+#include <utility>
+
+#include "allocator.hpp"
 
 namespace search_trees
 {
@@ -32,7 +36,147 @@ struct Data
 	{}
 };
 
-template<typename Key, typename Value>
-using DataPtr = std::unique_ptr<Data<Key,Value>>;
+// Node layouts. A layout provides the Entry type a node stores for each of its keys.
+// Entries are created with the tree's value allocator and must be release()d with it
+// before they are destroyed or overwritten while still holding a value.
+
+// Key and value live together inside the node.
+struct InlineLayout
+{
+	static constexpr bool separate_values = false;
+
+	template<typename Key, typename Value, template<typename> class Allocator>
+	class Entry
+	{
+		Data<Key, Value> data;
+
+	public:
+		template<typename KeyT, typename ValueT>
+		Entry(Allocator<Value> &, KeyT &&key, ValueT &&value)
+			: data(std::forward<KeyT>(key), std::forward<ValueT>(value))
+		{}
+
+		void release(Allocator<Value> &)
+		{}
+
+		const Key &key() const
+		{
+			return data.key;
+		}
+
+		Value &value()
+		{
+			return data.value;
+		}
+
+		const Value &value() const
+		{
+			return data.value;
+		}
+	};
+};
+
+// Only the key sits next to the child links, the value is kept in a block of its own.
+// Descents touch nothing but keys and links, and moving an entry never moves a value.
+struct HotLayout
+{
+	static constexpr bool separate_values = true;
+
+	template<typename Key, typename Value, template<typename> class Allocator>
+	class Entry
+	{
+		Key stored_key;
+		Value *stored_value;
+
+	public:
+		template<typename KeyT, typename ValueT>
+		Entry(Allocator<Value> &allocator, KeyT &&key, ValueT &&value)
+			: stored_key(std::forward<KeyT>(key))
+			, stored_value(construct(allocator, std::forward<ValueT>(value)))
+		{}
+
+		Entry(Entry &&other)
+			: stored_key(std::move(other.stored_key))
+			, stored_value(std::exchange(other.stored_value, nullptr))
+		{}
+
+		Entry &operator=(Entry &&other)
+		{
+			stored_key = std::move(other.stored_key);
+			stored_value = std::exchange(other.stored_value, nullptr);
+			return *this;
+		}
+
+		void release(Allocator<Value> &allocator)
+		{
+			if (stored_value)
+				destroy(allocator, std::exchange(stored_value, nullptr));
+		}
+
+		const Key &key() const
+		{
+			return stored_key;
+		}
+
+		Value &value()
+		{
+			return *stored_value;
+		}
+
+		const Value &value() const
+		{
+			return *stored_value;
+		}
+	};
+};
+
+// Raw storage for an object whose lifetime is managed by its owner.
+template<typename T>
+class Storage
+{
+	alignas(T) unsigned char bytes[sizeof(T)];
+
+public:
+	template<typename ...Args>
+	void emplace(Args &&...args)
+	{
+		new (bytes) T(std::forward<Args>(args)...);
+	}
+
+	void destroy()
+	{
+		get().~T();
+	}
+
+	T &get()
+	{
+		return *reinterpret_cast<T *>(bytes);
+	}
+
+	const T &get() const
+	{
+		return *reinterpret_cast<const T *>(bytes);
+	}
+
+	T &operator*()
+	{
+		return get();
+	}
+
+	const T &operator*() const
+	{
+		return get();
+	}
+
+	T *operator->()
+	{
+		return &get();
+	}
+
+	const T *operator->() const
+	{
+		return &get();
+	}
+};
 
 } // namespace search_trees
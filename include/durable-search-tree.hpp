@@ -0,0 +1,633 @@
+#pragma once
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "compare.hpp"
+#include "search-tree.hpp"
+#include "snapshot.hpp"
+
+namespace search_trees
+{
+
+namespace detail
+{
+
+// File written only at its end and synced to the device on request
+class LogFile
+{
+	int descriptor;
+
+public:
+	LogFile()
+		: descriptor(-1)
+	{}
+
+	LogFile(const LogFile &) = delete;
+	LogFile &operator=(const LogFile &) = delete;
+
+	~LogFile()
+	{
+		close();
+	}
+
+	// Appends to the file, creating it if needed, or empties it first with truncate
+	bool open(const std::string &path, bool truncate = false)
+	{
+		close();
+#ifdef _WIN32
+		descriptor = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_BINARY | (truncate ? _O_TRUNC : _O_APPEND),
+				_S_IREAD | _S_IWRITE);
+#else
+		descriptor = ::open(path.c_str(), O_WRONLY | O_CREAT | (truncate ? O_TRUNC : O_APPEND), 0644);
+#endif
+		return descriptor >= 0;
+	}
+
+	void close()
+	{
+		if (descriptor < 0)
+			return;
+
+#ifdef _WIN32
+		_close(descriptor);
+#else
+		::close(descriptor);
+#endif
+		descriptor = -1;
+	}
+
+	bool write(const char *data, std::size_t size)
+	{
+		while (size) {
+#ifdef _WIN32
+			auto written = _write(descriptor, data, static_cast<unsigned>(std::min<std::size_t>(size, 1 << 30)));
+#else
+			auto written = ::write(descriptor, data, size);
+#endif
+			if (written <= 0)
+				return false;
+			data += written;
+			size -= written;
+		}
+		return true;
+	}
+
+	bool sync()
+	{
+#ifdef _WIN32
+		return _commit(descriptor) == 0;
+#elif defined(__linux__)
+		return fdatasync(descriptor) == 0;
+#else
+		return fsync(descriptor) == 0;
+#endif
+	}
+
+	// Syncs a file written some other way, such as a snapshot
+	static bool sync(const std::string &path)
+	{
+		LogFile file;
+		return file.open(path) && file.sync();
+	}
+
+	// Makes files created or renamed in the directory survive a crash. Windows has no
+	// equivalent and needs none.
+	static bool sync_directory(const std::string &directory)
+	{
+#ifdef _WIN32
+		(void)directory;
+		return true;
+#else
+		int descriptor = ::open(directory.c_str(), O_RDONLY);
+		if (descriptor < 0)
+			return false;
+		bool synced = fsync(descriptor) == 0;
+		::close(descriptor);
+		return synced;
+#endif
+	}
+};
+
+// Stream appending to a vector, for serializing log records in memory
+class AppendBuffer: public std::streambuf
+{
+	std::vector<char> &bytes;
+
+protected:
+	int_type overflow(int_type c) override
+	{
+		if (!traits_type::eq_int_type(c, traits_type::eof()))
+			bytes.push_back(traits_type::to_char_type(c));
+		return traits_type::not_eof(c);
+	}
+
+	std::streamsize xsputn(const char *data, std::streamsize size) override
+	{
+		bytes.insert(bytes.end(), data, data + size);
+		return size;
+	}
+
+public:
+	explicit AppendBuffer(std::vector<char> &bytes)
+		: bytes(bytes)
+	{}
+};
+
+// Stream over bytes already in memory
+class ReadBuffer: public std::streambuf
+{
+public:
+	ReadBuffer(char *begin, char *end)
+	{
+		setg(begin, begin, end);
+	}
+};
+
+// FNV-1a, enough to tell a group of records written whole from a torn or stale one
+inline std::uint32_t log_checksum(const char *data, std::size_t size)
+{
+	std::uint32_t hash = 2166136261u;
+	for (std::size_t i = 0; i < size; ++i)
+		hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+	return hash;
+}
+
+// Precedes each group of records in a log
+struct LogGroupHeader
+{
+	std::uint32_t bytes;
+	std::uint32_t checksum;
+};
+
+} // namespace detail
+
+// When the records of a DurableSearchTree are written out and synced. A group is committed
+// once it holds group_bytes or once group_delay has passed, whichever comes first, so a
+// crash loses at most about group_delay of operations.
+struct DurabilityOptions
+{
+	std::size_t group_bytes = 1 << 20;
+	std::chrono::milliseconds group_delay{10};
+};
+
+// SearchTree that survives a crash. Each insert and remove appends a record to a write-ahead
+// log; a background thread writes records out in groups and syncs each group once, so the
+// cost of a sync is amortized to a small fraction of the tree operation. checkpoint()
+// condenses the log into a snapshot: a full one the first time and whenever the changes
+// since it add up to half of it, otherwise an incremental one holding only the keys changed
+// since the previous checkpoint. open() loads the checkpoints and replays the log after them.
+//
+// All files are named after a path prefix. The prefix.manifest file lists the checkpoints
+// in use, prefix.base-N and prefix.delta-N hold them and prefix.log-N the log segments.
+// Key and Value need a Serializer, see snapshot.hpp. Not safe to share between threads.
+template<typename Key, typename Value, typename Compare = ThreeWayCompare>
+class DurableSearchTree
+{
+	static_assert(Serializable<Key, Value>::value, "key and value types need a Serializer");
+
+	// An incremental checkpoint maps each changed key to whether it is present, and its value
+	using Change = std::pair<bool, Value>;
+
+	enum : unsigned char { INSERT = 1, REMOVE = 2 };
+
+	// Checkpoint generation and the entries it holds
+	struct Checkpoint
+	{
+		std::uint64_t generation;
+		std::uint64_t entries;
+	};
+
+	SearchTreePtr<Key, Value, Compare> tree;
+	std::string prefix;
+	DurabilityOptions options;
+
+	// What the manifest lists. A base generation of 0 means no full checkpoint.
+	Checkpoint base;
+	std::vector<Checkpoint> deltas;
+	std::uint64_t first_log;
+
+	// Segment taking new records
+	std::uint64_t log_generation;
+	detail::LogFile log;
+
+	// Records queued and being written by the flusher, and how many bytes of them were
+	// queued and synced in all
+	std::mutex mutex;
+	std::condition_variable wake, written;
+	std::vector<char> pending, writing;
+	detail::AppendBuffer record_out;
+	std::uint64_t queued, durable;
+	bool sync_requested, stopping, failed;
+	std::thread flusher;
+
+	std::string path(const char *kind, std::uint64_t generation) const
+	{
+		return prefix + "." + kind + "-" + std::to_string(generation);
+	}
+
+	std::string directory() const
+	{
+		auto slash = prefix.find_last_of("/\\");
+		return slash == std::string::npos ? "." : slash ? prefix.substr(0, slash) : "/";
+	}
+
+	static bool exists(const std::string &path)
+	{
+		return std::ifstream(path).is_open();
+	}
+
+	// A missing manifest is a new tree
+	bool read_manifest()
+	{
+		base = Checkpoint{0, 0};
+		deltas.clear();
+		first_log = 1;
+
+		std::ifstream in(prefix + ".manifest");
+		if (!in)
+			return !exists(prefix + ".manifest");
+
+		std::string kind;
+		Checkpoint checkpoint;
+		while (in >> kind) {
+			if (kind == "log") {
+				in >> first_log;
+			} else if (kind == "base") {
+				in >> base.generation >> base.entries;
+			} else if (kind == "delta") {
+				in >> checkpoint.generation >> checkpoint.entries;
+				deltas.push_back(checkpoint);
+			} else {
+				return false;
+			}
+		}
+		return in.eof();
+	}
+
+	// Replaced whole, so a crash leaves the old or the new one
+	bool write_manifest(const Checkpoint &base, const std::vector<Checkpoint> &deltas, std::uint64_t first_log)
+	{
+		std::string text;
+		if (base.generation)
+			text += "base " + std::to_string(base.generation) + " " + std::to_string(base.entries) + "\n";
+		for (auto &delta : deltas)
+			text += "delta " + std::to_string(delta.generation) + " " + std::to_string(delta.entries) + "\n";
+		text += "log " + std::to_string(first_log) + "\n";
+
+		auto manifest = prefix + ".manifest";
+		detail::LogFile file;
+		bool good = file.open(manifest + ".tmp", true) && file.write(text.data(), text.size()) && file.sync();
+		file.close();
+		return detail::replace_file(manifest + ".tmp", manifest, good) && detail::LogFile::sync_directory(directory());
+	}
+
+	// Calls f(type, key, value) for the records of a log segment, up to the first group
+	// that was not written whole
+	template<typename F>
+	static void read_log(const std::string &path, F f)
+	{
+		std::vector<char> buffer(detail::snapshot_buffer_bytes);
+		std::filebuf file;
+		file.pubsetbuf(buffer.data(), buffer.size());
+		if (!file.open(path, std::ios::in | std::ios::binary))
+			return;
+
+		detail::LogGroupHeader header;
+		std::vector<char> group;
+		Key key;
+		Value value;
+		while (Serializer<detail::LogGroupHeader>::read(file, header)) {
+			group.resize(header.bytes);
+			if (file.sgetn(group.data(), header.bytes) != std::streamsize(header.bytes)
+					|| detail::log_checksum(group.data(), group.size()) != header.checksum)
+				return;
+
+			detail::ReadBuffer in(group.data(), group.data() + group.size());
+			unsigned char type;
+			while (Serializer<unsigned char>::read(in, type)) {
+				if (!Serializer<Key>::read(in, key) || (type == INSERT && !Serializer<Value>::read(in, value)))
+					return;
+				f(type, key, value);
+			}
+		}
+	}
+
+	bool apply_delta(const std::string &path)
+	{
+		SnapshotReader<Key, Change> reader(path);
+		if (!reader.ok())
+			return false;
+
+		auto it = reader.begin();
+		for (std::uint64_t i = 0; i < reader.size(); ++i, ++it) {
+			auto entry = *it;
+			if (entry.second.first)
+				tree->insert(std::move(entry.first), std::move(entry.second.second));
+			else
+				tree->remove(entry.first);
+		}
+		return reader.finished();
+	}
+
+	void append(unsigned char type, const Key &key, const Value *value)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		// Nothing would ever write the record out, and a writer waiting for room would hang
+		if (!flusher.joinable()) {
+			failed = true;
+			return;
+		}
+
+		// A writer outrunning the device waits for it rather than queueing without bound
+		if (pending.size() >= 4 * options.group_bytes)
+			written.wait(lock, [&] { return pending.size() < options.group_bytes || failed; });
+
+		auto size = pending.size();
+		Serializer<unsigned char>::write(record_out, type);
+		Serializer<Key>::write(record_out, key);
+		if (value)
+			Serializer<Value>::write(record_out, *value);
+		queued += pending.size() - size;
+
+		if (pending.size() >= options.group_bytes)
+			wake.notify_one();
+	}
+
+	// Commits a group whenever one is full, one is asked for or the delay is up
+	void flush_loop()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			wake.wait_for(lock, options.group_delay,
+					[&] { return stopping || sync_requested || pending.size() >= options.group_bytes; });
+			sync_requested = false;
+			if (pending.empty()) {
+				written.notify_all();
+				if (stopping)
+					return;
+				continue;
+			}
+
+			writing.swap(pending);
+			auto target = queued;
+			lock.unlock();
+
+			detail::LogGroupHeader header{static_cast<std::uint32_t>(writing.size()),
+					detail::log_checksum(writing.data(), writing.size())};
+			bool good = log.write(reinterpret_cast<const char *>(&header), sizeof(header))
+					&& log.write(writing.data(), writing.size()) && log.sync();
+			writing.clear();
+
+			lock.lock();
+			failed = failed || !good;
+			durable = target;
+			written.notify_all();
+		}
+	}
+
+	void stop()
+	{
+		if (!flusher.joinable())
+			return;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_one();
+		flusher.join();
+		stopping = false;
+	}
+
+public:
+	// The tree should be empty; open() fills it from the files
+	DurableSearchTree(SearchTreePtr<Key, Value, Compare> tree, std::string prefix,
+			DurabilityOptions options = DurabilityOptions())
+		: tree(std::move(tree))
+		, prefix(std::move(prefix))
+		, options(options)
+		, base{0, 0}
+		, first_log(1)
+		, log_generation(0)
+		, record_out(pending)
+		, queued(0)
+		, durable(0)
+		, sync_requested(false)
+		, stopping(false)
+		, failed(false)
+	{}
+
+	DurableSearchTree(const DurableSearchTree &) = delete;
+	DurableSearchTree &operator=(const DurableSearchTree &) = delete;
+
+	// Commits whatever is still queued
+	~DurableSearchTree()
+	{
+		stop();
+	}
+
+	// Recovers the tree from the latest checkpoints and the log after them, or starts a new
+	// one if there are no files yet. False if a listed checkpoint is missing or damaged or a
+	// file cannot be created; the tree is then unusable. The directory must exist.
+	bool open()
+	{
+		bool fresh = !exists(prefix + ".manifest");
+		if (flusher.joinable() || !read_manifest())
+			return false;
+
+		if (base.generation && !tree->load(path("base", base.generation)))
+			return false;
+		for (auto &delta : deltas)
+			if (!apply_delta(path("delta", delta.generation)))
+				return false;
+
+		// Segments follow one another from first_log; the last may end in a torn group
+		for (log_generation = first_log; exists(path("log", log_generation)); ++log_generation)
+			read_log(path("log", log_generation), [&](unsigned char type, Key &key, Value &value) {
+				if (type == INSERT)
+					tree->insert(std::move(key), std::move(value));
+				else
+					tree->remove(key);
+			});
+
+		// A checkpoint interrupted before its manifest was written left files no manifest lists
+		for (auto generation = first_log + 1; generation <= log_generation; ++generation) {
+			std::remove(path("base", generation).c_str());
+			std::remove(path("delta", generation).c_str());
+		}
+
+		if (!log.open(path("log", log_generation)) || !detail::LogFile::sync_directory(directory())
+				|| (fresh && !write_manifest(base, deltas, first_log)))
+			return false;
+
+		flusher = std::thread([this] { flush_loop(); });
+		return true;
+	}
+
+	// Recorded in the log before it reaches the tree. The record is durable once its group
+	// is committed, or after sync(). Without a successful open() nothing is recorded and
+	// ok() turns false.
+	void insert(const Key &key, const Value &value)
+	{
+		append(INSERT, key, &value);
+		tree->insert(key, value);
+	}
+
+	void insert(Key &&key, Value &&value)
+	{
+		append(INSERT, key, &value);
+		tree->insert(std::move(key), std::move(value));
+	}
+
+	// Removing a missing key changes nothing and is not recorded
+	bool remove(const Key &key)
+	{
+		if (!tree->remove(key))
+			return false;
+
+		append(REMOVE, key, nullptr);
+		return true;
+	}
+
+	const Value *find(const Key &key) const
+	{
+		return static_cast<const SearchTree<Key, Value, Compare> &>(*tree).find(key);
+	}
+
+	const Value *min() const
+	{
+		return static_cast<const SearchTree<Key, Value, Compare> &>(*tree).min();
+	}
+
+	const Value *max() const
+	{
+		return static_cast<const SearchTree<Key, Value, Compare> &>(*tree).max();
+	}
+
+	// The tree behind the log, for lookups, scans and printing through its const interface
+	const SearchTree<Key, Value, Compare> &get() const
+	{
+		return *tree;
+	}
+
+	// Waits until every operation so far is on the device. False once a write has failed.
+	bool sync()
+	{
+		if (!flusher.joinable())
+			return false;
+
+		std::unique_lock<std::mutex> lock(mutex);
+		auto target = queued;
+		sync_requested = true;
+		wake.notify_one();
+		written.wait(lock, [&] { return durable >= target || failed; });
+		return !failed;
+	}
+
+	// False once writing or syncing the log has failed; operations since are in the tree but
+	// may not survive a crash
+	bool ok()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return !failed;
+	}
+
+	// Condenses the log written since the previous checkpoint into a new one and removes it.
+	// New operations go to a fresh log segment meanwhile. On failure the log is kept, so
+	// nothing is lost, and the next checkpoint tries again.
+	bool checkpoint()
+	{
+		if (!flusher.joinable() || !sync())
+			return false;
+
+		// The flusher is idle until the next operation, so the segment can be swapped
+		auto last_log = log_generation;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			log.close();
+			if (!log.open(path("log", ++log_generation)) || !detail::LogFile::sync_directory(directory())) {
+				failed = true;
+				return false;
+			}
+		}
+
+		std::vector<Key> changed;
+		for (auto generation = first_log; generation <= last_log; ++generation)
+			read_log(path("log", generation), [&](unsigned char, Key &key, Value &) { changed.push_back(std::move(key)); });
+		std::sort(changed.begin(), changed.end(), CompareLess<Compare>());
+		changed.erase(std::unique(changed.begin(), changed.end(),
+				[](const Key &a, const Key &b) { return !Compare::less(a, b); }), changed.end());
+
+		std::uint64_t delta_entries = changed.size();
+		for (auto &delta : deltas)
+			delta_entries += delta.entries;
+
+		auto new_base = base;
+		auto new_deltas = deltas;
+		Checkpoint checkpoint{log_generation, 0};
+		bool good;
+		if (!base.generation || delta_entries >= base.entries / 2) {
+			for (auto it = tree->begin(); it != tree->end(); ++it)
+				++checkpoint.entries;
+			auto file = path("base", checkpoint.generation);
+			good = tree->save(file) && detail::LogFile::sync(file);
+			new_base = checkpoint;
+			new_deltas.clear();
+		} else {
+			std::vector<std::pair<Key, Change>> changes;
+			changes.reserve(changed.size());
+			for (auto &key : changed) {
+				auto value = find(key);
+				changes.emplace_back(std::move(key), value ? Change(true, *value) : Change(false, Value()));
+			}
+			checkpoint.entries = changes.size();
+			auto file = path("delta", checkpoint.generation);
+			good = save_snapshot<Key, Change>(file, changes.begin(), changes.end()) && detail::LogFile::sync(file);
+			new_deltas.push_back(checkpoint);
+		}
+
+		if (!good || !write_manifest(new_base, new_deltas, log_generation)) {
+			std::remove(path(new_deltas.empty() ? "base" : "delta", checkpoint.generation).c_str());
+			return false;
+		}
+
+		// What the manifest no longer lists
+		for (auto generation = first_log; generation <= last_log; ++generation)
+			std::remove(path("log", generation).c_str());
+		if (new_deltas.empty()) {
+			if (base.generation)
+				std::remove(path("base", base.generation).c_str());
+			for (auto &delta : deltas)
+				std::remove(path("delta", delta.generation).c_str());
+		}
+
+		base = new_base;
+		deltas = std::move(new_deltas);
+		first_log = log_generation;
+		return true;
+	}
+};
+
+} // namespace search_trees
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#include "compare.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SEARCH_TREES_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace search_trees
+{
+
+// Immutable snapshot of a search tree, see SearchTree::freeze(). Keys sit in one contiguous
+// array in Eytzinger (breadth-first) order and values in a parallel array, so a lookup is a
+// branchless walk over array indices with the next levels prefetched. With SSE2, signed
+// 32-bit keys are laid out instead as a static B-tree of 16-key blocks, each searched with
+// four vector compares. Key and Value must be default constructible.
+template<typename Key, typename Value, typename Compare = ThreeWayCompare>
+class FrozenTree
+{
+	static constexpr std::size_t none = std::numeric_limits<std::size_t>::max();
+	static constexpr std::size_t block_keys = 16;
+	static constexpr std::size_t cache_line = 64;
+
+#ifdef SEARCH_TREES_SSE2
+	using uses_blocks = std::integral_constant<bool, std::is_integral<Key>::value && std::is_signed<Key>::value
+			&& sizeof(Key) == 4 && std::is_same<Compare, ThreeWayCompare>::value>;
+#else
+	using uses_blocks = std::false_type;
+#endif
+
+	// Slot 0 is unused in the binary layout, node k has children 2k and 2k + 1. In the block
+	// layout block b spans slots 16b to 16b + 15 and has children 17b + 1 to 17b + 17.
+	std::vector<Key> keys;
+	std::vector<Value> values;
+	std::size_t count;
+	std::size_t block_count;
+	std::size_t min_slot, max_slot;
+
+	static void prefetch(const void *address)
+	{
+	#if defined(__GNUC__)
+		__builtin_prefetch(address);
+	#elif defined(SEARCH_TREES_SSE2)
+		_mm_prefetch(static_cast<const char *>(address), _MM_HINT_T0);
+	#endif
+	}
+
+	// Address of a slot that may lie past the end, computed without leaving the array as a pointer
+	const void *slot_address(std::size_t slot) const
+	{
+		return reinterpret_cast<const void *>(reinterpret_cast<std::uintptr_t>(keys.data()) + slot * sizeof(Key));
+	}
+
+	static unsigned trailing_ones(std::size_t bits)
+	{
+	#if defined(__GNUC__)
+		return __builtin_ctzll(~static_cast<unsigned long long>(bits));
+	#else
+		unsigned ones = 0;
+		for (; bits & 1; bits >>= 1)
+			++ones;
+		return ones;
+	#endif
+	}
+
+	template<typename Iterator>
+	void place(Iterator &it, std::size_t rank, std::size_t slot)
+	{
+		keys[slot] = (*it).first;
+		values[slot] = (*it).second;
+		++it;
+
+		if (rank == 0)
+			min_slot = slot;
+		if (rank + 1 == count)
+			max_slot = slot;
+	}
+
+	// Fills the subtree of node with the next entries in key order
+	template<typename Iterator>
+	void fill(Iterator &it, std::size_t &rank, std::size_t node)
+	{
+		if (node > count)
+			return;
+
+		fill(it, rank, 2 * node);
+		place(it, rank++, node);
+		fill(it, rank, 2 * node + 1);
+	}
+
+	// Same for the block layout, slots past the last entry are padded with the largest key
+	template<typename Iterator>
+	void fill_blocks(Iterator &it, std::size_t &rank, std::size_t block)
+	{
+		if (block >= block_count)
+			return;
+
+		for (std::size_t i = 0; i < block_keys; ++i) {
+			fill_blocks(it, rank, block * (block_keys + 1) + i + 1);
+			if (rank < count)
+				place(it, rank++, block * block_keys + i);
+		}
+		fill_blocks(it, rank, block * (block_keys + 1) + block_keys + 1);
+	}
+
+	template<typename Iterator>
+	void build(Iterator it, std::false_type)
+	{
+		keys.resize(count + 1);
+		values.resize(count + 1);
+
+		std::size_t rank = 0;
+		fill(it, rank, 1);
+	}
+
+	template<typename Iterator>
+	void build(Iterator it, std::true_type)
+	{
+		block_count = (count + block_keys - 1) / block_keys;
+		keys.assign(block_count * block_keys, std::numeric_limits<Key>::max());
+		values.resize(block_count * block_keys);
+
+		std::size_t rank = 0;
+		fill_blocks(it, rank, 0);
+	}
+
+	// Slot of the first key not less than key, none if there is no such key
+	std::size_t lower_bound_slot(const Key &key, std::false_type) const
+	{
+		// Prefetching the node a cache line's worth of levels down hides most of the misses
+		const std::size_t stride = cache_line / sizeof(Key) > 1 ? cache_line / sizeof(Key) : 1;
+		auto data = keys.data();
+
+		std::size_t node = 1;
+		while (node <= count) {
+			prefetch(slot_address(node * stride));
+			node = 2 * node + Compare::less(data[node], key);
+		}
+
+		// Climbing back over the right turns taken below the answer leads to it
+		node >>= trailing_ones(node) + 1;
+		return node ? node : none;
+	}
+
+#ifdef SEARCH_TREES_SSE2
+	// Number of keys in a block of sixteen sorted ones that are less than key
+	static unsigned rank_in_block(const Key *block, __m128i key)
+	{
+		auto less0 = _mm_cmpgt_epi32(key, _mm_loadu_si128(reinterpret_cast<const __m128i *>(block)));
+		auto less1 = _mm_cmpgt_epi32(key, _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 4)));
+		auto less2 = _mm_cmpgt_epi32(key, _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 8)));
+		auto less3 = _mm_cmpgt_epi32(key, _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 12)));
+		auto less = _mm_packs_epi16(_mm_packs_epi32(less0, less1), _mm_packs_epi32(less2, less3));
+
+		// The keys less than key form a prefix of the block, so the mask is a run of low bits
+		unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(less));
+		return trailing_ones(mask);
+	}
+
+	std::size_t lower_bound_slot(const Key &key, std::true_type) const
+	{
+		auto data = keys.data();
+		auto wanted = _mm_set1_epi32(static_cast<int>(key));
+
+		std::size_t slot = none;
+		std::size_t block = 0;
+		while (block < block_count) {
+			prefetch(slot_address((block * (block_keys + 1) + 1) * block_keys));
+			auto index = rank_in_block(data + block * block_keys, wanted);
+			if (index < block_keys)
+				slot = block * block_keys + index;
+			block = block * (block_keys + 1) + index + 1;
+		}
+
+		return slot;
+	}
+#endif
+
+	bool holds(std::size_t slot, const Key &key, std::false_type) const
+	{
+		return slot != none && !Compare::less(key, keys[slot]);
+	}
+
+	// Padding repeats the largest key, but the search stops at the real one before it
+	bool holds(std::size_t slot, const Key &key, std::true_type) const
+	{
+		return slot != none && keys[slot] == key && (key != std::numeric_limits<Key>::max() || slot == max_slot);
+	}
+
+public:
+	// Entries must come in strictly increasing key order
+	template<typename Iterator>
+	FrozenTree(Iterator begin, Iterator end)
+		: count(std::distance(begin, end))
+		, block_count(0)
+		, min_slot(none)
+		, max_slot(none)
+	{
+		build(begin, uses_blocks());
+	}
+
+	std::size_t size() const
+	{
+		return count;
+	}
+
+	bool empty() const
+	{
+		return !count;
+	}
+
+	const Value *find(const Key &key) const
+	{
+		if (!count)
+			return nullptr;
+
+		auto slot = lower_bound_slot(key, uses_blocks());
+		return holds(slot, key, uses_blocks()) ? &values[slot] : nullptr;
+	}
+
+	const Value *min() const
+	{
+		return count ? &values[min_slot] : nullptr;
+	}
+
+	const Value *max() const
+	{
+		return count ? &values[max_slot] : nullptr;
+	}
+};
+
+} // namespace search_trees
@@ -0,0 +1,521 @@
+#pragma once
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "compare.hpp"
+#include "ordered-tree.hpp"
+#include "snapshot.hpp"
+
+#ifdef min
+#undef min
+#endif
+
+#ifdef max
+#undef max
+#endif
+
+namespace search_trees
+{
+
+namespace detail
+{
+
+// Read-only view of a whole file. Pages come from the page cache, shared with every other
+// process mapping the same file.
+class FileMapping
+{
+	const char *bytes;
+	std::size_t length;
+#ifdef _WIN32
+	HANDLE file, mapping;
+#endif
+
+public:
+	FileMapping()
+		: bytes(nullptr)
+		, length(0)
+	{}
+
+	FileMapping(const FileMapping &) = delete;
+	FileMapping &operator=(const FileMapping &) = delete;
+
+	~FileMapping()
+	{
+		close();
+	}
+
+	bool open(const std::string &path)
+	{
+		close();
+
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER size;
+		mapping = nullptr;
+		if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+			mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		auto view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+		if (!view) {
+			if (mapping)
+				CloseHandle(mapping);
+			CloseHandle(file);
+			return false;
+		}
+
+		bytes = static_cast<const char *>(view);
+		length = size.QuadPart;
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		struct stat info;
+		void *view = MAP_FAILED;
+		if (fstat(fd, &info) == 0 && info.st_size > 0)
+			view = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		// The mapping stays valid without the descriptor
+		::close(fd);
+		if (view == MAP_FAILED)
+			return false;
+
+		bytes = static_cast<const char *>(view);
+		length = info.st_size;
+#endif
+
+		return true;
+	}
+
+	void close()
+	{
+		if (!bytes)
+			return;
+
+#ifdef _WIN32
+		UnmapViewOfFile(bytes);
+		CloseHandle(mapping);
+		CloseHandle(file);
+#else
+		munmap(const_cast<char *>(bytes), length);
+#endif
+		bytes = nullptr;
+		length = 0;
+	}
+
+	const char *data() const
+	{
+		return bytes;
+	}
+
+	std::size_t size() const
+	{
+		return length;
+	}
+};
+
+struct MappedHeader
+{
+	char magic[4];
+	std::uint32_t version;
+	std::uint32_t byte_order;
+	std::uint32_t key_bytes;
+	std::uint32_t value_bytes;
+	std::uint32_t node_bytes;
+	std::uint64_t count;
+	std::uint64_t root;
+};
+
+} // namespace detail
+
+// Read-only tree served straight from a file written by write(). open() maps the file
+// instead of reading it, so only the pages a query touches are loaded, and processes
+// mapping the same file share one copy in the page cache. The file is a header and nodes
+// of NodeBytes each: full leaves in key order, the last one possibly partial, then the
+// inner levels bottom up with child links stored as file offsets. Key and Value must be
+// trivially copyable and default constructible, and files only open on machines with
+// the same type sizes and byte order.
+template<typename Key, typename Value, std::size_t NodeBytes = 4096, typename Compare = ThreeWayCompare>
+class MappedTree final: public OrderedTree<MappedTree<Key, Value, NodeBytes, Compare>, Key, const Value, Compare>
+{
+	friend class OrderedTree<MappedTree, Key, const Value, Compare>;
+	friend class TreeIterator<MappedTree, Key, const Value>;
+
+	static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+			"keys and values are used in place");
+
+	static constexpr std::size_t leaf_capacity = (NodeBytes - alignof(Value)) / (sizeof(Key) + sizeof(Value));
+	static constexpr std::size_t fanout =
+			(NodeBytes - 2 * sizeof(std::uint64_t) + sizeof(Key)) / (sizeof(Key) + sizeof(std::uint64_t));
+
+	// Entries of a leaf follow from its place, every leaf but the last is full
+	struct Leaf
+	{
+		Key keys[leaf_capacity];
+		Value values[leaf_capacity];
+	};
+
+	// Everything under children[i] is below keys[i], everything under children[i + 1] is not
+	struct Inner
+	{
+		std::uint64_t count;
+		Key keys[fanout - 1];
+		std::uint64_t children[fanout];
+	};
+
+	static_assert(leaf_capacity >= 2 && fanout >= 3 && sizeof(Leaf) <= NodeBytes && sizeof(Inner) <= NodeBytes
+			&& sizeof(detail::MappedHeader) <= NodeBytes, "NodeBytes is too small for Key and Value");
+	static_assert(NodeBytes % alignof(Leaf) == 0 && NodeBytes % alignof(Inner) == 0,
+			"NodeBytes must keep every node aligned");
+
+	detail::FileMapping file;
+	std::uint64_t count;
+	std::uint64_t root;
+	std::size_t leaf_count;
+	unsigned height;
+
+	static detail::MappedHeader make_header(std::uint64_t count, std::uint64_t root)
+	{
+		return detail::MappedHeader{{'S', 'T', 'M', 'T'}, 1, 0x01020304, sizeof(Key), sizeof(Value), NodeBytes,
+				count, root};
+	}
+
+	// Nodes on each level from the leaves up, the same for writing and checking a file
+	static std::vector<std::uint64_t> level_sizes(std::uint64_t count)
+	{
+		std::vector<std::uint64_t> sizes;
+		if (!count)
+			return sizes;
+
+		sizes.push_back((count + leaf_capacity - 1) / leaf_capacity);
+		while (sizes.back() > 1)
+			sizes.push_back((sizes.back() + fanout - 1) / fanout);
+		return sizes;
+	}
+
+	static bool write_node(std::filebuf &out, const void *node, std::size_t bytes)
+	{
+		static const char padding[NodeBytes] = {};
+		return out.sputn(static_cast<const char *>(node), bytes) == std::streamsize(bytes)
+				&& out.sputn(padding, NodeBytes - bytes) == std::streamsize(NodeBytes - bytes);
+	}
+
+	template<typename K>
+	static std::size_t lower_index(const Key *keys, std::size_t count, const K &key)
+	{
+		return std::lower_bound(keys, keys + count, key, CompareLess<Compare>()) - keys;
+	}
+
+	template<typename K>
+	static std::size_t upper_index(const Key *keys, std::size_t count, const K &key)
+	{
+		return std::upper_bound(keys, keys + count, key, CompareLess<Compare>()) - keys;
+	}
+
+	const Leaf *leaf(std::size_t index) const
+	{
+		return reinterpret_cast<const Leaf *>(file.data() + (index + 1) * NodeBytes);
+	}
+
+	std::size_t leaf_index(const void *node) const
+	{
+		return (static_cast<const char *>(node) - file.data()) / NodeBytes - 1;
+	}
+
+	std::size_t entries_in(std::size_t index) const
+	{
+		return index + 1 < leaf_count ? leaf_capacity : count - (leaf_count - 1) * leaf_capacity;
+	}
+
+	// Every link must lead one level down, so descents stay inside the file whatever it holds.
+	// Only the inner levels are read, the leaves are left to be paged in by queries.
+	bool check_structure(const std::vector<std::uint64_t> &sizes) const
+	{
+		std::uint64_t first = 1;
+		for (std::size_t level = 1; level < sizes.size(); ++level) {
+			auto below = first;
+			first += sizes[level - 1];
+			for (auto node = first; node < first + sizes[level]; ++node) {
+				auto inner = reinterpret_cast<const Inner *>(file.data() + node * NodeBytes);
+				if (inner->count >= fanout)
+					return false;
+				for (std::size_t i = 0; i <= inner->count; ++i) {
+					auto child = inner->children[i];
+					if (child % NodeBytes || child / NodeBytes < below || child / NodeBytes >= first)
+						return false;
+				}
+			}
+		}
+
+		return root == (first + sizes.back() - 1) * NodeBytes;
+	}
+
+	template<typename K>
+	std::size_t find_leaf(const K &key) const
+	{
+		auto offset = root;
+		for (unsigned level = 1; level < height; ++level) {
+			auto inner = reinterpret_cast<const Inner *>(file.data() + offset);
+			offset = inner->children[upper_index(inner->keys, inner->count, key)];
+		}
+
+		return offset / NodeBytes - 1;
+	}
+
+	using typename OrderedTree<MappedTree, Key, const Value, Compare>::Position;
+
+	Position position(std::size_t index, std::size_t entry) const
+	{
+		if (entry == entries_in(index))
+			return ++index < leaf_count ? position(index, 0) : Position{nullptr, 0};
+
+		return Position{const_cast<Leaf *>(leaf(index)), static_cast<unsigned>(entry)};
+	}
+
+	Position first_position() const
+	{
+		return count ? position(0, 0) : Position{nullptr, 0};
+	}
+
+	template<typename K>
+	Position lower_bound_position(const K &key) const
+	{
+		if (!count)
+			return Position{nullptr, 0};
+
+		auto index = find_leaf(key);
+		return position(index, lower_index(leaf(index)->keys, entries_in(index), key));
+	}
+
+	template<typename K>
+	Position upper_bound_position(const K &key) const
+	{
+		if (!count)
+			return Position{nullptr, 0};
+
+		auto index = find_leaf(key);
+		return position(index, upper_index(leaf(index)->keys, entries_in(index), key));
+	}
+
+	void next_position(Position &position) const
+	{
+		position = this->position(leaf_index(position.node), position.index + 1);
+	}
+
+	void prev_position(Position &position) const
+	{
+		if (position.index > 0) {
+			--position.index;
+			return;
+		}
+
+		auto index = position.node ? leaf_index(position.node) : leaf_count;
+		if (index == 0)
+			position = Position{nullptr, 0};
+		else
+			position = this->position(index - 1, entries_in(index - 1) - 1);
+	}
+
+	const Key &key_at(const Position &position) const
+	{
+		return static_cast<const Leaf *>(position.node)->keys[position.index];
+	}
+
+	const Value &value_at(const Position &position) const
+	{
+		return static_cast<const Leaf *>(position.node)->values[position.index];
+	}
+
+public:
+	using key_type = Key;
+	using mapped_type = Value;
+	using key_compare = Compare;
+
+	MappedTree()
+		: count(0)
+		, root(0)
+		, leaf_count(0)
+		, height(0)
+	{}
+
+	MappedTree(const MappedTree &) = delete;
+	MappedTree &operator=(const MappedTree &) = delete;
+
+	// Writes the (key, value) pairs of [begin, end), which must be in strictly increasing key
+	// order, as a file open() can map. Like save() the file only replaces path once complete.
+	template<typename Iterator>
+	static bool write(const std::string &path, Iterator begin, Iterator end)
+	{
+		auto temporary = path + ".tmp";
+		std::vector<char> buffer(detail::snapshot_buffer_bytes);
+		std::filebuf out;
+		out.pubsetbuf(buffer.data(), buffer.size());
+		if (!out.open(temporary, std::ios::out | std::ios::binary | std::ios::trunc))
+			return false;
+
+		// The header goes in last
+		auto header = make_header(0, 0);
+		auto good = write_node(out, &header, sizeof(header));
+
+		// Offset and smallest key of each node on the level being written
+		std::vector<std::uint64_t> offsets, parent_offsets;
+		std::vector<Key> lows, parent_lows;
+		std::uint64_t offset = NodeBytes;
+
+		std::unique_ptr<Leaf> leaf(new Leaf());
+		std::size_t filled = 0;
+		Key previous = Key();
+		for (; good && begin != end; ++begin, ++header.count) {
+			if (filled == leaf_capacity) {
+				good = write_node(out, leaf.get(), sizeof(Leaf));
+				*leaf = Leaf();
+				filled = 0;
+			}
+
+			Key key = (*begin).first;
+			if (header.count && !Compare::less(previous, key))
+				good = false;
+			previous = key;
+			if (!filled) {
+				offsets.push_back(offset);
+				lows.push_back(key);
+				offset += NodeBytes;
+			}
+
+			leaf->keys[filled] = key;
+			leaf->values[filled++] = (*begin).second;
+		}
+		if (filled)
+			good = good && write_node(out, leaf.get(), sizeof(Leaf));
+
+		std::unique_ptr<Inner> inner(new Inner());
+		while (good && offsets.size() > 1) {
+			auto nodes = (offsets.size() + fanout - 1) / fanout;
+			std::size_t next = 0;
+			for (std::size_t i = 0; good && i < nodes; ++i) {
+				auto children = offsets.size() - next < fanout ? offsets.size() - next : fanout;
+				*inner = Inner();
+				inner->count = children - 1;
+				inner->children[0] = offsets[next];
+				for (std::size_t j = 1; j < children; ++j) {
+					inner->keys[j - 1] = lows[next + j];
+					inner->children[j] = offsets[next + j];
+				}
+
+				parent_offsets.push_back(offset);
+				parent_lows.push_back(lows[next]);
+				offset += NodeBytes;
+				next += children;
+				good = write_node(out, inner.get(), sizeof(Inner));
+			}
+
+			offsets.swap(parent_offsets);
+			lows.swap(parent_lows);
+			parent_offsets.clear();
+			parent_lows.clear();
+		}
+
+		header.root = offsets.empty() ? 0 : offsets[0];
+		good = good && out.pubseekpos(0, std::ios::out) == std::streampos(0) && write_node(out, &header, sizeof(header));
+		good = out.close() && good;
+		return detail::replace_file(temporary, path, good);
+	}
+
+	// Maps a file written by write(). Returns false, leaving the tree empty, if the file is
+	// missing or was not written for these types and NodeBytes.
+	bool open(const std::string &path)
+	{
+		close();
+		if (!file.open(path))
+			return false;
+
+		detail::MappedHeader header;
+		auto expected = make_header(0, 0);
+		if (file.size() >= NodeBytes)
+			std::copy(file.data(), file.data() + sizeof(header), reinterpret_cast<char *>(&header));
+		if (file.size() < NodeBytes || !std::equal(expected.magic, expected.magic + 4, header.magic)
+				|| header.version != expected.version || header.byte_order != expected.byte_order
+				|| header.key_bytes != expected.key_bytes || header.value_bytes != expected.value_bytes
+				|| header.node_bytes != expected.node_bytes || header.count > file.size()) {
+			close();
+			return false;
+		}
+
+		auto sizes = level_sizes(header.count);
+		std::uint64_t nodes = 1;
+		for (auto size : sizes)
+			nodes += size;
+		if (file.size() != nodes * NodeBytes) {
+			close();
+			return false;
+		}
+
+		count = header.count;
+		root = header.root;
+		leaf_count = sizes.empty() ? 0 : sizes[0];
+		height = sizes.size();
+		if (count && !check_structure(sizes)) {
+			close();
+			return false;
+		}
+
+		return true;
+	}
+
+	void close()
+	{
+		file.close();
+		count = 0;
+		root = 0;
+		leaf_count = 0;
+		height = 0;
+	}
+
+	std::size_t size() const
+	{
+		return count;
+	}
+
+	const Value *find(const Key &key) const
+	{
+		if (!count)
+			return nullptr;
+
+		auto index = find_leaf(key);
+		auto node = leaf(index);
+		auto entry = lower_index(node->keys, entries_in(index), key);
+		if (entry < entries_in(index) && Compare::compare(key, node->keys[entry]) == 0)
+			return &node->values[entry];
+
+		return nullptr;
+	}
+
+	const Value *min() const
+	{
+		return count ? &leaf(0)->values[0] : nullptr;
+	}
+
+	const Value *max() const
+	{
+		return count ? &leaf(leaf_count - 1)->values[entries_in(leaf_count - 1) - 1] : nullptr;
+	}
+};
+
+} // namespace search_trees
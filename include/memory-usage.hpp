@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace search_trees
+{
+
+// Heap bytes an object owns beyond sizeof itself. Zero unless specialized; specialize it for
+// key and value types that keep storage elsewhere so memory_usage() can count it.
+template<typename T>
+struct HeapSize
+{
+	static std::size_t of(const T &)
+	{
+		return 0;
+	}
+};
+
+template<typename T>
+std::size_t heap_size(const T &object)
+{
+	return HeapSize<T>::of(object);
+}
+
+// Short strings live inside the object and own nothing
+template<typename Char, typename Traits, typename Alloc>
+struct HeapSize<std::basic_string<Char, Traits, Alloc>>
+{
+	static std::size_t of(const std::basic_string<Char, Traits, Alloc> &string)
+	{
+		auto data = reinterpret_cast<const unsigned char *>(string.data());
+		auto object = reinterpret_cast<const unsigned char *>(&string);
+		std::less<const unsigned char *> less;
+		if (!less(data, object) && less(data, object + sizeof(string)))
+			return 0;
+
+		return (string.capacity() + 1) * sizeof(Char);
+	}
+};
+
+template<typename T, typename Alloc>
+struct HeapSize<std::vector<T, Alloc>>
+{
+	static std::size_t of(const std::vector<T, Alloc> &vector)
+	{
+		auto bytes = vector.capacity() * sizeof(T);
+		for (auto &item : vector)
+			bytes += heap_size(item);
+		return bytes;
+	}
+};
+
+// Memory a tree takes, as the blocks it allocated. What the allocator keeps for itself, such
+// as malloc headers or pool chunks not handed out yet, is not included.
+struct MemoryUsage
+{
+	std::size_t entries = 0;
+	std::size_t nodes = 0;
+
+	// Blocks allocated apart from the nodes, one per value when the layout keeps values out
+	std::size_t value_blocks = 0;
+
+	// Keys and values, with what they own on the heap
+	std::size_t key_bytes = 0;
+	std::size_t value_bytes = 0;
+
+	// Everything else in the nodes: links, colors, summaries, padding, unused slots and the
+	// separator keys of inner nodes
+	std::size_t overhead_bytes = 0;
+
+	std::size_t total_bytes() const
+	{
+		return key_bytes + value_bytes + overhead_bytes;
+	}
+
+	double bytes_per_key() const
+	{
+		return entries ? static_cast<double>(total_bytes()) / entries : 0;
+	}
+
+	// Counts an entry whose key sits in a node and whose value sits in a node or block of its own
+	template<typename Key, typename Value>
+	void add_entry(const Key &key, const Value &value, bool value_block)
+	{
+		++entries;
+		key_bytes += sizeof(Key) + heap_size(key);
+		value_bytes += sizeof(Value) + heap_size(value);
+		value_blocks += value_block;
+	}
+
+	// Counts a node of the given size, of which entry_bytes belong to entries counted by add_entry
+	void add_node(std::size_t bytes, std::size_t entry_bytes)
+	{
+		++nodes;
+		overhead_bytes += bytes - entry_bytes;
+	}
+};
+
+} // namespace search_trees
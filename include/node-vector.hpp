@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace search_trees
+{
+
+// Nodes of the compact trees, kept in one vector and named by 32-bit indices instead of
+// pointers. Index 0 is a default-constructed sentinel standing for no node, and indices
+// stop at max_index so that the trees can keep flags in the bits above. Freed slots are
+// handed out again before the vector grows. An index stays valid until its node is freed,
+// a reference into the vector only until the next allocate().
+template<typename Node, std::uint32_t max_index = 0x7fffffff>
+class NodeVector
+{
+	std::vector<Node> nodes;
+	std::vector<std::uint32_t> free_slots;
+
+public:
+	using Index = std::uint32_t;
+
+	static constexpr Index none = 0;
+
+	NodeVector()
+		: nodes(1)
+	{}
+
+	Node &operator[](Index index)
+	{
+		return nodes[index];
+	}
+
+	const Node &operator[](Index index) const
+	{
+		return nodes[index];
+	}
+
+	template<typename ...Args>
+	Index allocate(Args &&...args)
+	{
+		if (!free_slots.empty()) {
+			auto index = free_slots.back();
+			free_slots.pop_back();
+			nodes[index] = Node(std::forward<Args>(args)...);
+			return index;
+		}
+
+		assert(nodes.size() <= max_index);
+		nodes.emplace_back(std::forward<Args>(args)...);
+		return Index(nodes.size() - 1);
+	}
+
+	// Resets the node, so that whatever its keys and values own is given back right away
+	void deallocate(Index index)
+	{
+		nodes[index] = Node();
+		free_slots.push_back(index);
+	}
+
+	void clear()
+	{
+		nodes.resize(1);
+		free_slots.clear();
+	}
+
+	void reserve(std::size_t count)
+	{
+		nodes.reserve(count + 1);
+	}
+
+	// Nodes in use
+	std::size_t size() const
+	{
+		return nodes.size() - 1 - free_slots.size();
+	}
+
+	void swap(NodeVector &other)
+	{
+		nodes.swap(other.nodes);
+		free_slots.swap(other.free_slots);
+	}
+};
+
+} // namespace search_trees
@@ -0,0 +1,246 @@
+#pragma once
+
+#include <cstddef>
+#include <iterator>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "frozen-tree.hpp"
+#include "snapshot.hpp"
+
+namespace search_trees
+{
+
+// Opaque location of an entry inside a tree, node is null past the end
+struct TreePosition
+{
+	void *node;
+	unsigned index;
+
+	bool operator==(const TreePosition &other) const
+	{
+		return node == other.node && index == other.index;
+	}
+};
+
+template<typename Tree, typename Key, typename Value, typename Compare>
+class OrderedTree;
+
+// Bidirectional iterator over the entries of Tree in key order. Tree provides the position
+// hooks; with a concrete tree they are ordinary member calls, with SearchTree virtual ones.
+// With a const Value it is the const_iterator, which an iterator converts to.
+template<typename Tree, typename Key, typename Value>
+class TreeIterator
+{
+	template<typename, typename, typename, typename>
+	friend class OrderedTree;
+
+	template<typename, typename, typename>
+	friend class TreeIterator;
+
+	const Tree *tree;
+	TreePosition position;
+
+	TreeIterator(const Tree *tree, const TreePosition &position)
+		: tree(tree)
+		, position(position)
+	{}
+
+public:
+	using iterator_category = std::bidirectional_iterator_tag;
+	using value_type = std::pair<const Key, typename std::remove_const<Value>::type>;
+	using difference_type = std::ptrdiff_t;
+	using reference = std::pair<const Key &, Value &>;
+
+	struct pointer
+	{
+		reference entry;
+
+		reference *operator->()
+		{
+			return &entry;
+		}
+	};
+
+	TreeIterator()
+		: tree(nullptr)
+		, position{nullptr, 0}
+	{}
+
+	template<typename V, typename = typename std::enable_if<std::is_same<const V, Value>::value>::type>
+	TreeIterator(const TreeIterator<Tree, Key, V> &other)
+		: tree(other.tree)
+		, position(other.position)
+	{}
+
+	const Key &key() const
+	{
+		return tree->key_at(position);
+	}
+
+	Value &value() const
+	{
+		return tree->value_at(position);
+	}
+
+	reference operator*() const
+	{
+		return reference(key(), value());
+	}
+
+	pointer operator->() const
+	{
+		return pointer{**this};
+	}
+
+	TreeIterator &operator++()
+	{
+		tree->next_position(position);
+		return *this;
+	}
+
+	TreeIterator operator++(int)
+	{
+		auto it = *this;
+		++*this;
+		return it;
+	}
+
+	TreeIterator &operator--()
+	{
+		tree->prev_position(position);
+		return *this;
+	}
+
+	TreeIterator operator--(int)
+	{
+		auto it = *this;
+		--*this;
+		return it;
+	}
+
+	template<typename V>
+	bool operator==(const TreeIterator<Tree, Key, V> &other) const
+	{
+		return position == other.position;
+	}
+
+	template<typename V>
+	bool operator!=(const TreeIterator<Tree, Key, V> &other) const
+	{
+		return !(*this == other);
+	}
+};
+
+// Iteration and snapshots shared by all trees. Derived provides first_position,
+// lower_bound_position, upper_bound_position, next_position, prev_position, key_at
+// and value_at, and befriends this class and its TreeIterator for Value and const Value.
+// Derived trees that name a transparent key_compare also get the bounds for keys of other
+// types.
+template<typename Derived, typename Key, typename Value, typename Compare>
+class OrderedTree
+{
+	friend Derived;
+
+	OrderedTree() = default;
+
+	const Derived &derived() const
+	{
+		return static_cast<const Derived &>(*this);
+	}
+
+protected:
+	using Position = TreePosition;
+
+	template<typename V = Value>
+	TreeIterator<Derived, Key, V> make_iterator(const Position &position) const
+	{
+		return TreeIterator<Derived, Key, V>(&derived(), position);
+	}
+
+public:
+	using iterator = TreeIterator<Derived, Key, Value>;
+	using const_iterator = TreeIterator<Derived, Key, const Value>;
+
+	iterator begin()
+	{
+		return make_iterator(derived().first_position());
+	}
+
+	iterator end()
+	{
+		return make_iterator(Position{nullptr, 0});
+	}
+
+	// First entry whose key is not less than key
+	iterator lower_bound(const Key &key)
+	{
+		return make_iterator(derived().lower_bound_position(key));
+	}
+
+	// First entry whose key is greater than key
+	iterator upper_bound(const Key &key)
+	{
+		return make_iterator(derived().upper_bound_position(key));
+	}
+
+	template<typename K, typename D = Derived, typename = typename D::key_compare::is_transparent>
+	iterator lower_bound(const K &key)
+	{
+		return make_iterator(derived().lower_bound_position(key));
+	}
+
+	template<typename K, typename D = Derived, typename = typename D::key_compare::is_transparent>
+	iterator upper_bound(const K &key)
+	{
+		return make_iterator(derived().upper_bound_position(key));
+	}
+
+	const_iterator begin() const
+	{
+		return make_iterator<const Value>(derived().first_position());
+	}
+
+	const_iterator end() const
+	{
+		return make_iterator<const Value>(Position{nullptr, 0});
+	}
+
+	const_iterator lower_bound(const Key &key) const
+	{
+		return make_iterator<const Value>(derived().lower_bound_position(key));
+	}
+
+	const_iterator upper_bound(const Key &key) const
+	{
+		return make_iterator<const Value>(derived().upper_bound_position(key));
+	}
+
+	template<typename K, typename D = Derived, typename = typename D::key_compare::is_transparent>
+	const_iterator lower_bound(const K &key) const
+	{
+		return make_iterator<const Value>(derived().lower_bound_position(key));
+	}
+
+	template<typename K, typename D = Derived, typename = typename D::key_compare::is_transparent>
+	const_iterator upper_bound(const K &key) const
+	{
+		return make_iterator<const Value>(derived().upper_bound_position(key));
+	}
+
+	// Writes the entries in key order to a binary snapshot at path, see snapshot.hpp. The
+	// trees' load() reads it back in linear time.
+	bool save(const std::string &path) const
+	{
+		return save_snapshot<Key, Value>(path, begin(), end());
+	}
+
+	// Read-only copy of the current entries laid out for fast lookups
+	FrozenTree<Key, Value, Compare> freeze() const
+	{
+		return FrozenTree<Key, Value, Compare>(begin(), end());
+	}
+};
+
+} // namespace search_trees
@@ -0,0 +1,429 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "compare.hpp"
+
+namespace search_trees
+{
+
+// Left-leaning red-black tree with path copying. An update copies the nodes on its path and
+// shares every other subtree with the previous version, then publishes the new root. Readers
+// take a Snapshot, which pins one version through reference counts and needs no locks while
+// it is searched or scanned. A version's nodes are freed once neither the tree nor any
+// snapshot reaches them, by whichever thread drops the last reference.
+//
+// One thread may update the tree at a time, any number may take and use snapshots. Nodes are
+// copied whole, so Key and Value should be cheap to copy.
+template<typename Key, typename Value, typename Compare = ThreeWayCompare>
+class PersistentRedBlackTree
+{
+	struct Node
+	{
+		enum class Color : bool
+		{
+			RED,
+			BLACK
+		};
+
+		Key key;
+		Value value;
+		Node *left, *right;
+		Color color;
+		std::atomic<unsigned> refs;
+		// Update that created the node, only nodes of the running update may change in place
+		std::uint64_t version;
+
+		template<typename KeyT, typename ValueT>
+		Node(KeyT &&key, ValueT &&value, std::uint64_t version)
+			: key(std::forward<KeyT>(key))
+			, value(std::forward<ValueT>(value))
+			, left(nullptr)
+			, right(nullptr)
+			, color(Color::RED)
+			, refs(1)
+			, version(version)
+		{}
+
+		Node(const Node &other, std::uint64_t version)
+			: key(other.key)
+			, value(other.value)
+			, left(other.left)
+			, right(other.right)
+			, color(other.color)
+			, refs(1)
+			, version(version)
+		{
+			retain(left);
+			retain(right);
+		}
+	};
+
+	using Color = typename Node::Color;
+
+	static void retain(Node *node)
+	{
+		if (node)
+			node->refs.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	static void release(Node *node)
+	{
+		while (node && node->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			release(node->left);
+			auto right = node->right;
+			delete node;
+			node = right;
+		}
+	}
+
+	// One published root, freed with the last snapshot holding it
+	struct Version
+	{
+		Node *root;
+
+		explicit Version(Node *root)
+			: root(root)
+		{
+			retain(root);
+		}
+
+		Version(const Version &) = delete;
+		Version &operator=(const Version &) = delete;
+
+		~Version()
+		{
+			release(root);
+		}
+	};
+
+	template<typename K>
+	static const Node *find_node(const Node *node, const K &key)
+	{
+		while (node) {
+			auto order = Compare::compare(key, node->key);
+			if (order == 0)
+				return node;
+			node = order < 0 ? node->left : node->right;
+		}
+
+		return nullptr;
+	}
+
+	// Calls f(key, value) for the keys of the subtree not less than lo (if given) and not
+	// greater than hi (if given), in order
+	template<typename Function>
+	static void for_each_in(const Node *node, const Key *lo, const Key *hi, Function &f)
+	{
+		std::vector<const Node *> path;
+		for (;;) {
+			while (node) {
+				if (lo && Compare::less(node->key, *lo)) {
+					node = node->right;
+				} else {
+					path.push_back(node);
+					node = node->left;
+				}
+			}
+
+			if (path.empty())
+				return;
+
+			node = path.back();
+			path.pop_back();
+			if (hi && Compare::less(*hi, node->key))
+				return;
+
+			f(node->key, node->value);
+			node = node->right;
+		}
+	}
+
+	Node *root;
+	std::shared_ptr<const Version> current;
+	std::uint64_t version;
+
+	static bool is_red(const Node *node)
+	{
+		return node && node->color == Color::RED;
+	}
+
+	// Makes the node behind link one the running update may change, copying it if needed
+	void own(Node *&link)
+	{
+		if (!link || link->version == version)
+			return;
+
+		auto copy = new Node(*link, version);
+		release(link);
+		link = copy;
+	}
+
+	// The helpers below take and return nodes of the running update
+
+	Node *rotate_left(Node *node)
+	{
+		own(node->right);
+		auto right = node->right;
+		node->right = right->left;
+		right->left = node;
+		right->color = node->color;
+		node->color = Color::RED;
+		return right;
+	}
+
+	Node *rotate_right(Node *node)
+	{
+		own(node->left);
+		auto left = node->left;
+		node->left = left->right;
+		left->right = node;
+		left->color = node->color;
+		node->color = Color::RED;
+		return left;
+	}
+
+	static Color flipped(Color color)
+	{
+		return color == Color::RED ? Color::BLACK : Color::RED;
+	}
+
+	void flip_colors(Node *node)
+	{
+		own(node->left);
+		own(node->right);
+		node->color = flipped(node->color);
+		node->left->color = flipped(node->left->color);
+		node->right->color = flipped(node->right->color);
+	}
+
+	Node *balance(Node *node)
+	{
+		if (is_red(node->right) && !is_red(node->left))
+			node = rotate_left(node);
+		if (is_red(node->left) && is_red(node->left->left))
+			node = rotate_right(node);
+		if (is_red(node->left) && is_red(node->right))
+			flip_colors(node);
+		return node;
+	}
+
+	template<typename KeyT, typename ValueT>
+	Node *insert_into(Node *node, KeyT &&key, ValueT &&value)
+	{
+		if (!node)
+			return new Node(std::forward<KeyT>(key), std::forward<ValueT>(value), version);
+
+		own(node);
+		auto order = Compare::compare(key, node->key);
+		if (order == 0) {
+			node->value = std::forward<ValueT>(value);
+			return node;
+		} else if (order < 0) {
+			node->left = insert_into(node->left, std::forward<KeyT>(key), std::forward<ValueT>(value));
+		} else {
+			node->right = insert_into(node->right, std::forward<KeyT>(key), std::forward<ValueT>(value));
+		}
+
+		return balance(node);
+	}
+
+	// Makes the left child or one of its children red, node must be red with a black left child
+	Node *move_red_left(Node *node)
+	{
+		flip_colors(node);
+		if (is_red(node->right->left)) {
+			node->right = rotate_right(node->right);
+			node = rotate_left(node);
+			flip_colors(node);
+		}
+		return node;
+	}
+
+	Node *move_red_right(Node *node)
+	{
+		flip_colors(node);
+		if (is_red(node->left->left)) {
+			node = rotate_right(node);
+			flip_colors(node);
+		}
+		return node;
+	}
+
+	Node *remove_min(Node *node)
+	{
+		if (!node->left) {
+			release(node);
+			return nullptr;
+		}
+
+		if (!is_red(node->left) && !is_red(node->left->left))
+			node = move_red_left(node);
+		own(node->left);
+		node->left = remove_min(node->left);
+		return balance(node);
+	}
+
+	// Removes key, which must be in the subtree of node
+	Node *remove_from(Node *node, const Key &key)
+	{
+		if (Compare::less(key, node->key)) {
+			if (!is_red(node->left) && !is_red(node->left->left))
+				node = move_red_left(node);
+			own(node->left);
+			node->left = remove_from(node->left, key);
+		} else {
+			if (is_red(node->left))
+				node = rotate_right(node);
+			if (!node->right && Compare::compare(key, node->key) == 0) {
+				release(node);
+				return nullptr;
+			}
+			if (!is_red(node->right) && !is_red(node->right->left))
+				node = move_red_right(node);
+			own(node->right);
+			if (Compare::compare(key, node->key) == 0) {
+				auto min = node->right;
+				while (min->left)
+					min = min->left;
+				node->key = min->key;
+				node->value = min->value;
+				node->right = remove_min(node->right);
+			} else {
+				node->right = remove_from(node->right, key);
+			}
+		}
+
+		return balance(node);
+	}
+
+	void publish()
+	{
+		std::atomic_store(&current, std::shared_ptr<const Version>(std::make_shared<Version>(root)));
+	}
+
+public:
+	// Read-only view of the tree as it was when the snapshot was taken
+	class Snapshot
+	{
+		friend class PersistentRedBlackTree;
+
+		std::shared_ptr<const Version> version;
+
+		explicit Snapshot(std::shared_ptr<const Version> version)
+			: version(std::move(version))
+		{}
+
+	public:
+		bool empty() const
+		{
+			return !version->root;
+		}
+
+		const Value *find(const Key &key) const
+		{
+			auto node = find_node(version->root, key);
+			return node ? &node->value : nullptr;
+		}
+
+		template<typename K, typename C = Compare, typename = typename C::is_transparent>
+		const Value *find(const K &key) const
+		{
+			auto node = find_node(version->root, key);
+			return node ? &node->value : nullptr;
+		}
+
+		const Value *min() const
+		{
+			auto node = version->root;
+			if (!node)
+				return nullptr;
+			while (node->left)
+				node = node->left;
+			return &node->value;
+		}
+
+		const Value *max() const
+		{
+			auto node = version->root;
+			if (!node)
+				return nullptr;
+			while (node->right)
+				node = node->right;
+			return &node->value;
+		}
+
+		// Calls f(key, value) for every entry in key order
+		template<typename Function>
+		void for_each(Function f) const
+		{
+			for_each_in(version->root, nullptr, nullptr, f);
+		}
+
+		// Same for the entries with keys in [lo, hi]
+		template<typename Function>
+		void for_each(const Key &lo, const Key &hi, Function f) const
+		{
+			for_each_in(version->root, &lo, &hi, f);
+		}
+	};
+
+	PersistentRedBlackTree()
+		: root(nullptr)
+		, version(0)
+	{
+		publish();
+	}
+
+	PersistentRedBlackTree(const PersistentRedBlackTree &) = delete;
+	PersistentRedBlackTree &operator=(const PersistentRedBlackTree &) = delete;
+
+	~PersistentRedBlackTree()
+	{
+		release(root);
+	}
+
+	// Current version, safe to call from any thread
+	Snapshot snapshot() const
+	{
+		return Snapshot(std::atomic_load(&current));
+	}
+
+	template<typename KeyT, typename ValueT>
+	void insert(KeyT &&key, ValueT &&value)
+	{
+		++version;
+		root = insert_into(root, std::forward<KeyT>(key), std::forward<ValueT>(value));
+		root->color = Color::BLACK;
+		publish();
+	}
+
+	bool remove(const Key &key)
+	{
+		if (!find_node(root, key))
+			return false;
+
+		++version;
+		own(root);
+		if (!is_red(root->left) && !is_red(root->right))
+			root->color = Color::RED;
+		root = remove_from(root, key);
+		if (root)
+			root->color = Color::BLACK;
+		publish();
+		return true;
+	}
+
+	// Lookup in the latest version, for the updating thread
+	const Value *find(const Key &key) const
+	{
+		auto node = find_node(root, key);
+		return node ? &node->value : nullptr;
+	}
+};
+
+} // namespace search_trees
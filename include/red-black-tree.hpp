@@ -4,7 +4,16 @@
 #include <Windows.h>
 #endif
 
+#include <iostream>
+#include <string>
+#include <type_traits>
+
 #include "search-tree.hpp"
+#include "allocator.hpp"
+#include "augment.hpp"
+#include "data.hpp"
+#include "memory-usage.hpp"
+#include "stats.hpp"
 #include "util.hpp"
 
 #ifdef min
@@ -18,16 +27,22 @@
 namespace search_trees
 {
 
-template<typename Key, typename Value>
-class RedBlackTree final: public SearchTree<Key, Value>
+template<typename Key, typename Value, template<typename> class Allocator = HeapAllocator, typename Layout = InlineLayout,
+		typename Augment = NoAugment, typename Compare = ThreeWayCompare>
+class RedBlackTree final: public OrderedTree<RedBlackTree<Key, Value, Allocator, Layout, Augment, Compare>, Key, Value, Compare>
 {
-	struct Node;
-	using NodePtr = std::unique_ptr<Node>;
+	friend class OrderedTree<RedBlackTree, Key, Value, Compare>;
+	friend class TreeIterator<RedBlackTree, Key, Value>;
+	friend class TreeIterator<RedBlackTree, Key, const Value>;
+	friend class SearchTreeAdapter<RedBlackTree>;
+
+	using Entry = typename Layout::template Entry<Key, Value, Allocator>;
+	using Aggregate = typename Augment::type;
 
 	struct Node
 	{
-		DataPtr<Key, Value> data;
-		NodePtr left, right;
+		Entry data;
+		Node *left, *right;
 		Node *parent;
 
 		enum class Color {
@@ -35,111 +50,63 @@ class RedBlackTree final: public SearchTree<Key, Value>
 			BLACK
 		} color;
 
-		Node(DataPtr<Key, Value> &&data)
-			: data(std::move(data))
+		// Removed lazily, see set_lazy_remove()
+		bool dead;
+
+		SubtreeSummary<Augment> summary;
+
+		template<typename KeyT, typename ValueT>
+		Node(Allocator<Value> &allocator, KeyT &&key, ValueT &&value)
+			: data(allocator, std::forward<KeyT>(key), std::forward<ValueT>(value))
+			, left(nullptr)
+			, right(nullptr)
 			, parent(nullptr)
 			, color(Color::RED)
+			, dead(false)
 		{}
 
-		void set_left(NodePtr &&node) {
+		void set_left(Node *node) {
 			if (node)
 				node->parent = this;
-			left = std::move(node);
+			left = node;
 		}
 
-		void set_right(NodePtr &&node) {
+		void set_right(Node *node) {
 			if (node)
 				node->parent = this;
-			right = std::move(node);
+			right = node;
 		}
 
-		static void resolve_red_red_violation(Node *node)
+		// Node holding key, comparing key once with each node on the way
+		template<typename K>
+		Node *find(const K &key, OperationCounters &counters)
 		{
-			if (!node || node->color == Node::Color::BLACK)
-				return;
-
-			auto parent = node->parent;
-			if (!parent)
-				return;
-
-			if (node == parent->left.get()) {
-				if (node->left && node->left->color == Node::Color::RED) {
-					auto left = std::move(node->left);
-					auto right = std::move(parent->left);
-					node->set_left(std::move(node->right));
-					node->set_right(std::move(parent->right));
-					parent->set_left(std::move(left));
-					parent->set_right(std::move(right));
-					parent->data.swap(parent->right->data);
-				} else if (node->right && node->right->color == Node::Color::RED) {
-					auto right = std::move(parent->right);
-					parent->set_right(std::move(node->right));
-					node->set_right(std::move(parent->right->left));
-					parent->right->set_left(std::move(parent->right->right));
-					parent->right->set_right(std::move(right));
-					parent->data.swap(parent->right->data);
-				}
-			} else if (node == parent->right.get()) {
-				if (node->right && node->right->color == Node::Color::RED) {
-					auto left = std::move(std::move(parent->right));
-					auto right = std::move(node->right);
-					node->set_right(std::move(node->left));
-					node->set_left(std::move(parent->left));
-					parent->set_left(std::move(left));
-					parent->set_right(std::move(right));
-					parent->data.swap(parent->left->data);
-				} else if (node->left && node->left->color == Node::Color::RED) {
-					auto left = std::move(parent->left);
-					parent->set_left(std::move(node->left));
-					node->set_left(std::move(parent->left->right));
-					parent->left->set_right(std::move(parent->left->left));
-					parent->left->set_left(std::move(left));
-					parent->data.swap(parent->left->data);
-				}
+			auto node = this;
+			while (node) {
+				counters.visited();
+				counters.compared();
+				auto order = Compare::compare(key, node->data.key());
+				if (order == 0)
+					return node;
+				node = order < 0 ? node->left : node->right;
 			}
 
-			parent->left->color = Node::Color::BLACK;
-			parent->right->color = Node::Color::BLACK;
-			parent->color = Node::Color::RED;
-
-			resolve_red_red_violation(parent->parent);
-		}
-
-		void insert(NodePtr &&node)
-		{
-			if (node->data->key == data->key) {
-				data->value = std::move(node->data->value);
-			} else if (node->data->key < data->key) {
-				if (!left) {
-					set_left(std::move(node));
-					resolve_red_red_violation(this);
-				} else {
-					left->insert(std::move(node));
-				}
-			} else {
-				if (!right) {
-					set_right(std::move(node));
-					resolve_red_red_violation(this);
-				} else {
-					right->insert(std::move(node));
-				}
-			}
+			return nullptr;
 		}
 
-		Node *find(const Key &key)
+		// Last node on the way down to key, with how key compares with it
+		template<typename K>
+		Node *descend(const K &key, int &order, OperationCounters &counters)
 		{
-			if (key == data->key) {
-				return this;
-			} else if (key < data->key) {
-				if (left)
-					return left->find(key);
-				else
-					return nullptr;
-			} else {
-				if (right)
-					return right->find(key);
-				else
-					return nullptr;
+			auto node = this;
+			for (;;) {
+				counters.visited();
+				counters.compared();
+				order = Compare::compare(key, node->data.key());
+				auto next = order < 0 ? node->left : node->right;
+				if (order == 0 || !next)
+					return node;
+				node = next;
 			}
 		}
 
@@ -148,8 +115,8 @@ class RedBlackTree final: public SearchTree<Key, Value>
 			if (!right)
 				return this;
 
-			auto r = right.get();
-			for (; r->right; r = r->right.get());
+			auto r = right;
+			for (; r->right; r = r->right);
 			return r;
 		}
 
@@ -158,25 +125,29 @@ class RedBlackTree final: public SearchTree<Key, Value>
 			if (!left)
 				return this;
 
-			auto l = left.get();
-			for (; l->left; l = l->left.get());
+			auto l = left;
+			for (; l->left; l = l->left);
 			return l;
 		}
 
 		Node *predecessor() const
 		{
-			if (!left)
-				return nullptr;
+			if (left)
+				return left->max();
 
-			return left->max();
+			auto node = this;
+			for (; node->parent && node == node->parent->left; node = node->parent);
+			return node->parent;
 		}
 
 		Node *successor() const
 		{
-			if (!right)
-				return nullptr;
+			if (right)
+				return right->min();
 
-			return right->min();
+			auto node = this;
+			for (; node->parent && node == node->parent->right; node = node->parent);
+			return node->parent;
 		}
 
 		friend std::ostream &operator<<(std::ostream &stream, const Node &node)
@@ -186,16 +157,16 @@ class RedBlackTree final: public SearchTree<Key, Value>
 				#ifdef _WIN32
 					HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
 					SetConsoleTextAttribute(hConsole, 12);
-					stream << node.data->key;
+					stream << node.data.key();
 					SetConsoleTextAttribute(hConsole, 15);
 				#else
-					stream << "\033[31m" << node.data->key << "\033[0m";
+					stream << "\033[31m" << node.data.key() << "\033[0m";
 				#endif
 				} else {
-					stream << node.data->key << " (red)";
+					stream << node.data.key() << " (red)";
 				}
 			} else {
-				stream << node.data->key;
+				stream << node.data.key();
 			}
 
 			return stream;
@@ -224,30 +195,390 @@ class RedBlackTree final: public SearchTree<Key, Value>
 		}
 	};
 
-	NodePtr root;
+	Node *root;
+	Allocator<Node> node_allocator;
+	Allocator<Value> value_allocator;
+	mutable OperationCounters counters;
+
+	// Lazy removal: tombstones are compacted away once they pass this fraction of the
+	// entries, which are counted with the tombstones. 0 when removal is immediate.
+	double tombstone_fraction;
+	std::size_t tombstone_count;
+	std::size_t entry_count;
+
+	// Changes whenever nodes may have been freed, which sends cursors back to the root
+	std::uint64_t version;
+
+	void destroy_node(Node *node)
+	{
+		node->data.release(value_allocator);
+		destroy(node_allocator, node);
+	}
+
+	void destroy_subtree(Node *node)
+	{
+		if (!node)
+			return;
+
+		destroy_subtree(node->left);
+		destroy_subtree(node->right);
+		destroy_node(node);
+	}
+
+	static std::size_t size_of(const Node *node)
+	{
+		return node ? node->summary.size : 0;
+	}
+
+	static Aggregate aggregate_of(const Node *node)
+	{
+		return node ? node->summary.value : Augment::identity();
+	}
+
+	// Tombstones count for nothing
+	static Aggregate lift(const Node *node)
+	{
+		return node->dead ? Augment::identity() : Augment::lift(node->data.value());
+	}
+
+	static void update(Node *, std::false_type)
+	{}
+
+	static void update(Node *node, std::true_type)
+	{
+		node->summary.size = size_of(node->left) + !node->dead + size_of(node->right);
+		node->summary.value = Augment::combine(Augment::combine(aggregate_of(node->left), lift(node)),
+				aggregate_of(node->right));
+	}
+
+	// Recomputes the augmented fields of node from its children
+	static void update(Node *node)
+	{
+		update(node, is_augmented<Augment>());
+	}
+
+	static void update_path(Node *node)
+	{
+		if (!is_augmented<Augment>::value)
+			return;
+
+		for (; node; node = node->parent)
+			update(node);
+	}
+
+	// Perfectly balanced subtree of the next count entries from it. Only nodes at red_depth,
+	// the last and incomplete level, are red, so every path has the same number of black nodes.
+	template<typename Iterator>
+	Node *build_subtree(Iterator &it, std::size_t count, unsigned depth, unsigned red_depth)
+	{
+		if (!count)
+			return nullptr;
+
+		auto left = build_subtree(it, (count - 1) / 2, depth + 1, red_depth);
+		auto node = construct(node_allocator, value_allocator, (*it).first, (*it).second);
+		++it;
+		node->color = depth == red_depth ? Node::Color::RED : Node::Color::BLACK;
+		node->set_left(left);
+		node->set_right(build_subtree(it, count - 1 - (count - 1) / 2, depth + 1, red_depth));
+		update(node);
+		return node;
+	}
+
+	// Depth of the last level of a perfectly balanced tree of count nodes, if incomplete
+	static unsigned red_depth(std::size_t count)
+	{
+		unsigned full_levels = 0;
+		while ((std::size_t(2) << full_levels) - 1 <= count)
+			++full_levels;
+		return full_levels;
+	}
+
+	template<typename Iterator>
+	void build(Iterator it, std::size_t count)
+	{
+		root = build_subtree(it, count, 0, red_depth(count));
+		entry_count = count;
+	}
+
+	// Same shape as build_subtree(), made of existing nodes in key order
+	Node *relink(Node **nodes, std::size_t count, unsigned depth, unsigned red_depth)
+	{
+		if (!count)
+			return nullptr;
+
+		auto half = (count - 1) / 2;
+		auto node = nodes[half];
+		node->parent = nullptr;
+		node->color = depth == red_depth ? Node::Color::RED : Node::Color::BLACK;
+		node->set_left(relink(nodes, half, depth + 1, red_depth));
+		node->set_right(relink(nodes + half + 1, count - 1 - half, depth + 1, red_depth));
+		update(node);
+		return node;
+	}
+
+	static std::size_t count_entries(const Node *node)
+	{
+		return node ? count_entries(node->left) + 1 + count_entries(node->right) : 0;
+	}
+
+	// After split, join and the set operations, which move and free nodes. Cursors go back
+	// to the root and the entries, which only lazy removal needs, are counted again.
+	void restructured()
+	{
+		++version;
+		if (tombstone_fraction > 0)
+			entry_count = count_entries(root);
+	}
+
+	// Nearest node from node on, forwards or backwards, that is not a tombstone
+	static Node *skip_forward(Node *node)
+	{
+		while (node && node->dead)
+			node = node->successor();
+		return node;
+	}
+
+	static Node *skip_backward(Node *node)
+	{
+		while (node && node->dead)
+			node = node->predecessor();
+		return node;
+	}
+
+	// Lowest ancestor of node whose subtree spans key, given that key is above everything left of node
+	static Node *ancestor_spanning(Node *node, const Key &key)
+	{
+		for (auto parent = node->parent; parent; node = parent, parent = parent->parent) {
+			if (node == parent->left && Compare::less(key, parent->data.key()))
+				break;
+		}
+
+		return node;
+	}
+
+	// Lowest node on the way up from node whose subtree spans key. Climbs only while the
+	// ancestor passed bounds the keys below it away from key, so nearby keys stay low.
+	template<typename K>
+	Node *ancestor_near(Node *node, const K &key) const
+	{
+		auto order = Compare::compare(key, node->data.key());
+		if (order == 0)
+			return node;
+
+		auto lowest = node;
+		for (auto parent = node->parent; parent; node = parent, parent = parent->parent) {
+			counters.visited();
+			if (node != (order > 0 ? parent->left : parent->right))
+				continue;
+
+			counters.compared();
+			auto bound = Compare::compare(key, parent->data.key());
+			if (order > 0 ? bound < 0 : bound > 0)
+				return lowest;
+			if (bound == 0)
+				return parent;
+			lowest = parent;
+		}
+
+		return lowest;
+	}
 
 	template<typename KeyT, typename ValueT>
 	void insert_impl(KeyT &&key, ValueT &&value)
 	{
-		auto data = std::make_unique<Data<Key, Value>>(std::forward<KeyT>(key), std::forward<ValueT>(value));
+		insert_impl(std::forward<KeyT>(key), std::forward<ValueT>(value), root);
+	}
 
-		if (root) {
-			auto node = std::make_unique<Node>(std::move(data));
-			root->insert(std::move(node));
-		} else {
-			root = std::make_unique<Node>(std::move(data));
+	// Inserts with the descent starting at start, whose subtree must span key.
+	// Returns the node now holding key.
+	template<typename KeyT, typename ValueT>
+	Node *insert_impl(KeyT &&key, ValueT &&value, Node *start)
+	{
+		Node *parent = start ? start->parent : nullptr;
+		auto link = !parent ? &root : start == parent->left ? &parent->left : &parent->right;
+		while (*link) {
+			parent = *link;
+			counters.visited();
+			counters.compared();
+			auto order = Compare::compare(key, parent->data.key());
+			if (order == 0) {
+				parent->data.value() = std::forward<ValueT>(value);
+				if (parent->dead) {
+					parent->dead = false;
+					--tombstone_count;
+				}
+				update_path(parent);
+				return parent;
+			}
+			link = order < 0 ? &parent->left : &parent->right;
 		}
 
+		auto node = construct(node_allocator, value_allocator, std::forward<KeyT>(key), std::forward<ValueT>(value));
+		node->parent = parent;
+		*link = node;
+		++entry_count;
+		update_path(node);
+		resolve_red_red_violation(node);
+
 		if (root->color != Node::Color::BLACK)
 			root->color = Node::Color::BLACK;
+
+		return node;
+	}
+
+	template<typename Iterator>
+	void insert_batch_impl(Iterator pairs, const std::vector<std::size_t> &order)
+	{
+		Node *finger = nullptr;
+		for (auto i : order) {
+			auto start = finger ? ancestor_spanning(finger, pairs[i].first) : root;
+			finger = insert_impl(pairs[i].first, pairs[i].second, start);
+		}
+	}
+
+	// Splits the run of keys at every node while more than one key shares the way down.
+	// Single keys are left in descents to finish afterwards.
+	void find_sorted(Node *node, const Key *keys, const std::size_t *first, const std::size_t *last, Value **out,
+			std::vector<std::pair<Node *, std::size_t>> &descents) const
+	{
+		while (node && last - first > 1) {
+			auto equal = equal_run<Compare>(keys, first, last, node->data.key());
+			for (auto it = equal.first; it != equal.second && !node->dead; ++it)
+				out[*it] = &node->data.value();
+
+			if (first != equal.first)
+				find_sorted(node->left, keys, first, equal.first, out, descents);
+			node = node->right;
+			first = equal.second;
+		}
+
+		if (node && first != last)
+			descents.emplace_back(node, *first);
+	}
+
+	// Walks all descents down together, one level per round, so that the cache misses of
+	// independent lookups overlap instead of following one another
+	static void find_interleaved(std::vector<std::pair<Node *, std::size_t>> &descents, const Key *keys, Value **out)
+	{
+		while (!descents.empty()) {
+			std::size_t active = 0;
+			for (auto &descent : descents) {
+				auto node = descent.first;
+				auto &key = keys[descent.second];
+				auto order = Compare::compare(key, node->data.key());
+				if (order == 0) {
+					if (!node->dead)
+						out[descent.second] = &node->data.value();
+					continue;
+				}
+
+				node = order < 0 ? node->left : node->right;
+				if (node)
+					descents[active++] = std::make_pair(node, descent.second);
+			}
+			descents.resize(active);
+		}
+	}
+
+	// Puts replacement in the place node occupies under its parent
+	void replace_child(Node *node, Node *replacement)
+	{
+		auto parent = node->parent;
+		if (!parent)
+			root = replacement;
+		else if (node == parent->left)
+			parent->left = replacement;
+		else
+			parent->right = replacement;
+
+		if (replacement)
+			replacement->parent = parent;
+	}
+
+	void rotate_left(Node *node)
+	{
+		auto right = node->right;
+		node->set_right(right->left);
+		replace_child(node, right);
+		right->set_left(node);
+		update(node);
+		update(right);
+		counters.rotated();
+	}
+
+	void rotate_right(Node *node)
+	{
+		auto left = node->left;
+		node->set_left(left->right);
+		replace_child(node, left);
+		left->set_right(node);
+		update(node);
+		update(left);
+		counters.rotated();
+	}
+
+	static bool is_red(const Node *node)
+	{
+		return node && node->color == Node::Color::RED;
+	}
+
+	void resolve_red_red_violation(Node *node)
+	{
+		Node *parent, *grandparent;
+		std::uint64_t steps = 0;
+
+		// Recoloring pushes the violation two levels up, a rotation ends it
+		for (;; ++steps) {
+			parent = node->parent;
+			if (!parent || parent->color == Node::Color::BLACK) {
+				counters.cascaded(steps);
+				return;
+			}
+
+			grandparent = parent->parent;
+			if (!grandparent) {
+				counters.cascaded(steps);
+				return;
+			}
+
+			auto uncle = parent == grandparent->left ? grandparent->right : grandparent->left;
+			if (!is_red(uncle))
+				break;
+
+			parent->color = Node::Color::BLACK;
+			uncle->color = Node::Color::BLACK;
+			grandparent->color = Node::Color::RED;
+			counters.red_red_fixed();
+			node = grandparent;
+		}
+
+		counters.cascaded(steps + 1);
+
+		if (parent == grandparent->left) {
+			if (node == parent->right) {
+				rotate_left(parent);
+				parent = node;
+			}
+			rotate_right(grandparent);
+		} else {
+			if (node == parent->left) {
+				rotate_right(parent);
+				parent = node;
+			}
+			rotate_left(grandparent);
+		}
+
+		parent->color = Node::Color::BLACK;
+		grandparent->color = Node::Color::RED;
 	}
 
-	Value *find_impl(const Key &key) const
+	template<typename K>
+	Value *find_impl(const K &key) const
 	{
 		if (root) {
-			auto node = root->find(key);
-			if (node)
-				return &node->data->value;
+			auto node = root->find(key, counters);
+			if (node && !node->dead)
+				return &node->data.value();
 		}
 
 		return nullptr;
@@ -255,229 +586,956 @@ class RedBlackTree final: public SearchTree<Key, Value>
 
 	Value *min_impl() const
 	{
-		if (root)
-			return &root->min()->data->value;
-
-		return nullptr;
+		auto node = root ? skip_forward(root->min()) : nullptr;
+		return node ? &node->data.value() : nullptr;
 	}
 
 	Value *max_impl() const
 	{
-		if (root)
-			return &root->max()->data->value;
+		auto node = root ? skip_backward(root->max()) : nullptr;
+		return node ? &node->data.value() : nullptr;
+	}
 
-		return nullptr;
+	template<typename K>
+	Node *lower_bound_node(const K &key) const
+	{
+		Node *bound = nullptr;
+		for (auto node = root; node; ) {
+			if (Compare::less(node->data.key(), key)) {
+				node = node->right;
+			} else {
+				bound = node;
+				node = node->left;
+			}
+		}
+
+		return bound;
 	}
 
-	static void remove_double_blackness(Node *node, Node *parent)
+	template<typename K>
+	Node *upper_bound_node(const K &key) const
 	{
-		if (!parent)
-			return;
+		Node *bound = nullptr;
+		for (auto node = root; node; ) {
+			if (Compare::less(key, node->data.key())) {
+				bound = node;
+				node = node->left;
+			} else {
+				node = node->right;
+			}
+		}
 
-		if (node && node->color == Node::Color::RED) {
-			node->color = Node::Color::BLACK;
-			return;
+		return bound;
+	}
+
+	// Number of keys less than key, or not greater than it if inclusive
+	std::size_t rank_impl(const Key &key, bool inclusive) const
+	{
+		std::size_t rank = 0;
+		for (auto node = root; node; ) {
+			if (Compare::less(node->data.key(), key) || (inclusive && !Compare::less(key, node->data.key()))) {
+				rank += size_of(node->left) + !node->dead;
+				node = node->right;
+			} else {
+				node = node->left;
+			}
 		}
 
-		if (node == parent->left.get()) {
-			auto sibling = parent->right.get();
-			if (sibling) {
-				if (sibling->color == Node::Color::BLACK) {
-					if (sibling->left && sibling->left->color == Node::Color::RED) {
-						auto left = std::move(sibling->left);
-						left->color = Node::Color::BLACK;
-						sibling->set_left(std::move(left->right));
-						left->set_right(std::move(left->left));
-						left->set_left(std::move(parent->left));
-						parent->data.swap(left->data);
-						parent->set_left(std::move(left));
-					} else if (sibling->right && sibling->right->color == Node::Color::RED) {
-						auto right = std::move(sibling->right);
-						right->color = Node::Color::BLACK;
-						sibling->set_right(std::move(sibling->left));
-						sibling->set_left(std::move(parent->left));
-						parent->data.swap(sibling->data);
-						parent->set_left(std::move(parent->right));
-						parent->set_right(std::move(right));
-					} else if ((!sibling->left || (sibling->left && sibling->left->color == Node::Color::BLACK)) &&
-							(!sibling->right || (sibling->right && sibling->right->color == Node::Color::BLACK))) {
-						sibling->color = Node::Color::RED;
-						remove_double_blackness(parent, parent->parent);
-					}
-				} else {
-					auto left = std::move(parent->right);
-					auto right = std::move(sibling->right);
-					sibling->set_right(std::move(sibling->left));
-					sibling->set_left(std::move(parent->left));
-					parent->data.swap(left->data);
-					parent->set_left(std::move(left));
-					parent->set_right(std::move(right));
-					remove_double_blackness(node, sibling);
-				}
+		return rank;
+	}
+
+	Node *select_node(std::size_t index) const
+	{
+		auto node = root;
+		while (node) {
+			auto left = size_of(node->left);
+			if (index < left) {
+				node = node->left;
+			} else if (index == left && !node->dead) {
+				break;
+			} else {
+				index -= left + !node->dead;
+				node = node->right;
 			}
-		} else {
-			auto sibling = parent->left.get();
-			if (sibling) {
-				if (sibling->color == Node::Color::BLACK) {
-					if (sibling->right && sibling->right->color == Node::Color::RED) {
-						auto right = std::move(sibling->right);
-						right->color = Node::Color::BLACK;
-						sibling->set_right(std::move(right->left));
-						right->set_left(std::move(right->right));
-						right->set_right(std::move(parent->right));
-						parent->data.swap(right->data);
-						parent->set_right(std::move(right));
-					} else if (sibling->right && sibling->right->color == Node::Color::RED) {
-						auto left = std::move(sibling->left);
-						left->color = Node::Color::BLACK;
-						sibling->set_left(std::move(sibling->right));
-						sibling->set_right(std::move(parent->right));
-						parent->data.swap(sibling->data);
-						parent->set_right(std::move(parent->left));
-						parent->set_left(std::move(left));
-					} else if ((!sibling->left || (sibling->left && sibling->left->color == Node::Color::BLACK)) &&
-							(!sibling->right || (sibling->right && sibling->right->color == Node::Color::BLACK))) {
-						sibling->color = Node::Color::RED;
-						remove_double_blackness(parent, parent->parent);
-					}
-				} else {
-					auto right = std::move(parent->left);
-					auto left = std::move(sibling->left);
-					sibling->set_left(std::move(sibling->right));
-					sibling->set_right(std::move(parent->right));
-					parent->data.swap(right->data);
-					parent->set_left(std::move(left));
-					parent->set_right(std::move(right));
-					remove_double_blackness(node, sibling);
-				}
+		}
+
+		return node;
+	}
+
+	// Aggregate of the keys not less than lo in the subtree of node
+	static Aggregate aggregate_from(const Node *node, const Key &lo)
+	{
+		auto result = Augment::identity();
+		while (node) {
+			if (Compare::less(node->data.key(), lo)) {
+				node = node->right;
+			} else {
+				result = Augment::combine(Augment::combine(lift(node), aggregate_of(node->right)), result);
+				node = node->left;
 			}
 		}
+
+		return result;
 	}
 
-	bool remove_impl(const Key &key)
+	// Aggregate of the keys not greater than hi in the subtree of node
+	static Aggregate aggregate_to(const Node *node, const Key &hi)
 	{
-		if (root) {
-			auto node = root->find(key);
-			if (!node)
-				return false;
+		auto result = Augment::identity();
+		while (node) {
+			if (Compare::less(hi, node->data.key())) {
+				node = node->left;
+			} else {
+				result = Augment::combine(result, Augment::combine(aggregate_of(node->left), lift(node)));
+				node = node->right;
+			}
+		}
 
-			if (node->left) {
-				auto predecessor = node->predecessor();
-				node->data = std::move(predecessor->data);
-				auto parent = predecessor->parent;
-				auto child = predecessor->left.get();
-				if (child) {
-					if (node == parent)
-						node->set_left(std::move(predecessor->left));
-					else
-						parent->set_right(std::move(predecessor->left));
-				} else {
-					if (predecessor == parent->left.get())
-						parent->left.reset();
-					else
-						parent->right.reset();
+		return result;
+	}
+
+	// Node is one black short compared to its sibling; parent is passed as node may be null
+	void remove_double_blackness(Node *node, Node *parent)
+	{
+		std::uint64_t steps = 0;
+
+		// Recoloring the sibling moves the missing black one level up, a rotation ends it
+		while (parent && !is_red(node)) {
+			counters.double_black_fixed();
+			++steps;
+			if (node == parent->left) {
+				auto sibling = parent->right;
+				if (sibling->color == Node::Color::RED) {
+					sibling->color = Node::Color::BLACK;
+					parent->color = Node::Color::RED;
+					rotate_left(parent);
+					sibling = parent->right;
 				}
-				remove_double_blackness(child, parent);
-			} else if (node->right) {
-				auto successor = node->successor();
-				node->data = std::move(successor->data);
-				auto parent = successor->parent;
-				auto child = successor->right.get();
-				if (child) {
-					if (node == parent)
-						node->set_right(std::move(successor->right));
-					else
-						parent->set_left(std::move(successor->right));
-				} else {
-					if (successor == parent->left.get())
-						parent->left.reset();
-					else
-						parent->right.reset();
+
+				if (!is_red(sibling->left) && !is_red(sibling->right)) {
+					sibling->color = Node::Color::RED;
+					node = parent;
+					parent = parent->parent;
+					continue;
 				}
-				remove_double_blackness(child, parent);
+
+				if (!is_red(sibling->right)) {
+					sibling->left->color = Node::Color::BLACK;
+					sibling->color = Node::Color::RED;
+					rotate_right(sibling);
+					sibling = parent->right;
+				}
+
+				sibling->color = parent->color;
+				parent->color = Node::Color::BLACK;
+				sibling->right->color = Node::Color::BLACK;
+				rotate_left(parent);
 			} else {
-				auto parent = node->parent;
-				if (parent) {
-					if (node == parent->left.get())
-						parent->left.reset();
-					else
-						parent->right.reset();
-					remove_double_blackness(nullptr, parent);
-				} else {
-					root.reset();
+				auto sibling = parent->left;
+				if (sibling->color == Node::Color::RED) {
+					sibling->color = Node::Color::BLACK;
+					parent->color = Node::Color::RED;
+					rotate_right(parent);
+					sibling = parent->left;
+				}
+
+				if (!is_red(sibling->left) && !is_red(sibling->right)) {
+					sibling->color = Node::Color::RED;
+					node = parent;
+					parent = parent->parent;
+					continue;
 				}
+
+				if (!is_red(sibling->left)) {
+					sibling->right->color = Node::Color::BLACK;
+					sibling->color = Node::Color::RED;
+					rotate_left(sibling);
+					sibling = parent->left;
+				}
+
+				sibling->color = parent->color;
+				parent->color = Node::Color::BLACK;
+				sibling->left->color = Node::Color::BLACK;
+				rotate_right(parent);
 			}
+			counters.cascaded(steps);
+			return;
+		}
 
-			return true;
+		counters.cascaded(steps);
+		if (node)
+			node->color = Node::Color::BLACK;
+	}
+
+	bool remove_impl(const Key &key)
+	{
+		if (!root)
+			return false;
+
+		auto node = root->find(key, counters);
+		if (!node || node->dead)
+			return false;
+
+		remove_node(node);
+		return true;
+	}
+
+	// Removes the entry of node, which must not be a tombstone. Returns a node still in the
+	// tree near where node was, null if the tree is now empty.
+	Node *remove_node(Node *node)
+	{
+		if (tombstone_fraction > 0) {
+			node->dead = true;
+			update_path(node);
+			if (++tombstone_count > tombstone_fraction * entry_count) {
+				compact();
+				return root;
+			}
+			return node;
+		}
+
+		auto parent = node->parent;
+		unlink(node);
+		destroy_node(node);
+		--entry_count;
+		++version;
+		return parent ? parent : root;
+	}
+
+	// Takes node out of the tree and rebalances, leaving node itself as it was
+	void unlink(Node *node)
+	{
+		// A node with two children swaps places with its predecessor, which has no right child
+		if (node->left && node->right) {
+			auto predecessor = node->predecessor();
+			auto color = predecessor->color;
+			auto child = predecessor->left;
+			Node *parent;
+
+			if (predecessor->parent == node) {
+				parent = predecessor;
+			} else {
+				parent = predecessor->parent;
+				parent->set_right(child);
+				predecessor->set_left(node->left);
+			}
+
+			replace_child(node, predecessor);
+			predecessor->set_right(node->right);
+			predecessor->color = node->color;
+			update_path(parent);
+
+			if (color == Node::Color::BLACK)
+				remove_double_blackness(child, parent);
+		} else {
+			auto child = node->left ? node->left : node->right;
+			auto parent = node->parent;
+			replace_child(node, child);
+			update_path(parent);
+
+			if (node->color == Node::Color::BLACK)
+				remove_double_blackness(child, parent);
+		}
+	}
+
+	static unsigned height_of(const Node *node)
+	{
+		return node ? 1 + std::max(height_of(node->left), height_of(node->right)) : 0;
+	}
+
+	static void add_usage(const Node *node, MemoryUsage &usage)
+	{
+		if (!node)
+			return;
+
+		// Tombstones count as overhead
+		if (!node->dead)
+			usage.add_entry(node->data.key(), node->data.value(), Layout::separate_values);
+		usage.add_node(sizeof(Node), node->dead ? 0 : sizeof(Key) + (Layout::separate_values ? 0 : sizeof(Value)));
+		add_usage(node->left, usage);
+		add_usage(node->right, usage);
+	}
+
+	static unsigned black_height(const Node *node)
+	{
+		unsigned height = 0;
+		for (; node; node = node->left)
+			height += !is_red(node);
+		return height;
+	}
+
+	static Node *detach(Node *node)
+	{
+		if (node)
+			node->parent = nullptr;
+		return node;
+	}
+
+	// Tree of the keys of left, then middle, then right, each part above the one before.
+	// Descends the taller tree to the black height of the other and links middle in there,
+	// so the cost is the difference of the heights. Uses root along the way.
+	Node *join_nodes(Node *left, Node *middle, Node *right)
+	{
+		middle->left = middle->right = middle->parent = nullptr;
+		if (is_red(left))
+			left->color = Node::Color::BLACK;
+		if (is_red(right))
+			right->color = Node::Color::BLACK;
+
+		auto left_height = black_height(left), right_height = black_height(right);
+		if (left_height == right_height) {
+			middle->color = Node::Color::BLACK;
+			middle->set_left(left);
+			middle->set_right(right);
+			update(middle);
+			return middle;
+		}
+
+		Node *parent = nullptr;
+		middle->color = Node::Color::RED;
+		if (left_height > right_height) {
+			root = left;
+			auto node = left;
+			for (auto height = left_height; is_red(node) || height != right_height; node = node->right) {
+				height -= !is_red(node);
+				parent = node;
+			}
+			middle->set_left(node);
+			middle->set_right(right);
+			parent->set_right(middle);
+		} else {
+			root = right;
+			auto node = right;
+			for (auto height = right_height; is_red(node) || height != left_height; node = node->left) {
+				height -= !is_red(node);
+				parent = node;
+			}
+			middle->set_left(left);
+			middle->set_right(node);
+			parent->set_left(middle);
+		}
+
+		update(middle);
+		update_path(parent);
+		resolve_red_red_violation(middle);
+		root->color = Node::Color::BLACK;
+		return root;
+	}
+
+	// Same without a middle entry, either tree may be empty
+	Node *join_nodes(Node *left, Node *right)
+	{
+		if (!left || !right)
+			return left ? left : right;
+
+		root = as_root(right);
+		auto middle = right->min();
+		unlink(middle);
+		return join_nodes(left, middle, root);
+	}
+
+	// Splits the subtree of node, taking it apart, into the keys below key and those above.
+	// Returns the node holding key, unlinked, or null. Uses root along the way.
+	Node *split_node(Node *node, const Key &key, Node *&left, Node *&right)
+	{
+		if (!node) {
+			left = right = nullptr;
+			return nullptr;
+		}
+
+		auto lower = detach(node->left), upper = detach(node->right);
+		auto order = Compare::compare(key, node->data.key());
+		if (order == 0) {
+			left = lower;
+			right = upper;
+			return node;
 		}
 
-		return false;
+		Node *found, *middle;
+		if (order < 0) {
+			found = split_node(lower, key, left, middle);
+			right = join_nodes(middle, node, upper);
+		} else {
+			found = split_node(upper, key, middle, right);
+			left = join_nodes(lower, node, middle);
+		}
+
+		return found;
 	}
 
-	RedBlackTree() = default;
+	// Root of a split off part, which may be left red
+	static Node *as_root(Node *node)
+	{
+		if (node) {
+			node->parent = nullptr;
+			node->color = Node::Color::BLACK;
+		}
+		return node;
+	}
+
+	// The set operations below take other apart and leave the result in this tree. Each
+	// splits this tree by the root of other and recurses on the two sides, handing one side
+	// to another thread while depth lasts. Every recursion works on trees of its own, as
+	// the join and split helpers use root, and the cost is O(m log(n / m + 1)) for trees of
+	// m <= n entries.
+
+	void unite_impl(RedBlackTree &other, unsigned depth)
+	{
+		if (!other.root)
+			return;
+		if (!root) {
+			std::swap(root, other.root);
+			return;
+		}
+
+		auto pivot = other.root;
+		RedBlackTree other_left, other_right, right;
+		other_left.root = as_root(pivot->left);
+		other_right.root = as_root(pivot->right);
+		other.root = nullptr;
+
+		// The entry of other replaces the one here, as insert() would
+		Node *left;
+		auto found = split_node(root, pivot->data.key(), left, right.root);
+		if (found)
+			destroy_node(found);
+		root = as_root(left);
+		right.root = as_root(right.root);
+
+		fork_join(depth, [&](unsigned next) { unite_impl(other_left, next); },
+				[&](unsigned next) { right.unite_impl(other_right, next); });
+		root = join_nodes(root, pivot, right.root);
+		right.root = nullptr;
+	}
+
+	void intersect_impl(RedBlackTree &other, unsigned depth)
+	{
+		if (!root || !other.root) {
+			destroy_subtree(root);
+			root = nullptr;
+			return;
+		}
+
+		auto pivot = other.root;
+		RedBlackTree other_left, other_right, right;
+		other_left.root = as_root(pivot->left);
+		other_right.root = as_root(pivot->right);
+		other.root = nullptr;
+
+		Node *left;
+		auto found = split_node(root, pivot->data.key(), left, right.root);
+		destroy_node(pivot);
+		root = as_root(left);
+		right.root = as_root(right.root);
+
+		fork_join(depth, [&](unsigned next) { intersect_impl(other_left, next); },
+				[&](unsigned next) { right.intersect_impl(other_right, next); });
+		root = found ? join_nodes(root, found, right.root) : join_nodes(root, right.root);
+		right.root = nullptr;
+	}
+
+	void subtract_impl(RedBlackTree &other, unsigned depth)
+	{
+		if (!root || !other.root)
+			return;
+
+		auto pivot = other.root;
+		RedBlackTree other_left, other_right, right;
+		other_left.root = as_root(pivot->left);
+		other_right.root = as_root(pivot->right);
+		other.root = nullptr;
+
+		Node *left;
+		auto found = split_node(root, pivot->data.key(), left, right.root);
+		if (found)
+			destroy_node(found);
+		destroy_node(pivot);
+		root = as_root(left);
+		right.root = as_root(right.root);
+
+		fork_join(depth, [&](unsigned next) { subtract_impl(other_left, next); },
+				[&](unsigned next) { right.subtract_impl(other_right, next); });
+		root = join_nodes(root, right.root);
+		right.root = nullptr;
+	}
+
+	using typename OrderedTree<RedBlackTree, Key, Value, Compare>::Position;
+
+	Position first_position() const
+	{
+		return Position{root ? skip_forward(root->min()) : nullptr, 0};
+	}
+
+	template<typename K>
+	Position lower_bound_position(const K &key) const
+	{
+		return Position{skip_forward(lower_bound_node(key)), 0};
+	}
+
+	template<typename K>
+	Position upper_bound_position(const K &key) const
+	{
+		return Position{skip_forward(upper_bound_node(key)), 0};
+	}
+
+	void next_position(Position &position) const
+	{
+		position.node = skip_forward(static_cast<Node *>(position.node)->successor());
+	}
+
+	void prev_position(Position &position) const
+	{
+		if (position.node)
+			position.node = skip_backward(static_cast<Node *>(position.node)->predecessor());
+		else
+			position.node = root ? skip_backward(root->max()) : nullptr;
+	}
+
+	const Key &key_at(const Position &position) const
+	{
+		return static_cast<Node *>(position.node)->data.key();
+	}
+
+	Value &value_at(const Position &position) const
+	{
+		return static_cast<Node *>(position.node)->data.value();
+	}
 
 public:
-	static SearchTreePtr<Key, Value> create()
+	using key_type = Key;
+	using mapped_type = Value;
+	using key_compare = Compare;
+	using typename OrderedTree<RedBlackTree, Key, Value, Compare>::iterator;
+
+	RedBlackTree()
+		: root(nullptr)
+		, tombstone_fraction(0)
+		, tombstone_count(0)
+		, entry_count(0)
+		, version(0)
+	{}
+
+	RedBlackTree(const RedBlackTree &) = delete;
+	RedBlackTree &operator=(const RedBlackTree &) = delete;
+
+	~RedBlackTree()
 	{
-		return std::unique_ptr<RedBlackTree<Key, Value>>(new RedBlackTree<Key, Value>());
+		// Pooled nodes go away together with their chunks, only payloads may need destructors
+		if (!Allocator<Node>::releases_all || !std::is_trivially_destructible<Data<Key, Value>>::value)
+			destroy_subtree(root);
 	}
 
-	void insert(const Key &key, const Value &value) override final
+	static SearchTreePtr<Key, Value, Compare> create()
 	{
-		insert_impl(key, value);
+		return std::unique_ptr<SearchTreeAdapter<RedBlackTree>>(new SearchTreeAdapter<RedBlackTree>());
 	}
 
-	void insert(const Key &key, Value &&value) override final
+	// Replaces the contents with (key, value) pairs in linear time. Input that is not sorted
+	// by key, or repeats a key, is sorted and deduplicated into a temporary copy first.
+	template<typename ForwardIterator>
+	void assign_sorted(ForwardIterator begin, ForwardIterator end)
 	{
-		insert_impl(key, value);
+		destroy_subtree(root);
+		root = nullptr;
+		tombstone_count = 0;
+		++version;
+
+		if (keys_strictly_increasing<Compare>(begin, end)) {
+			build(begin, std::distance(begin, end));
+		} else {
+			auto entries = sorted_by_key<Key, Value, Compare>(begin, end);
+			build(std::make_move_iterator(entries.begin()), entries.size());
+		}
 	}
 
-	void insert(Key &&key, const Value &value) override final
+	template<typename ForwardIterator>
+	static SearchTreePtr<Key, Value, Compare> build_from_sorted(ForwardIterator begin, ForwardIterator end)
 	{
-		insert_impl(key, value);
+		std::unique_ptr<SearchTreeAdapter<RedBlackTree>> tree(new SearchTreeAdapter<RedBlackTree>());
+		tree->get().assign_sorted(begin, end);
+		return tree;
+	}
+
+	// Replaces the contents with a snapshot written by save(), in linear time. Returns false
+	// and keeps the current contents if the file is missing, damaged or out of key order.
+	bool load(const std::string &path)
+	{
+		SnapshotReader<Key, Value> reader(path);
+		if (!reader.ok())
+			return false;
+
+		auto old_root = root;
+		auto old_entries = entry_count;
+		build(reader.begin(), reader.size());
+		if (!reader.finished() || !keys_strictly_increasing<Compare>(this->begin(), this->end())) {
+			destroy_subtree(root);
+			root = old_root;
+			entry_count = old_entries;
+			return false;
+		}
+
+		destroy_subtree(old_root);
+		tombstone_count = 0;
+		++version;
+		return true;
 	}
 
-	void insert(Key &&key, Value &&value) override final
+	void insert(const Key &key, const Value &value)
 	{
 		insert_impl(key, value);
 	}
 
-	Value *find(const Key &key) override final
+	void insert(const Key &key, Value &&value)
+	{
+		insert_impl(key, std::move(value));
+	}
+
+	void insert(Key &&key, const Value &value)
+	{
+		insert_impl(std::move(key), value);
+	}
+
+	void insert(Key &&key, Value &&value)
+	{
+		insert_impl(std::move(key), std::move(value));
+	}
+
+	Value *find(const Key &key)
+	{
+		return find_impl(key);
+	}
+
+	const Value *find(const Key &key) const
+	{
+		return find_impl(key);
+	}
+
+	// Lookup by any type Compare orders against Key, when Compare is transparent
+	template<typename K, typename C = Compare, typename = typename C::is_transparent>
+	Value *find(const K &key)
 	{
 		return find_impl(key);
 	}
 
-	const Value *find(const Key &key) const override final
+	template<typename K, typename C = Compare, typename = typename C::is_transparent>
+	const Value *find(const K &key) const
 	{
 		return find_impl(key);
 	}
 
-	Value *min() override final
+	void insert_batch(const std::vector<std::pair<Key, Value>> &pairs)
+	{
+		insert_batch_impl(pairs.begin(), sorted_order(pairs, KeyLess<Compare>()));
+	}
+
+	void insert_batch(std::vector<std::pair<Key, Value>> &&pairs)
+	{
+		insert_batch_impl(std::make_move_iterator(pairs.begin()), sorted_order(pairs, KeyLess<Compare>()));
+	}
+
+	void find_batch(const std::vector<Key> &keys, std::vector<Value *> &out)
+	{
+		auto order = sorted_order(keys, CompareLess<Compare>());
+		out.assign(keys.size(), nullptr);
+		std::vector<std::pair<Node *, std::size_t>> descents;
+		find_sorted(root, keys.data(), order.data(), order.data() + order.size(), out.data(), descents);
+		find_interleaved(descents, keys.data(), out.data());
+	}
+
+	Value *min()
 	{
 		return min_impl();
 	}
 
-	const Value *min() const override final
+	const Value *min() const
 	{
 		return min_impl();
 	}
 
-	Value *max() override final
+	Value *max()
 	{
 		return max_impl();
 	}
 
-	const Value *max() const override final
+	const Value *max() const
 	{
 		return max_impl();
 	}
 
-	bool remove(const Key &key) override final
+	bool remove(const Key &key)
 	{
 		return remove_impl(key);
 	}
 
-	virtual void print(std::ostream &stream) override final
+	// Lazy removal for delete-heavy phases. remove() then only marks the entry as a tombstone,
+	// skipped by lookups, iteration and the order statistics, and an insert of the same key
+	// takes the node back. Once tombstones pass max_fraction of the entries, compact() runs.
+	// Tombstones keep their values until then. 0 makes removal immediate again and compacts.
+	void set_lazy_remove(double max_fraction)
+	{
+		tombstone_fraction = max_fraction;
+		entry_count = count_entries(root);
+		if (max_fraction <= 0)
+			compact();
+	}
+
+	std::size_t tombstones() const
+	{
+		return tombstone_count;
+	}
+
+	// Frees the tombstones and relinks the remaining nodes into a balanced tree, in linear
+	// time. Iterators are invalidated.
+	void compact()
+	{
+		if (!tombstone_count)
+			return;
+
+		std::vector<Node *> live, dead;
+		live.reserve(entry_count - tombstone_count);
+		dead.reserve(tombstone_count);
+		for (auto node = root ? root->min() : nullptr; node; node = node->successor())
+			(node->dead ? dead : live).push_back(node);
+		for (auto node : dead)
+			destroy_node(node);
+
+		root = relink(live.data(), live.size(), 0, red_depth(live.size()));
+		entry_count = live.size();
+		tombstone_count = 0;
+		++version;
+		counters.compacted();
+	}
+
+	// Finger for lookups and updates near one another. Each find, insert or remove starts
+	// from the node the previous one ended at and climbs parent links only until the key is
+	// in reach, so a key d entries from the last one typically takes O(log d) steps instead
+	// of a descent from the root. Anything that frees nodes, eager removes, compaction,
+	// split, join, the set operations or a load, sends cursors back to the root. A cursor
+	// must not outlive its tree.
+	class Cursor
+	{
+		friend class RedBlackTree;
+
+		RedBlackTree *tree;
+		Node *finger;
+		std::uint64_t version;
+
+		explicit Cursor(RedBlackTree *tree)
+			: tree(tree)
+			, finger(nullptr)
+			, version(tree->version)
+		{}
+
+		// Node whose subtree spans key, null for an empty tree
+		Node *start(const Key &key) const
+		{
+			if (!finger || version != tree->version)
+				return tree->root;
+			return tree->ancestor_near(finger, key);
+		}
+
+		void move_to(Node *node)
+		{
+			finger = node;
+			version = tree->version;
+		}
+
+	public:
+		Value *find(const Key &key)
+		{
+			auto node = start(key);
+			if (!node)
+				return nullptr;
+
+			int order;
+			node = node->descend(key, order, tree->counters);
+			move_to(node);
+			return order == 0 && !node->dead ? &node->data.value() : nullptr;
+		}
+
+		template<typename KeyT, typename ValueT>
+		void insert(KeyT &&key, ValueT &&value)
+		{
+			auto node = start(key);
+			move_to(tree->insert_impl(std::forward<KeyT>(key), std::forward<ValueT>(value), node));
+		}
+
+		bool remove(const Key &key)
+		{
+			auto node = start(key);
+			if (!node)
+				return false;
+
+			int order;
+			node = node->descend(key, order, tree->counters);
+			if (order != 0 || node->dead) {
+				move_to(node);
+				return false;
+			}
+
+			move_to(tree->remove_node(node));
+			return true;
+		}
+	};
+
+	Cursor cursor()
+	{
+		return Cursor(this);
+	}
+
+	// Split, join and the set operations move nodes from one tree to another, so they need
+	// an allocator that does not tie nodes to the tree, such as HeapAllocator
+
+	// Moves the entries with keys above key into greater, which must be empty. O(log n).
+	void split(const Key &key, RedBlackTree &greater)
+	{
+		static_assert(!Allocator<Node>::releases_all, "split() needs nodes that can change trees");
+		compact();
+		Node *left, *right;
+		auto found = split_node(root, key, left, right);
+		root = as_root(left);
+		if (found)
+			root = join_nodes(root, found, nullptr);
+		greater.root = as_root(right);
+		restructured();
+		greater.restructured();
+	}
+
+	// Appends (key, value) and then the entries of greater, which is left empty. Every key
+	// here must be below key and every key of greater above it. O(log n).
+	template<typename KeyT, typename ValueT>
+	void join(KeyT &&key, ValueT &&value, RedBlackTree &greater)
+	{
+		static_assert(!Allocator<Node>::releases_all, "join() needs nodes that can change trees");
+		compact();
+		greater.compact();
+		auto middle = construct(node_allocator, value_allocator, std::forward<KeyT>(key), std::forward<ValueT>(value));
+		root = join_nodes(root, middle, greater.root);
+		greater.root = nullptr;
+		restructured();
+		greater.restructured();
+	}
+
+	// Appends the entries of greater, whose keys must all be above the ones here
+	void join(RedBlackTree &greater)
+	{
+		static_assert(!Allocator<Node>::releases_all, "join() needs nodes that can change trees");
+		compact();
+		greater.compact();
+		root = join_nodes(root, greater.root);
+		greater.root = nullptr;
+		restructured();
+		greater.restructured();
+	}
+
+	// Adds the entries of other, whose values win on equal keys. Other is left empty.
+	void unite(RedBlackTree &other)
+	{
+		static_assert(!Allocator<Node>::releases_all, "unite() needs nodes that can change trees");
+		compact();
+		other.compact();
+		unite_impl(other, parallel_depth());
+		restructured();
+		other.restructured();
+	}
+
+	// Keeps the entries whose keys are in other too. Other is left empty.
+	void intersect(RedBlackTree &other)
+	{
+		static_assert(!Allocator<Node>::releases_all, "intersect() needs nodes that can change trees");
+		compact();
+		other.compact();
+		intersect_impl(other, parallel_depth());
+		destroy_subtree(other.root);
+		other.root = nullptr;
+		restructured();
+		other.restructured();
+	}
+
+	// Removes the entries whose keys are in other. Other is left empty.
+	void subtract(RedBlackTree &other)
+	{
+		static_assert(!Allocator<Node>::releases_all, "subtract() needs nodes that can change trees");
+		compact();
+		other.compact();
+		subtract_impl(other, parallel_depth());
+		destroy_subtree(other.root);
+		other.root = nullptr;
+		restructured();
+		other.restructured();
+	}
+
+	// Order statistics and range aggregates, available when the tree is augmented
+
+	std::size_t rank(const Key &key) const
+	{
+		static_assert(is_augmented<Augment>::value, "rank() needs an augmented tree");
+		return rank_impl(key, false);
+	}
+
+	// Entry with the given zero-based rank, end() if there are not that many entries
+	iterator select(std::size_t index)
+	{
+		static_assert(is_augmented<Augment>::value, "select() needs an augmented tree");
+		return this->make_iterator(Position{select_node(index), 0});
+	}
+
+	// Number of keys in [lo, hi]
+	std::size_t count(const Key &lo, const Key &hi) const
+	{
+		static_assert(is_augmented<Augment>::value, "count() needs an augmented tree");
+		if (Compare::less(hi, lo))
+			return 0;
+
+		return rank_impl(hi, true) - rank_impl(lo, false);
+	}
+
+	// Values with keys in [lo, hi] combined in key order
+	Aggregate aggregate(const Key &lo, const Key &hi) const
+	{
+		static_assert(is_augmented<Augment>::value, "aggregate() needs an augmented tree");
+
+		// Descend to the first node inside the range, both bounds split off from there
+		auto node = root;
+		while (node) {
+			if (Compare::less(node->data.key(), lo))
+				node = node->right;
+			else if (Compare::less(hi, node->data.key()))
+				node = node->left;
+			else
+				break;
+		}
+
+		if (!node)
+			return Augment::identity();
+
+		return Augment::combine(Augment::combine(aggregate_from(node->left, lo), lift(node)),
+				aggregate_to(node->right, hi));
+	}
+
+	// Counters since creation or the last reset_stats(), see stats.hpp. The height takes
+	// a walk over the whole tree.
+	TreeStats stats() const
+	{
+		auto result = counters.get();
+		result.height = height_of(root);
+		return result;
+	}
+
+	void reset_stats()
+	{
+		counters.reset();
+	}
+
+	// Walks the whole tree, see memory-usage.hpp
+	MemoryUsage memory_usage() const
+	{
+		MemoryUsage usage;
+		add_usage(root, usage);
+		return usage;
+	}
+
+	void print(std::ostream &stream) const
 	{
 		if (root)
 			root->print(stream, "", true);
@@ -2,13 +2,42 @@
 
 #include <memory>
 #include <ostream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "compare.hpp"
+#include "memory-usage.hpp"
+#include "ordered-tree.hpp"
+#include "stats.hpp"
 
 namespace search_trees
 {
 
-template<typename Key, typename Value>
-class SearchTree
+// Type-erased interface to the trees. Concrete trees such as RedBlackTree can also be used
+// directly, which lets calls be inlined; their create() wraps them in a SearchTreeAdapter.
+// Compare is the ordering the trees behind it use, see compare.hpp.
+template<typename Key, typename Value, typename Compare = ThreeWayCompare>
+class SearchTree: public OrderedTree<SearchTree<Key, Value, Compare>, Key, Value, Compare>
 {
+	friend class OrderedTree<SearchTree, Key, Value, Compare>;
+	friend class TreeIterator<SearchTree, Key, Value>;
+	friend class TreeIterator<SearchTree, Key, const Value>;
+
+protected:
+	using Position = TreePosition;
+
+	virtual Position first_position() const = 0;
+	virtual Position lower_bound_position(const Key &key) const = 0;
+	virtual Position upper_bound_position(const Key &key) const = 0;
+
+	virtual void next_position(Position &position) const = 0;
+	virtual void prev_position(Position &position) const = 0;
+
+	virtual const Key &key_at(const Position &position) const = 0;
+	virtual Value &value_at(const Position &position) const = 0;
+
 public:
 	virtual ~SearchTree() = default;
 
@@ -20,6 +49,15 @@ public:
 	virtual Value *find(const Key &key) = 0;
 	virtual const Value *find(const Key &key) const = 0;
 
+	// Same as inserting the pairs one after another. The batch is taken in key order and
+	// each descent starts from where the previous one ended instead of from the root.
+	virtual void insert_batch(const std::vector<std::pair<Key, Value>> &pairs) = 0;
+	virtual void insert_batch(std::vector<std::pair<Key, Value>> &&pairs) = 0;
+
+	// Sets out[i] to find(keys[i]). The batch is taken in key order so that lookups share
+	// the upper levels of their paths and overlap their cache misses.
+	virtual void find_batch(const std::vector<Key> &keys, std::vector<Value *> &out) = 0;
+
 	virtual Value *min() = 0;
 	virtual const Value *min() const = 0;
 
@@ -28,10 +66,186 @@ public:
 
 	virtual bool remove(const Key &key) = 0;
 
-	virtual void print(std::ostream &stream) = 0;
+	// Replaces the contents with a snapshot from save(), see snapshot.hpp. Always false for
+	// key or value types without a Serializer.
+	virtual bool load(const std::string &path) = 0;
+
+	// Operation counters, kept when SEARCH_TREES_STATS is defined, see stats.hpp
+	virtual TreeStats stats() const = 0;
+	virtual void reset_stats() = 0;
+
+	// Nodes and bytes the tree takes, see memory-usage.hpp
+	virtual MemoryUsage memory_usage() const = 0;
+
+	virtual void print(std::ostream &stream) const = 0;
 };
 
-template<typename Key, typename Value>
-using SearchTreePtr = std::unique_ptr<SearchTree<Key, Value>>;
+template<typename Key, typename Value, typename Compare = ThreeWayCompare>
+using SearchTreePtr = std::unique_ptr<SearchTree<Key, Value, Compare>>;
+
+// SearchTree forwarding every call to a Tree it owns
+template<typename Tree>
+class SearchTreeAdapter final: public SearchTree<typename Tree::key_type, typename Tree::mapped_type,
+		typename Tree::key_compare>
+{
+	using Key = typename Tree::key_type;
+	using Value = typename Tree::mapped_type;
+	using typename SearchTree<Key, Value, typename Tree::key_compare>::Position;
+
+	Tree tree;
+
+	Position first_position() const override final
+	{
+		return tree.first_position();
+	}
+
+	Position lower_bound_position(const Key &key) const override final
+	{
+		return tree.lower_bound_position(key);
+	}
+
+	Position upper_bound_position(const Key &key) const override final
+	{
+		return tree.upper_bound_position(key);
+	}
+
+	void next_position(Position &position) const override final
+	{
+		tree.next_position(position);
+	}
+
+	void prev_position(Position &position) const override final
+	{
+		tree.prev_position(position);
+	}
+
+	const Key &key_at(const Position &position) const override final
+	{
+		return tree.key_at(position);
+	}
+
+	Value &value_at(const Position &position) const override final
+	{
+		return tree.value_at(position);
+	}
+
+	bool load(const std::string &path, std::true_type)
+	{
+		return tree.load(path);
+	}
+
+	bool load(const std::string &, std::false_type)
+	{
+		return false;
+	}
+
+public:
+	SearchTreeAdapter() = default;
+
+	Tree &get()
+	{
+		return tree;
+	}
+
+	const Tree &get() const
+	{
+		return tree;
+	}
+
+	void insert(const Key &key, const Value &value) override final
+	{
+		tree.insert(key, value);
+	}
+
+	void insert(const Key &key, Value &&value) override final
+	{
+		tree.insert(key, std::move(value));
+	}
+
+	void insert(Key &&key, const Value &value) override final
+	{
+		tree.insert(std::move(key), value);
+	}
+
+	void insert(Key &&key, Value &&value) override final
+	{
+		tree.insert(std::move(key), std::move(value));
+	}
+
+	Value *find(const Key &key) override final
+	{
+		return tree.find(key);
+	}
+
+	const Value *find(const Key &key) const override final
+	{
+		return tree.find(key);
+	}
+
+	void insert_batch(const std::vector<std::pair<Key, Value>> &pairs) override final
+	{
+		tree.insert_batch(pairs);
+	}
+
+	void insert_batch(std::vector<std::pair<Key, Value>> &&pairs) override final
+	{
+		tree.insert_batch(std::move(pairs));
+	}
+
+	void find_batch(const std::vector<Key> &keys, std::vector<Value *> &out) override final
+	{
+		tree.find_batch(keys, out);
+	}
+
+	Value *min() override final
+	{
+		return tree.min();
+	}
+
+	const Value *min() const override final
+	{
+		return tree.min();
+	}
+
+	Value *max() override final
+	{
+		return tree.max();
+	}
+
+	const Value *max() const override final
+	{
+		return tree.max();
+	}
+
+	bool remove(const Key &key) override final
+	{
+		return tree.remove(key);
+	}
+
+	bool load(const std::string &path) override final
+	{
+		return load(path, Serializable<Key, Value>());
+	}
+
+	TreeStats stats() const override final
+	{
+		return tree.stats();
+	}
+
+	void reset_stats() override final
+	{
+		tree.reset_stats();
+	}
+
+	MemoryUsage memory_usage() const override final
+	{
+		return tree.memory_usage();
+	}
+
+	void print(std::ostream &stream) const override final
+	{
+		tree.print(stream);
+	}
+};
 
 } // namespace search_trees
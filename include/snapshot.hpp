@@ -0,0 +1,271 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <streambuf>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace search_trees
+{
+
+// Writes objects to and reads them back from a binary stream, returning false when the
+// stream fails. Trivially copyable types are copied byte for byte, in the machine's own
+// byte order; specialize it for other key and value types that trees should save.
+template<typename T, typename Enable = void>
+struct Serializer
+{
+	static constexpr bool supported = false;
+};
+
+template<typename T>
+struct Serializer<T, std::enable_if_t<std::is_trivially_copyable<T>::value>>
+{
+	static constexpr bool supported = true;
+
+	static bool write(std::streambuf &out, const T &object)
+	{
+		return out.sputn(reinterpret_cast<const char *>(&object), sizeof(T)) == sizeof(T);
+	}
+
+	static bool read(std::streambuf &in, T &object)
+	{
+		return in.sgetn(reinterpret_cast<char *>(&object), sizeof(T)) == sizeof(T);
+	}
+};
+
+// Length, then the characters
+template<typename Char, typename Traits, typename Alloc>
+struct Serializer<std::basic_string<Char, Traits, Alloc>>
+{
+	static_assert(std::is_trivially_copyable<Char>::value, "characters are copied byte for byte");
+
+	static constexpr bool supported = true;
+
+	using String = std::basic_string<Char, Traits, Alloc>;
+
+	static bool write(std::streambuf &out, const String &string)
+	{
+		std::uint64_t length = string.size();
+		std::streamsize bytes = length * sizeof(Char);
+		return Serializer<std::uint64_t>::write(out, length)
+				&& out.sputn(reinterpret_cast<const char *>(string.data()), bytes) == bytes;
+	}
+
+	// Read in pieces, so that a damaged length runs into the end of the stream instead of
+	// allocating whatever it says
+	static bool read(std::streambuf &in, String &string)
+	{
+		std::uint64_t length;
+		if (!Serializer<std::uint64_t>::read(in, length))
+			return false;
+
+		string.clear();
+		Char piece[256];
+		while (length) {
+			auto count = std::min<std::uint64_t>(length, 256);
+			std::streamsize bytes = count * sizeof(Char);
+			if (in.sgetn(reinterpret_cast<char *>(piece), bytes) != bytes)
+				return false;
+			string.append(piece, count);
+			length -= count;
+		}
+
+		return true;
+	}
+};
+
+// First, then second
+template<typename First, typename Second>
+struct Serializer<std::pair<First, Second>, std::enable_if_t<!std::is_trivially_copyable<std::pair<First, Second>>::value>>
+{
+	static constexpr bool supported = Serializer<First>::supported && Serializer<Second>::supported;
+
+	static bool write(std::streambuf &out, const std::pair<First, Second> &pair)
+	{
+		return Serializer<First>::write(out, pair.first) && Serializer<Second>::write(out, pair.second);
+	}
+
+	static bool read(std::streambuf &in, std::pair<First, Second> &pair)
+	{
+		return Serializer<First>::read(in, pair.first) && Serializer<Second>::read(in, pair.second);
+	}
+};
+
+template<typename Key, typename Value>
+struct Serializable: std::integral_constant<bool, Serializer<Key>::supported && Serializer<Value>::supported>
+{};
+
+namespace detail
+{
+
+constexpr std::size_t snapshot_buffer_bytes = 1 << 20;
+
+// Snapshots are only read back by a build with the same key and value types and byte order
+struct SnapshotHeader
+{
+	char magic[4];
+	std::uint32_t version;
+	std::uint32_t byte_order;
+	std::uint32_t key_bytes;
+	std::uint32_t value_bytes;
+	std::uint32_t reserved;
+	std::uint64_t count;
+
+	template<typename Key, typename Value>
+	static SnapshotHeader make(std::uint64_t count)
+	{
+		return SnapshotHeader{{'S', 'T', 'S', 'N'}, 1, 0x01020304, sizeof(Key), sizeof(Value), 0, count};
+	}
+
+	bool same_format(const SnapshotHeader &other) const
+	{
+		return std::equal(magic, magic + 4, other.magic) && version == other.version
+				&& byte_order == other.byte_order && key_bytes == other.key_bytes
+				&& value_bytes == other.value_bytes && reserved == other.reserved;
+	}
+};
+
+// Moves a completely written temporary file over path, or removes it if writing failed
+inline bool replace_file(const std::string &temporary, const std::string &path, bool written)
+{
+	// Not every platform's rename replaces an existing file
+	if (written && std::rename(temporary.c_str(), path.c_str()) != 0) {
+		std::remove(path.c_str());
+		written = std::rename(temporary.c_str(), path.c_str()) == 0;
+	}
+
+	if (!written)
+		std::remove(temporary.c_str());
+	return written;
+}
+
+} // namespace detail
+
+// Writes a header and the (key, value) pairs of [begin, end), which must be in key order.
+// The snapshot goes to a temporary file that replaces path once complete, so a failed or
+// interrupted save leaves an earlier snapshot intact.
+template<typename Key, typename Value, typename Iterator>
+bool save_snapshot(const std::string &path, Iterator begin, Iterator end)
+{
+	static_assert(Serializable<Key, Value>::value, "key and value types need a Serializer");
+
+	auto temporary = path + ".tmp";
+	std::vector<char> buffer(detail::snapshot_buffer_bytes);
+	std::filebuf file;
+	file.pubsetbuf(buffer.data(), buffer.size());
+	if (!file.open(temporary, std::ios::out | std::ios::binary | std::ios::trunc))
+		return false;
+
+	auto header = detail::SnapshotHeader::make<Key, Value>(0);
+	auto good = Serializer<detail::SnapshotHeader>::write(file, header);
+	for (; good && begin != end; ++begin, ++header.count)
+		good = Serializer<Key>::write(file, (*begin).first) && Serializer<Value>::write(file, (*begin).second);
+
+	// The count goes in last
+	good = good && file.pubseekpos(0, std::ios::out) == std::streampos(0)
+			&& Serializer<detail::SnapshotHeader>::write(file, header);
+	good = file.close() && good;
+	return detail::replace_file(temporary, path, good);
+}
+
+// Reads back what save_snapshot() wrote. ok() turns false on a missing, damaged or
+// truncated file; finished() tells whether every entry was read and nothing follows.
+template<typename Key, typename Value>
+class SnapshotReader
+{
+	static_assert(Serializable<Key, Value>::value, "key and value types need a Serializer");
+
+	std::vector<char> buffer;
+	std::filebuf file;
+	std::uint64_t count, remaining;
+	std::pair<Key, Value> entry;
+	bool good;
+
+	void next()
+	{
+		if (!remaining)
+			return;
+
+		--remaining;
+		good = good && Serializer<Key>::read(file, entry.first) && Serializer<Value>::read(file, entry.second);
+	}
+
+public:
+	// Input iterator over the entries. Each entry may be moved from before the next is read.
+	class Iterator
+	{
+		SnapshotReader *reader;
+
+	public:
+		explicit Iterator(SnapshotReader *reader)
+			: reader(reader)
+		{}
+
+		std::pair<Key, Value> &&operator*() const
+		{
+			return std::move(reader->entry);
+		}
+
+		Iterator &operator++()
+		{
+			reader->next();
+			return *this;
+		}
+	};
+
+	explicit SnapshotReader(const std::string &path)
+		: buffer(detail::snapshot_buffer_bytes)
+		, count(0)
+		, remaining(0)
+		, good(false)
+	{
+		file.pubsetbuf(buffer.data(), buffer.size());
+		if (!file.open(path, std::ios::in | std::ios::binary))
+			return;
+
+		std::streamoff bytes = file.pubseekoff(0, std::ios::end, std::ios::in);
+		detail::SnapshotHeader header;
+		if (bytes < std::streamoff(sizeof(header)) || file.pubseekpos(0, std::ios::in) != std::streampos(0)
+				|| !Serializer<detail::SnapshotHeader>::read(file, header)
+				|| !header.same_format(detail::SnapshotHeader::make<Key, Value>(0)))
+			return;
+
+		// Every entry takes a byte at least, which bounds what a damaged count can make a tree allocate
+		if (header.count > std::uint64_t(bytes) - sizeof(header))
+			return;
+
+		count = remaining = header.count;
+		good = true;
+		next();
+	}
+
+	SnapshotReader(const SnapshotReader &) = delete;
+	SnapshotReader &operator=(const SnapshotReader &) = delete;
+
+	std::uint64_t size() const
+	{
+		return count;
+	}
+
+	bool ok() const
+	{
+		return good;
+	}
+
+	bool finished()
+	{
+		return good && !remaining && file.sgetc() == std::char_traits<char>::eof();
+	}
+
+	Iterator begin()
+	{
+		return Iterator(this);
+	}
+};
+
+} // namespace search_trees
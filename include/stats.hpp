@@ -0,0 +1,235 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "compare.hpp"
+
+namespace search_trees
+{
+
+// What the trees did since they were created or their stats were last reset. Counting is
+// compiled in only when SEARCH_TREES_STATS is defined before the trees are included,
+// otherwise the counters cost nothing and stay zero. height is filled in either way.
+// Counted lookups may run on many threads at once, as in ConcurrentSearchTree, since the
+// counters are relaxed atomics.
+struct TreeStats
+{
+	// Key comparisons and nodes entered on the way down to a key
+	std::uint64_t comparisons = 0;
+	std::uint64_t nodes_visited = 0;
+
+	// Red-black rebalancing: recolorings that pushed a red-red violation up two levels,
+	// steps of remove_double_blackness, and rotations of either
+	std::uint64_t red_red_fixes = 0;
+	std::uint64_t double_black_fixes = 0;
+	std::uint64_t rotations = 0;
+
+	// Nodes split by inserts and merged by removes in the 2-3 and B+ trees
+	std::uint64_t splits = 0;
+	std::uint64_t merges = 0;
+
+	// Most rebalancing steps a single insert or remove took: red-black recolorings and
+	// rotations, 2-3 and B+ splits or merges climbing the tree
+	std::uint64_t longest_cascade = 0;
+
+	// Rebuilds that cleared the tombstones of lazy removal in the red-black and 2-3 trees
+	std::uint64_t compactions = 0;
+
+	// Levels from the root to the deepest leaf, 0 for an empty tree
+	unsigned height = 0;
+};
+
+namespace detail
+{
+
+template<typename Compare>
+struct CountingLess
+{
+	std::atomic<std::uint64_t> *count;
+
+	template<typename A, typename B>
+	bool operator()(const A &a, const B &b) const
+	{
+		count->fetch_add(1, std::memory_order_relaxed);
+		return Compare::less(a, b);
+	}
+};
+
+} // namespace detail
+
+// Counters a tree keeps, with every method an empty inline function unless enabled
+#ifdef SEARCH_TREES_STATS
+class OperationCounters
+{
+	using Counter = std::atomic<std::uint64_t>;
+
+	Counter comparisons{0};
+	Counter nodes_visited{0};
+	Counter red_red_fixes{0};
+	Counter double_black_fixes{0};
+	Counter rotations{0};
+	Counter splits{0};
+	Counter merges{0};
+	Counter longest_cascade{0};
+	Counter compactions{0};
+
+	static void add(Counter &counter, std::uint64_t count = 1)
+	{
+		counter.fetch_add(count, std::memory_order_relaxed);
+	}
+
+	static std::uint64_t load(const Counter &counter)
+	{
+		return counter.load(std::memory_order_relaxed);
+	}
+
+	void set(const TreeStats &counts)
+	{
+		comparisons.store(counts.comparisons, std::memory_order_relaxed);
+		nodes_visited.store(counts.nodes_visited, std::memory_order_relaxed);
+		red_red_fixes.store(counts.red_red_fixes, std::memory_order_relaxed);
+		double_black_fixes.store(counts.double_black_fixes, std::memory_order_relaxed);
+		rotations.store(counts.rotations, std::memory_order_relaxed);
+		splits.store(counts.splits, std::memory_order_relaxed);
+		merges.store(counts.merges, std::memory_order_relaxed);
+		longest_cascade.store(counts.longest_cascade, std::memory_order_relaxed);
+		compactions.store(counts.compactions, std::memory_order_relaxed);
+	}
+
+public:
+	OperationCounters() = default;
+
+	// Copies of a tree take its counts along
+	OperationCounters(const OperationCounters &other)
+	{
+		set(other.get());
+	}
+
+	OperationCounters &operator=(const OperationCounters &other)
+	{
+		set(other.get());
+		return *this;
+	}
+
+	void compared(std::uint64_t count = 1)
+	{
+		add(comparisons, count);
+	}
+
+	void visited()
+	{
+		add(nodes_visited);
+	}
+
+	void red_red_fixed()
+	{
+		add(red_red_fixes);
+	}
+
+	void double_black_fixed()
+	{
+		add(double_black_fixes);
+	}
+
+	void rotated()
+	{
+		add(rotations);
+	}
+
+	void split()
+	{
+		add(splits);
+	}
+
+	void merged()
+	{
+		add(merges);
+	}
+
+	void cascaded(std::uint64_t levels)
+	{
+		auto longest = load(longest_cascade);
+		while (levels > longest && !longest_cascade.compare_exchange_weak(longest, levels, std::memory_order_relaxed));
+	}
+
+	void compacted()
+	{
+		add(compactions);
+	}
+
+	// Less-than function object counting its calls as comparisons
+	template<typename Compare>
+	detail::CountingLess<Compare> less()
+	{
+		return detail::CountingLess<Compare>{&comparisons};
+	}
+
+	TreeStats get() const
+	{
+		TreeStats counts;
+		counts.comparisons = load(comparisons);
+		counts.nodes_visited = load(nodes_visited);
+		counts.red_red_fixes = load(red_red_fixes);
+		counts.double_black_fixes = load(double_black_fixes);
+		counts.rotations = load(rotations);
+		counts.splits = load(splits);
+		counts.merges = load(merges);
+		counts.longest_cascade = load(longest_cascade);
+		counts.compactions = load(compactions);
+		return counts;
+	}
+
+	void reset()
+	{
+		set(TreeStats());
+	}
+};
+#else
+class OperationCounters
+{
+public:
+	void compared(std::uint64_t = 1)
+	{}
+
+	void visited()
+	{}
+
+	void red_red_fixed()
+	{}
+
+	void double_black_fixed()
+	{}
+
+	void rotated()
+	{}
+
+	void split()
+	{}
+
+	void merged()
+	{}
+
+	void cascaded(std::uint64_t)
+	{}
+
+	void compacted()
+	{}
+
+	template<typename Compare>
+	CompareLess<Compare> less()
+	{
+		return CompareLess<Compare>();
+	}
+
+	TreeStats get() const
+	{
+		return TreeStats();
+	}
+
+	void reset()
+	{}
+};
+#endif
+
+} // namespace search_trees
@@ -2,34 +2,74 @@
 
 #include <utility>
 #include <string>
+#include <type_traits>
 
 #include "search-tree.hpp"
+#include "allocator.hpp"
+#include "augment.hpp"
 #include "data.hpp"
+#include "memory-usage.hpp"
+#include "stats.hpp"
 #include "util.hpp"
 
 namespace search_trees
 {
 
-template<typename Key, typename Value>
-class TwoThreeTree final: public SearchTree<Key, Value>
+template<typename Key, typename Value, template<typename> class Allocator = HeapAllocator, typename Layout = InlineLayout,
+		typename Augment = NoAugment, typename Compare = ThreeWayCompare>
+class TwoThreeTree final: public OrderedTree<TwoThreeTree<Key, Value, Allocator, Layout, Augment, Compare>, Key, Value, Compare>
 {
-	struct Node;
-	using NodePtr = std::unique_ptr<Node>;
+	friend class OrderedTree<TwoThreeTree, Key, Value, Compare>;
+	friend class TreeIterator<TwoThreeTree, Key, Value>;
+	friend class TreeIterator<TwoThreeTree, Key, const Value>;
+	friend class SearchTreeAdapter<TwoThreeTree>;
+
+	using Entry = typename Layout::template Entry<Key, Value, Allocator>;
+	using Aggregate = typename Augment::type;
 
 	struct Node
 	{
-		DataPtr<Key, Value> ldata, rdata;
-		NodePtr left, middle, right;
+		Entry ldata;
+		Storage<Entry> rdata;
+		Node *left, *middle, *right;
 		Node *parent;
+		bool three;
+
+		// Entries removed lazily, see set_lazy_remove()
+		bool ldead, rdead;
 
-		Node(DataPtr<Key, Value> &&data)
-			: ldata(std::move(data))
+		SubtreeSummary<Augment> summary;
+
+		template<typename ...Args>
+		Node(Args &&...args)
+			: ldata(std::forward<Args>(args)...)
+			, left(nullptr)
+			, middle(nullptr)
+			, right(nullptr)
 			, parent(nullptr)
+			, three(false)
+			, ldead(false)
+			, rdead(false)
 		{}
 
 		bool is_three() const
 		{
-			return rdata != nullptr;
+			return three;
+		}
+
+		void set_rdata(Entry &&entry, bool dead = false)
+		{
+			rdata.emplace(std::move(entry));
+			rdead = dead;
+			three = true;
+		}
+
+		Entry take_rdata()
+		{
+			Entry entry(std::move(*rdata));
+			rdata.destroy();
+			three = false;
+			return entry;
 		}
 
 		bool is_leaf() const
@@ -37,45 +77,87 @@ class TwoThreeTree final: public SearchTree<Key, Value>
 			return !left;
 		}
 
-		void set_left(NodePtr &&node) {
+		void set_left(Node *node) {
 			if (node)
 				node->parent = this;
-			left = std::move(node);
+			left = node;
 		}
 
-		void set_middle(NodePtr &&node) {
+		void set_middle(Node *node) {
 			if (node)
 				node->parent = this;
-			middle = std::move(node);
+			middle = node;
 		}
 
-		void set_right(NodePtr &&node) {
+		void set_right(Node *node) {
 			if (node)
 				node->parent = this;
-			right = std::move(node);
+			right = node;
 		}
 
-		std::pair<Node *, bool> find(const Key &key)
+		// Node and entry holding key, comparing key once with each entry on the way
+		template<typename K>
+		std::pair<Node *, bool> find(const K &key, OperationCounters &counters)
 		{
-			if (key == ldata->key) {
-				return std::make_pair(this, true);
-			} else if (is_three() && key == rdata->key) {
-				return std::make_pair(this, false);
-			} else if (key < ldata->key) {
-				if (left)
-					return left->find(key);
-				else
-					return std::make_pair(nullptr, false);
-			} else if (is_three() && key < rdata->key) {
-				if (middle)
-					return middle->find(key);
-				else
-					return std::make_pair(nullptr, false);
-			} else {
-				if (right)
-					return right->find(key);
-				else
-					return std::make_pair(nullptr, false);
+			auto node = this;
+			while (node) {
+				counters.visited();
+				counters.compared();
+				auto order = Compare::compare(key, node->ldata.key());
+				if (order == 0)
+					return std::make_pair(node, true);
+				if (order < 0) {
+					node = node->left;
+					continue;
+				}
+				if (!node->is_three()) {
+					node = node->right;
+					continue;
+				}
+
+				counters.compared();
+				order = Compare::compare(key, node->rdata->key());
+				if (order == 0)
+					return std::make_pair(node, false);
+				node = order < 0 ? node->middle : node->right;
+			}
+
+			return std::make_pair(nullptr, false);
+		}
+
+		// Last node on the way down to key, with slot 0 or 1 for the left (ldata) or right
+		// entry holding key and -1 when no entry does
+		template<typename K>
+		Node *descend(const K &key, int &slot, OperationCounters &counters)
+		{
+			auto node = this;
+			for (;;) {
+				counters.visited();
+				counters.compared();
+				auto order = Compare::compare(key, node->ldata.key());
+				Node *next;
+				if (order == 0) {
+					slot = 0;
+					return node;
+				} else if (order < 0) {
+					next = node->left;
+				} else if (!node->is_three()) {
+					next = node->right;
+				} else {
+					counters.compared();
+					order = Compare::compare(key, node->rdata->key());
+					if (order == 0) {
+						slot = 1;
+						return node;
+					}
+					next = order < 0 ? node->middle : node->right;
+				}
+
+				if (!next) {
+					slot = -1;
+					return node;
+				}
+				node = next;
 			}
 		}
 
@@ -84,8 +166,8 @@ class TwoThreeTree final: public SearchTree<Key, Value>
 			if (!right)
 				return this;
 
-			auto r = right.get();
-			for (; r->right; r = r->right.get());
+			auto r = right;
+			for (; r->right; r = r->right);
 			return r;
 		}
 
@@ -94,33 +176,60 @@ class TwoThreeTree final: public SearchTree<Key, Value>
 			if (!left)
 				return this;
 
-			auto l = left.get();
-			for (; l->left; l = l->left.get());
+			auto l = left;
+			for (; l->left; l = l->left);
 			return l;
 		}
 
-		Node *predecessor() const
+		// In-order neighbours of the left (ldata) or right entry, in the form find() returns
+		std::pair<Node *, bool> predecessor(bool ldata)
 		{
-			if (!left)
-				return nullptr;
+			if (!is_leaf()) {
+				auto node = (ldata ? left : middle)->max();
+				return std::make_pair(node, !node->is_three());
+			}
 
-			return left->max();
+			if (!ldata)
+				return std::make_pair(this, true);
+
+			auto node = this;
+			for (; node->parent && node == node->parent->left; node = node->parent);
+
+			auto parent = node->parent;
+			if (!parent)
+				return std::make_pair(nullptr, false);
+			else if (node == parent->right)
+				return std::make_pair(parent, !parent->is_three());
+			else
+				return std::make_pair(parent, true);
 		}
 
-		Node *successor() const
+		std::pair<Node *, bool> successor(bool ldata)
 		{
-			if (!right)
-				return nullptr;
+			if (!is_leaf())
+				return std::make_pair((ldata && is_three() ? middle : right)->min(), true);
+
+			if (ldata && is_three())
+				return std::make_pair(this, false);
 
-			return right->min();
+			auto node = this;
+			for (; node->parent && node == node->parent->right; node = node->parent);
+
+			auto parent = node->parent;
+			if (!parent)
+				return std::make_pair(nullptr, false);
+			else if (node == parent->left)
+				return std::make_pair(parent, true);
+			else
+				return std::make_pair(parent, false);
 		}
 
 		friend std::ostream &operator<<(std::ostream &stream, const Node &node)
 		{
-			stream << node.ldata->key;
-			if (node.rdata) {
+			stream << node.ldata.key();
+			if (node.three) {
 				stream << '|';
-				stream << node.rdata->key;
+				stream << node.rdata->key();
 			}
 
 			return stream;
@@ -151,327 +260,1596 @@ class TwoThreeTree final: public SearchTree<Key, Value>
 		}
 	};
 
-	NodePtr root;
+	Node *root;
+	Allocator<Node> node_allocator;
+	Allocator<Value> value_allocator;
+	mutable OperationCounters counters;
+
+	// Lazy removal: tombstones are compacted away once they pass this fraction of the
+	// entries, which are counted with the tombstones. 0 when removal is immediate.
+	double tombstone_fraction;
+	std::size_t tombstone_count;
+	std::size_t entry_count;
+
+	// Changes whenever nodes may have been freed, which sends cursors back to the root
+	std::uint64_t version;
 
-	static void insert_into_subtree(NodePtr &&subtree, NodePtr &&node)
+	void destroy_node(Node *node)
 	{
-		if (!subtree)
+		node->ldata.release(value_allocator);
+		if (node->is_three()) {
+			node->rdata->release(value_allocator);
+			node->rdata.destroy();
+		}
+		destroy(node_allocator, node);
+	}
+
+	void destroy_subtree(Node *node)
+	{
+		if (!node)
 			return;
 
-		if (node->ldata->key == subtree->ldata->key) {
-			subtree->ldata->value = std::move(node->ldata->value);
-		} else if (subtree->is_three() && node->ldata->key == subtree->rdata->key) {
-			subtree->rdata->value = std::move(node->ldata->value);
-		} else if (node->ldata->key < subtree->ldata->key) {
-			insert_into_subtree(std::move(subtree->left), std::move(node));
-			if (!node)
+		destroy_subtree(node->left);
+		destroy_subtree(node->middle);
+		destroy_subtree(node->right);
+		destroy_node(node);
+	}
+
+	static std::size_t size_of(const Node *node)
+	{
+		return node ? node->summary.size : 0;
+	}
+
+	static Aggregate aggregate_of(const Node *node)
+	{
+		return node ? node->summary.value : Augment::identity();
+	}
+
+	// Tombstones count for nothing
+	static Aggregate lift(const Node *node, bool ldata)
+	{
+		if (ldata)
+			return node->ldead ? Augment::identity() : Augment::lift(node->ldata.value());
+		return node->rdead ? Augment::identity() : Augment::lift(node->rdata->value());
+	}
+
+	static void update(Node *, std::false_type)
+	{}
+
+	static void update(Node *node, std::true_type)
+	{
+		node->summary.size = size_of(node->left) + !node->ldead + size_of(node->right);
+		auto value = Augment::combine(aggregate_of(node->left), lift(node, true));
+		if (node->is_three()) {
+			node->summary.size += size_of(node->middle) + !node->rdead;
+			value = Augment::combine(Augment::combine(value, aggregate_of(node->middle)), lift(node, false));
+		}
+		node->summary.value = Augment::combine(value, aggregate_of(node->right));
+	}
+
+	// Recomputes the augmented fields of node from its entries and children
+	static void update(Node *node)
+	{
+		update(node, is_augmented<Augment>());
+	}
+
+	static void update_path(Node *node)
+	{
+		if (!is_augmented<Augment>::value)
+			return;
+
+		for (; node; node = node->parent)
+			update(node);
+	}
+
+	// Puts entry into node, right after the child it was promoted from. If node overflows,
+	// its middle entry moves on to the parent together with a new right sibling.
+	void insert_into_subtree(Node *node, Entry &&entry, Node *right_child)
+	{
+		// Entries promoted from below take their tombstone marks along
+		bool dead = false;
+		for (std::uint64_t steps = 0;; ++steps) {
+			if (!node->is_three()) {
+				if (Compare::less(entry.key(), node->ldata.key())) {
+					node->set_rdata(std::move(node->ldata), node->ldead);
+					node->ldata = std::move(entry);
+					node->ldead = dead;
+					node->set_middle(right_child);
+				} else {
+					node->set_rdata(std::move(entry), dead);
+					node->set_middle(node->right);
+					node->set_right(right_child);
+				}
+				update_path(node);
+				counters.cascaded(steps);
 				return;
-			if (!subtree->is_three()) {
-				subtree->rdata = std::move(subtree->ldata);
-				subtree->ldata = std::move(node->ldata);
-				subtree->set_left(std::move(node->left));
-				subtree->set_middle(std::move(node->right));
-				node.reset();
+			}
+
+			counters.split();
+			Node *sibling;
+			if (Compare::less(entry.key(), node->ldata.key())) {
+				Entry promoted(std::move(node->ldata));
+				node->ldata = std::move(entry);
+				std::swap(node->ldead, dead);
+				sibling = construct(node_allocator, node->take_rdata());
+				sibling->ldead = node->rdead;
+				sibling->set_left(node->middle);
+				sibling->set_right(node->right);
+				node->set_right(right_child);
+				entry = std::move(promoted);
+			} else if (Compare::less(entry.key(), node->rdata->key())) {
+				sibling = construct(node_allocator, node->take_rdata());
+				sibling->ldead = node->rdead;
+				sibling->set_left(right_child);
+				sibling->set_right(node->right);
+				node->set_right(node->middle);
 			} else {
-				auto right = std::make_unique<Node>(std::move(subtree->rdata));
-				right->set_left(std::move(subtree->middle));
-				right->set_right(std::move(subtree->right));
-				subtree->set_left(std::move(node));
-				subtree->set_right(std::move(right));
-				node = std::move(subtree);
+				sibling = construct(node_allocator, std::move(entry));
+				sibling->ldead = dead;
+				sibling->set_left(node->right);
+				sibling->set_right(right_child);
+				node->set_right(node->middle);
+				entry = node->take_rdata();
+				dead = node->rdead;
 			}
-		} else if (subtree->is_three() && node->ldata->key < subtree->rdata->key) {
-			insert_into_subtree(std::move(subtree->middle), std::move(node));
-			if (!node)
-				return;
-			auto right = std::make_unique<Node>(std::move(subtree->rdata));
-			right->set_left(std::move(node->right));
-			right->set_right(std::move(subtree->right));
-			subtree->set_right(std::move(node->left));
-			node->parent = subtree->parent;
-			node->set_left(std::move(subtree));
-			node->set_right(std::move(right));
-		} else {
-			insert_into_subtree(std::move(subtree->right), std::move(node));
-			if (!node)
+			node->middle = nullptr;
+			update(node);
+			update(sibling);
+
+			if (!node->parent) {
+				root = construct(node_allocator, std::move(entry));
+				root->ldead = dead;
+				root->set_left(node);
+				root->set_right(sibling);
+				update(root);
+				counters.cascaded(steps + 1);
 				return;
-			if (!subtree->is_three()) {
-				subtree->rdata = std::move(node->ldata);
-				subtree->set_middle(std::move(node->left));
-				subtree->set_right(std::move(node->right));
-				node.reset();
-			} else {
-				auto left = std::make_unique<Node>(std::move(subtree->ldata));
-				left->set_left(std::move(subtree->left));
-				left->set_right(std::move(subtree->middle));
-				subtree->ldata = std::move(subtree->rdata);
-				subtree->set_left(std::move(left));
-				subtree->set_right(std::move(node));
-				node = std::move(subtree);
 			}
+
+			node = node->parent;
+			right_child = sibling;
 		}
 	}
 
-	template<typename KeyT, typename ValueT>
-	void insert_impl(KeyT &&key, ValueT &&value)
+	// Most entries a subtree of the given height can hold, every node a 3-node
+	static std::size_t capacity(unsigned height)
 	{
-		auto data = std::make_unique<Data<Key, Value>>(std::forward<KeyT>(key), std::forward<ValueT>(value));
+		std::size_t nodes = 1;
+		for (unsigned i = 0; i < height; ++i)
+			nodes *= 3;
+		return nodes - 1;
+	}
 
-		if (root) {
-			auto node = std::make_unique<Node>(std::move(data));
-			insert_into_subtree(std::move(root), std::move(node));
-			if (!root)
-				root = std::move(node);
-		} else {
-			root = std::make_unique<Node>(std::move(data));
+	// Subtree of the given height holding the next count entries from it, which must lie
+	// between 2^height - 1 and 3^height - 1. Children are filled as evenly as possible and
+	// a node only becomes a 3-node when two children cannot hold the entries.
+	template<typename Iterator>
+	Node *build_subtree(Iterator &it, std::size_t count, unsigned height)
+	{
+		Node *left = nullptr, *middle = nullptr;
+		std::size_t children = 0, rest = 0;
+		if (height > 1) {
+			children = count - 1 <= 2 * capacity(height - 1) ? 2 : 3;
+			rest = count - (children - 1);
+			left = build_subtree(it, rest / children + (rest % children > 0), height - 1);
+		}
+
+		auto node = construct(node_allocator, next_entry(it));
+		node->set_left(left);
+
+		if (children == 3) {
+			middle = build_subtree(it, rest / children + (rest % children > 1), height - 1);
+			node->set_middle(middle);
 		}
+
+		if (children == 3 || (!children && count == 2))
+			node->set_rdata(next_entry(it));
+
+		if (children)
+			node->set_right(build_subtree(it, rest / children, height - 1));
+
+		update(node);
+		return node;
 	}
 
-	Value *find_impl(const Key &key) const
+	// Entry made of the (key, value) pair at it, or taken from a vector of entries
+	template<typename Iterator>
+	Entry next_entry(Iterator &it)
 	{
-		if (root) {
-			auto found = root->find(key);
-			auto node = found.first;
-			if (node) {
-				auto ldata = found.second;
-				if (ldata)
-					return &node->ldata->value;
-				else
-					return &node->rdata->value;
-			}
+		Entry entry(value_allocator, (*it).first, (*it).second);
+		++it;
+		return entry;
+	}
+
+	Entry next_entry(typename std::vector<Entry>::iterator &it)
+	{
+		return std::move(*it++);
+	}
+
+	template<typename Iterator>
+	void build(Iterator it, std::size_t count)
+	{
+		unsigned height = 0;
+		while (capacity(height) < count)
+			++height;
+		root = count ? build_subtree(it, count, height) : nullptr;
+		entry_count = count;
+	}
+
+	static std::size_t count_entries(const Node *node)
+	{
+		if (!node)
+			return 0;
+		return count_entries(node->left) + count_entries(node->middle) + count_entries(node->right)
+				+ (node->is_three() ? 2 : 1);
+	}
+
+	// After split, join and the set operations, which move and free nodes. Cursors go back
+	// to the root and the entries, which only lazy removal needs, are counted again.
+	void restructured()
+	{
+		++version;
+		if (tombstone_fraction > 0)
+			entry_count = count_entries(root);
+	}
+
+	// Moves the entries that are not tombstones out of the subtree of node, in key order
+	static void take_live(Node *node, std::vector<Entry> &live)
+	{
+		if (!node)
+			return;
+
+		take_live(node->left, live);
+		if (!node->ldead)
+			live.push_back(std::move(node->ldata));
+		if (node->is_three()) {
+			take_live(node->middle, live);
+			if (!node->rdead)
+				live.push_back(std::move(*node->rdata));
 		}
+		take_live(node->right, live);
+	}
 
-		return nullptr;
+	static bool is_dead(const std::pair<Node *, bool> &entry)
+	{
+		return entry.second ? entry.first->ldead : entry.first->rdead;
 	}
 
-	Value *min_impl() const
+	// Nearest entry from entry on, forwards or backwards, that is not a tombstone
+	static std::pair<Node *, bool> skip_forward(std::pair<Node *, bool> entry)
 	{
-		if (root)
-			return &root->min()->ldata->value;
+		while (entry.first && is_dead(entry))
+			entry = entry.first->successor(entry.second);
+		return entry;
+	}
 
-		return nullptr;
+	static std::pair<Node *, bool> skip_backward(std::pair<Node *, bool> entry)
+	{
+		while (entry.first && is_dead(entry))
+			entry = entry.first->predecessor(entry.second);
+		return entry;
 	}
 
-	Value *max_impl() const
+	// Entry holding the largest key
+	static std::pair<Node *, bool> max_entry(Node *node)
 	{
-		if (root) {
-			auto max = root->max();
-			if (max->is_three())
-				return &max->rdata->value;
-			else
-				return &max->ldata->value;
+		node = node->max();
+		return std::make_pair(node, !node->is_three());
+	}
+
+	// Lowest ancestor of node whose subtree spans key, given that key is above everything left of node
+	static Node *ancestor_spanning(Node *node, const Key &key)
+	{
+		for (auto parent = node->parent; parent; node = parent, parent = parent->parent) {
+			if (node == parent->left && Compare::less(key, parent->ldata.key()))
+				break;
+			if (node == parent->middle && Compare::less(key, parent->rdata->key()))
+				break;
 		}
 
-		return nullptr;
+		return node;
+	}
+
+	static const Key &last_key(const Node *node)
+	{
+		return node->is_three() ? node->rdata->key() : node->ldata.key();
 	}
 
-	void remove_hole(Node *hole)
+	// Lowest node on the way up from node whose subtree spans key. Climbs only while the
+	// ancestors passed bound the keys below them away from key, so nearby keys stay low.
+	template<typename K>
+	Node *ancestor_near(Node *node, const K &key) const
 	{
-		auto parent = hole->parent;
+		counters.compared();
+		bool above = !Compare::less(key, node->ldata.key());
+		if (above) {
+			counters.compared();
+			if (!Compare::less(last_key(node), key))
+				return node;
+		}
 
-		if (!parent) {
-			root = std::move(hole->left);
-			if (root)
-				root->parent = nullptr;
-			return;
+		auto lowest = node;
+		for (auto parent = node->parent; parent; node = parent, parent = parent->parent) {
+			counters.visited();
+			const Key *bound = nullptr;
+			if (above && node != parent->right)
+				bound = node == parent->left ? &parent->ldata.key() : &parent->rdata->key();
+			else if (!above && node != parent->left)
+				bound = node == parent->right ? &last_key(parent) : &parent->ldata.key();
+			if (!bound)
+				continue;
+
+			counters.compared();
+			if (above ? Compare::less(key, *bound) : Compare::less(*bound, key))
+				return lowest;
+
+			// Past the bound, so key is among the keys of parent unless beyond the far one
+			counters.compared();
+			if (above ? !Compare::less(last_key(parent), key) : !Compare::less(key, parent->ldata.key()))
+				return parent;
+			lowest = parent;
 		}
 
-		if (!parent->is_three()) {
-			if (hole == parent->left.get()) {
-				auto sibling = parent->right.get();
-				if (!sibling->is_three()) {
-					sibling->rdata = std::move(sibling->ldata);
-					sibling->ldata = std::move(parent->ldata);
-					sibling->set_middle(std::move(sibling->left));
-					sibling->set_left(std::move(hole->left));
-					parent->set_left(std::move(parent->right));
-					remove_hole(parent);
-				} else {
-					auto &left = parent->left;
-					left->ldata = std::move(parent->ldata);
-					left->set_right(std::move(sibling->left));
-					parent->ldata = std::move(sibling->ldata);
-					sibling->ldata = std::move(sibling->rdata);
-					sibling->set_left(std::move(sibling->middle));
-				}
-			} else {
-				auto sibling = parent->left.get();
-				if (!sibling->is_three()) {
-					sibling->rdata = std::move(parent->ldata);
-					sibling->set_middle(std::move(sibling->right));
-					sibling->set_right(std::move(hole->left));
-					parent->right.reset();
-					remove_hole(parent);
-				} else {
-					auto &right = parent->right;
-					right->ldata = std::move(parent->ldata);
-					right->set_right(std::move(right->left));
-					right->set_left(std::move(sibling->right));
-					parent->ldata = std::move(sibling->rdata);
-					sibling->set_right(std::move(sibling->middle));
-				}
-			}
-		} else {
-			if (hole == parent->left.get()) {
-				auto sibling = parent->middle.get();
-				if (!sibling->is_three()) {
-					sibling->rdata = std::move(sibling->ldata);
-					sibling->ldata = std::move(parent->ldata);
-					sibling->set_middle(std::move(sibling->left));
-					sibling->set_left(std::move(hole->left));
-					parent->ldata = std::move(parent->rdata);
-					parent->set_left(std::move(parent->middle));
-				} else {
-					auto &left = parent->left;
-					left->ldata = std::move(parent->ldata);
-					left->set_right(std::move(sibling->left));
-					parent->ldata = std::move(sibling->ldata);
-					sibling->ldata = std::move(sibling->rdata);
-					sibling->set_left(std::move(sibling->middle));
-				}
-			} else if (hole == parent->middle.get()) {
-				auto sibling = parent->left.get();
-				if (!sibling->is_three()) {
-					sibling->rdata = std::move(parent->ldata);
-					sibling->set_middle(std::move(sibling->right));
-					sibling->set_right(std::move(hole->left));
-					parent->ldata = std::move(parent->rdata);
-					parent->middle.reset();
-				} else {
-					auto &middle = parent->middle;
-					middle->ldata = std::move(parent->ldata);
-					middle->set_right(std::move(middle->left));
-					middle->set_left(std::move(sibling->right));
-					parent->ldata = std::move(sibling->rdata);
-					sibling->set_right(std::move(sibling->middle));
+		return lowest;
+	}
+
+	template<typename KeyT, typename ValueT>
+	void insert_impl(KeyT &&key, ValueT &&value)
+	{
+		insert_impl(std::forward<KeyT>(key), std::forward<ValueT>(value), root);
+	}
+
+	// Inserts with the descent starting at start, whose subtree must span key. Returns the node
+	// the descent ended in, which stays in the tree and has nothing but keys below key to its left.
+	template<typename KeyT, typename ValueT>
+	Node *insert_impl(KeyT &&key, ValueT &&value, Node *start)
+	{
+		if (!root) {
+			root = construct(node_allocator, value_allocator, std::forward<KeyT>(key), std::forward<ValueT>(value));
+			update(root);
+			++entry_count;
+			return root;
+		}
+
+		auto node = start;
+		for (;;) {
+			Node *child;
+			counters.visited();
+			counters.compared();
+			auto order = Compare::compare(key, node->ldata.key());
+			if (order == 0) {
+				node->ldata.value() = std::forward<ValueT>(value);
+				if (node->ldead) {
+					node->ldead = false;
+					--tombstone_count;
 				}
+				update_path(node);
+				return node;
+			} else if (order < 0) {
+				child = node->left;
+			} else if (!node->is_three()) {
+				child = node->right;
 			} else {
-				auto sibling = parent->middle.get();
-				if (!sibling->is_three()) {
-					sibling->rdata = std::move(parent->rdata);
-					sibling->set_middle(std::move(sibling->right));
-					sibling->set_right(std::move(hole->left));
-					parent->set_right(std::move(parent->middle));
-				} else {
-					auto &right = parent->right;
-					right->ldata = std::move(parent->rdata);
-					right->set_right(std::move(right->left));
-					right->set_left(std::move(sibling->right));
-					parent->rdata = std::move(sibling->rdata);
-					sibling->set_right(std::move(sibling->middle));
+				counters.compared();
+				order = Compare::compare(key, node->rdata->key());
+				if (order == 0) {
+					node->rdata->value() = std::forward<ValueT>(value);
+					if (node->rdead) {
+						node->rdead = false;
+						--tombstone_count;
+					}
+					update_path(node);
+					return node;
 				}
+				child = order < 0 ? node->middle : node->right;
 			}
+
+			if (!child)
+				break;
+			node = child;
 		}
+
+		insert_into_subtree(node, Entry(value_allocator, std::forward<KeyT>(key), std::forward<ValueT>(value)), nullptr);
+		++entry_count;
+		return node;
 	}
 
-	bool remove_impl(const Key &key)
+	template<typename Iterator>
+	void insert_batch_impl(Iterator pairs, const std::vector<std::size_t> &order)
 	{
-		if (root) {
-			auto found = root->find(key);
-			auto node = found.first;
-			if (!node)
-				return false;
+		Node *finger = nullptr;
+		for (auto i : order) {
+			auto start = finger ? ancestor_spanning(finger, pairs[i].first) : root;
+			finger = insert_impl(pairs[i].first, pairs[i].second, start);
+		}
+	}
 
-			auto ldata = found.second;
-			if (!node->is_leaf()) {
-				if (ldata) {
-					auto predecessor = node->predecessor();
-					if (predecessor->is_three()) {
-						node->ldata = std::move(predecessor->rdata);
-					} else {
-						node->ldata = std::move(predecessor->ldata);
-						remove_hole(predecessor);
-					}
-				} else {
-					auto successor = node->successor();
-					if (successor->is_three()) {
-						node->rdata = std::move(successor->ldata);
-						successor->ldata = std::move(successor->rdata);
-					} else {
-						node->rdata = std::move(successor->ldata);
-						remove_hole(successor);
-					}
-				}
-			} else if (node->is_three()) {
-				if (ldata)
-					node->ldata = std::move(node->rdata);
-				else
-					node->rdata.reset();
-			} else {
-				node->ldata.reset();
-				remove_hole(node);
+	// Splits the run of keys at every node while more than one key shares the way down.
+	// Single keys are left in descents to finish afterwards.
+	void find_sorted(Node *node, const Key *keys, const std::size_t *first, const std::size_t *last, Value **out,
+			std::vector<std::pair<Node *, std::size_t>> &descents) const
+	{
+		while (node && last - first > 1) {
+			auto equal = equal_run<Compare>(keys, first, last, node->ldata.key());
+			for (auto it = equal.first; it != equal.second && !node->ldead; ++it)
+				out[*it] = &node->ldata.value();
+
+			if (first != equal.first)
+				find_sorted(node->left, keys, first, equal.first, out, descents);
+			first = equal.second;
+
+			if (node->is_three()) {
+				equal = equal_run<Compare>(keys, first, last, node->rdata->key());
+				for (auto it = equal.first; it != equal.second && !node->rdead; ++it)
+					out[*it] = &node->rdata->value();
+
+				if (first != equal.first)
+					find_sorted(node->middle, keys, first, equal.first, out, descents);
+				first = equal.second;
 			}
 
-			return true;
+			node = node->right;
 		}
 
-		return false;
+		if (node && first != last)
+			descents.emplace_back(node, *first);
 	}
 
-	TwoThreeTree() = default;
-
-public:
-	static SearchTreePtr<Key, Value> create()
+	// Walks all descents down together, one level per round, so that the cache misses of
+	// independent lookups overlap instead of following one another
+	static void find_interleaved(std::vector<std::pair<Node *, std::size_t>> &descents, const Key *keys, Value **out)
 	{
-		return std::unique_ptr<TwoThreeTree<Key, Value>>(new TwoThreeTree<Key, Value>());
+		while (!descents.empty()) {
+			std::size_t active = 0;
+			for (auto &descent : descents) {
+				auto node = descent.first;
+				auto &key = keys[descent.second];
+				auto order = Compare::compare(key, node->ldata.key());
+				if (order == 0) {
+					if (!node->ldead)
+						out[descent.second] = &node->ldata.value();
+					continue;
+				} else if (order < 0) {
+					node = node->left;
+				} else if (!node->is_three()) {
+					node = node->right;
+				} else if ((order = Compare::compare(key, node->rdata->key())) == 0) {
+					if (!node->rdead)
+						out[descent.second] = &node->rdata->value();
+					continue;
+				} else {
+					node = order < 0 ? node->middle : node->right;
+				}
+
+				if (node)
+					descents[active++] = std::make_pair(node, descent.second);
+			}
+			descents.resize(active);
+		}
 	}
 
-	void insert(const Key &key, const Value &value) override final
+	template<typename K>
+	Value *find_impl(const K &key) const
 	{
-		insert_impl(key, value);
+		if (root) {
+			auto found = root->find(key, counters);
+			if (found.first && !is_dead(found))
+				return value_of(found);
+		}
+
+		return nullptr;
 	}
 
-	void insert(const Key &key, Value &&value) override final
+	static Value *value_of(const std::pair<Node *, bool> &entry)
 	{
-		insert_impl(key, value);
+		return entry.second ? &entry.first->ldata.value() : &entry.first->rdata->value();
 	}
 
-	void insert(Key &&key, const Value &value) override final
+	Value *min_impl() const
 	{
-		insert_impl(key, value);
+		auto min = root ? skip_forward(std::make_pair(root->min(), true)) : std::pair<Node *, bool>(nullptr, false);
+		return min.first ? value_of(min) : nullptr;
 	}
 
-	void insert(Key &&key, Value &&value) override final
+	Value *max_impl() const
 	{
-		insert_impl(key, value);
+		auto max = root ? skip_backward(max_entry(root)) : std::pair<Node *, bool>(nullptr, false);
+		return max.first ? value_of(max) : nullptr;
 	}
 
-	Value *find(const Key &key) override final
+	template<typename K>
+	std::pair<Node *, bool> lower_bound_entry(const K &key) const
 	{
-		return find_impl(key);
+		std::pair<Node *, bool> bound(nullptr, false);
+		for (auto node = root; node; ) {
+			if (!Compare::less(node->ldata.key(), key)) {
+				bound = std::make_pair(node, true);
+				node = node->left;
+			} else if (node->is_three() && !Compare::less(node->rdata->key(), key)) {
+				bound = std::make_pair(node, false);
+				node = node->middle;
+			} else {
+				node = node->right;
+			}
+		}
+
+		return bound;
 	}
 
-	const Value *find(const Key &key) const override final
+	template<typename K>
+	std::pair<Node *, bool> upper_bound_entry(const K &key) const
 	{
-		return find_impl(key);
+		std::pair<Node *, bool> bound(nullptr, false);
+		for (auto node = root; node; ) {
+			if (Compare::less(key, node->ldata.key())) {
+				bound = std::make_pair(node, true);
+				node = node->left;
+			} else if (node->is_three() && Compare::less(key, node->rdata->key())) {
+				bound = std::make_pair(node, false);
+				node = node->middle;
+			} else {
+				node = node->right;
+			}
+		}
+
+		return bound;
 	}
 
-	Value *min() override final
+	std::size_t rank_impl(const Key &key, bool inclusive) const
 	{
-		return min_impl();
+		auto precedes = [&](const Entry &entry) {
+			return Compare::less(entry.key(), key) || (inclusive && !Compare::less(key, entry.key()));
+		};
+
+		std::size_t rank = 0;
+		for (auto node = root; node; ) {
+			if (!precedes(node->ldata)) {
+				node = node->left;
+				continue;
+			}
+
+			rank += size_of(node->left) + !node->ldead;
+			if (node->is_three()) {
+				if (!precedes(*node->rdata)) {
+					node = node->middle;
+					continue;
+				}
+				rank += size_of(node->middle) + !node->rdead;
+			}
+			node = node->right;
+		}
+
+		return rank;
 	}
 
-	const Value *min() const override final
+	std::pair<Node *, bool> select_entry(std::size_t index) const
 	{
-		return min_impl();
+		auto node = root;
+		while (node) {
+			auto left = size_of(node->left);
+			if (index < left) {
+				node = node->left;
+				continue;
+			} else if (index == left && !node->ldead) {
+				return std::pair<Node *, bool>(node, true);
+			}
+
+			index -= left + !node->ldead;
+			if (node->is_three()) {
+				auto middle = size_of(node->middle);
+				if (index < middle) {
+					node = node->middle;
+					continue;
+				} else if (index == middle && !node->rdead) {
+					return std::pair<Node *, bool>(node, false);
+				}
+				index -= middle + !node->rdead;
+			}
+			node = node->right;
+		}
+
+		return std::pair<Node *, bool>(nullptr, false);
 	}
 
-	Value *max() override final
+	// Aggregate of the keys not less than lo in the subtree of node
+	static Aggregate aggregate_from(const Node *node, const Key &lo)
 	{
-		return max_impl();
+		auto result = Augment::identity();
+		while (node) {
+			if (node->is_three()) {
+				if (Compare::less(node->rdata->key(), lo)) {
+					node = node->right;
+					continue;
+				}
+				result = Augment::combine(Augment::combine(lift(node, false), aggregate_of(node->right)), result);
+			}
+
+			auto between = node->is_three() ? node->middle : node->right;
+			if (Compare::less(node->ldata.key(), lo)) {
+				node = between;
+			} else {
+				result = Augment::combine(Augment::combine(lift(node, true), aggregate_of(between)), result);
+				node = node->left;
+			}
+		}
+
+		return result;
 	}
 
-	const Value *max() const override final
+	// Aggregate of the keys not greater than hi in the subtree of node
+	static Aggregate aggregate_to(const Node *node, const Key &hi)
 	{
-		return max_impl();
+		auto result = Augment::identity();
+		while (node) {
+			if (Compare::less(hi, node->ldata.key())) {
+				node = node->left;
+				continue;
+			}
+
+			result = Augment::combine(result, Augment::combine(aggregate_of(node->left), lift(node, true)));
+			if (node->is_three()) {
+				if (Compare::less(hi, node->rdata->key())) {
+					node = node->middle;
+					continue;
+				}
+				result = Augment::combine(result, Augment::combine(aggregate_of(node->middle), lift(node, false)));
+			}
+			node = node->right;
+		}
+
+		return result;
 	}
 
-	bool remove(const Key &key) override final
+	// A hole is a node that lost its only entry and keeps at most its left child. It is
+	// filled by borrowing from a sibling, or merged away, which may leave a hole one level up.
+	// Returns the node the fix-up stopped at, which stays in the tree, or the new root.
+	Node *remove_hole(Node *hole)
 	{
-		return remove_impl(key);
+		++version;
+		for (std::uint64_t steps = 1;; ++steps) {
+			auto parent = hole->parent;
+
+			if (!parent) {
+				root = hole->left;
+				destroy_node(hole);
+				if (root)
+					root->parent = nullptr;
+				counters.cascaded(steps);
+				return root;
+			}
+
+			if (!parent->is_three()) {
+				if (hole == parent->left) {
+					auto sibling = parent->right;
+					if (!sibling->is_three()) {
+						sibling->set_rdata(std::move(sibling->ldata));
+						sibling->ldata = std::move(parent->ldata);
+						sibling->set_middle(std::exchange(sibling->left, nullptr));
+						sibling->set_left(hole->left);
+						destroy_node(hole);
+						counters.merged();
+						update(sibling);
+						parent->set_left(std::exchange(parent->right, nullptr));
+						hole = parent;
+						continue;
+					} else {
+						auto left = parent->left;
+						left->ldata = std::move(parent->ldata);
+						left->set_right(std::exchange(sibling->left, nullptr));
+						parent->ldata = std::move(sibling->ldata);
+						sibling->ldata = sibling->take_rdata();
+						sibling->set_left(std::exchange(sibling->middle, nullptr));
+						update(left);
+						update(sibling);
+					}
+				} else {
+					auto sibling = parent->left;
+					if (!sibling->is_three()) {
+						sibling->set_rdata(std::move(parent->ldata));
+						sibling->set_middle(std::exchange(sibling->right, nullptr));
+						sibling->set_right(hole->left);
+						destroy_node(hole);
+						counters.merged();
+						update(sibling);
+						parent->right = nullptr;
+						hole = parent;
+						continue;
+					} else {
+						auto right = parent->right;
+						right->ldata = std::move(parent->ldata);
+						right->set_right(std::exchange(right->left, nullptr));
+						right->set_left(std::exchange(sibling->right, nullptr));
+						parent->ldata = sibling->take_rdata();
+						sibling->set_right(std::exchange(sibling->middle, nullptr));
+						update(right);
+						update(sibling);
+					}
+				}
+			} else {
+				if (hole == parent->left) {
+					auto sibling = parent->middle;
+					if (!sibling->is_three()) {
+						sibling->set_rdata(std::move(sibling->ldata));
+						sibling->ldata = std::move(parent->ldata);
+						sibling->set_middle(std::exchange(sibling->left, nullptr));
+						sibling->set_left(hole->left);
+						destroy_node(hole);
+						counters.merged();
+						update(sibling);
+						parent->ldata = parent->take_rdata();
+						parent->set_left(std::exchange(parent->middle, nullptr));
+					} else {
+						auto left = parent->left;
+						left->ldata = std::move(parent->ldata);
+						left->set_right(std::exchange(sibling->left, nullptr));
+						parent->ldata = std::move(sibling->ldata);
+						sibling->ldata = sibling->take_rdata();
+						sibling->set_left(std::exchange(sibling->middle, nullptr));
+						update(left);
+						update(sibling);
+					}
+				} else if (hole == parent->middle) {
+					auto sibling = parent->left;
+					if (!sibling->is_three()) {
+						sibling->set_rdata(std::move(parent->ldata));
+						sibling->set_middle(std::exchange(sibling->right, nullptr));
+						sibling->set_right(hole->left);
+						destroy_node(hole);
+						counters.merged();
+						update(sibling);
+						parent->ldata = parent->take_rdata();
+						parent->middle = nullptr;
+					} else {
+						auto middle = parent->middle;
+						middle->ldata = std::move(parent->ldata);
+						middle->set_right(std::exchange(middle->left, nullptr));
+						middle->set_left(std::exchange(sibling->right, nullptr));
+						parent->ldata = sibling->take_rdata();
+						sibling->set_right(std::exchange(sibling->middle, nullptr));
+						update(middle);
+						update(sibling);
+					}
+				} else {
+					auto sibling = parent->middle;
+					if (!sibling->is_three()) {
+						sibling->set_rdata(parent->take_rdata());
+						sibling->set_middle(std::exchange(sibling->right, nullptr));
+						sibling->set_right(hole->left);
+						destroy_node(hole);
+						counters.merged();
+						update(sibling);
+						parent->set_right(std::exchange(parent->middle, nullptr));
+					} else {
+						auto right = parent->right;
+						right->ldata = parent->take_rdata();
+						right->set_right(std::exchange(right->left, nullptr));
+						right->set_left(std::exchange(sibling->right, nullptr));
+						parent->set_rdata(sibling->take_rdata());
+						sibling->set_right(std::exchange(sibling->middle, nullptr));
+						update(right);
+						update(sibling);
+					}
+				}
+			}
+
+			update_path(parent);
+			counters.cascaded(steps);
+			return parent;
+		}
+	}
+
+	bool remove_impl(const Key &key)
+	{
+		if (root) {
+			auto found = root->find(key, counters);
+			if (!found.first || is_dead(found))
+				return false;
+
+			remove_entry(found.first, found.second);
+			return true;
+		}
+
+		return false;
+	}
+
+	// Removes the left (ldata) or right entry of node, which must not be a tombstone. Returns
+	// a node still in the tree near where the entry was, null if the tree is now empty.
+	Node *remove_entry(Node *node, bool ldata)
+	{
+		if (tombstone_fraction > 0) {
+			(ldata ? node->ldead : node->rdead) = true;
+			update_path(node);
+			if (++tombstone_count > tombstone_fraction * entry_count) {
+				compact();
+				return root;
+			}
+			return node;
+		}
+
+		--entry_count;
+		if (!node->is_leaf()) {
+			if (ldata) {
+				auto predecessor = node->predecessor(true).first;
+				node->ldata.release(value_allocator);
+				if (predecessor->is_three()) {
+					node->ldata = predecessor->take_rdata();
+					update_path(predecessor);
+					return predecessor;
+				}
+				node->ldata = std::move(predecessor->ldata);
+				return remove_hole(predecessor);
+			}
+
+			auto successor = node->successor(false).first;
+			node->rdata->release(value_allocator);
+			*node->rdata = std::move(successor->ldata);
+			if (successor->is_three()) {
+				successor->ldata = successor->take_rdata();
+				update_path(successor);
+				return successor;
+			}
+			return remove_hole(successor);
+		}
+
+		if (node->is_three()) {
+			if (ldata) {
+				node->ldata.release(value_allocator);
+				node->ldata = node->take_rdata();
+			} else {
+				node->rdata->release(value_allocator);
+				node->take_rdata();
+			}
+			update_path(node);
+			return node;
+		}
+
+		node->ldata.release(value_allocator);
+		return remove_hole(node);
+	}
+
+	static unsigned height_of(const Node *node)
+	{
+		unsigned height = 0;
+		for (; node; node = node->left)
+			++height;
+		return height;
+	}
+
+	// A 2-node's empty rdata slot counts as overhead
+	static void add_usage(const Node *node, MemoryUsage &usage)
+	{
+		if (!node)
+			return;
+
+		// So do tombstones
+		constexpr auto entry_bytes = sizeof(Key) + (Layout::separate_values ? 0 : sizeof(Value));
+		std::size_t live = 0;
+		if (!node->ldead) {
+			usage.add_entry(node->ldata.key(), node->ldata.value(), Layout::separate_values);
+			++live;
+		}
+		if (node->is_three() && !node->rdead) {
+			usage.add_entry(node->rdata->key(), node->rdata->value(), Layout::separate_values);
+			++live;
+		}
+		usage.add_node(sizeof(Node), live * entry_bytes);
+		add_usage(node->left, usage);
+		add_usage(node->middle, usage);
+		add_usage(node->right, usage);
+	}
+
+	static Node *detach(Node *node)
+	{
+		if (node)
+			node->parent = nullptr;
+		return node;
+	}
+
+	// Tree of the keys of left, then entry, then right, each part above the one before.
+	// Descends the taller tree to the height of the other and inserts entry there, with
+	// the other tree as its child, so the cost is the difference of the heights. Uses root
+	// along the way.
+	Node *join_nodes(Node *left, Entry &&entry, Node *right)
+	{
+		auto left_height = height_of(left), right_height = height_of(right);
+		if (left_height == right_height) {
+			auto node = construct(node_allocator, std::move(entry));
+			node->set_left(left);
+			node->set_right(right);
+			update(node);
+			return node;
+		}
+
+		if (left_height > right_height) {
+			root = left;
+			auto node = left;
+			for (auto height = left_height; height > right_height + 1; --height)
+				node = node->right;
+			insert_into_subtree(node, std::move(entry), right);
+		} else {
+			root = right;
+			auto node = right;
+			for (auto height = right_height; height > left_height + 1; --height)
+				node = node->left;
+			auto old_left = node->left;
+			node->set_left(left);
+			insert_into_subtree(node, std::move(entry), old_left);
+		}
+
+		return root;
+	}
+
+	// Takes the entry with the smallest key out of the tree, which must not be empty
+	Entry take_min()
+	{
+		auto node = root->min();
+		Entry entry(std::move(node->ldata));
+		if (node->is_three()) {
+			node->ldata = node->take_rdata();
+			update_path(node);
+		} else {
+			remove_hole(node);
+		}
+
+		return entry;
+	}
+
+	// Same without a middle entry, either tree may be empty
+	Node *join_nodes(Node *left, Node *right)
+	{
+		if (!left || !right)
+			return left ? left : right;
+
+		root = right;
+		auto middle = take_min();
+		return join_nodes(left, std::move(middle), root);
+	}
+
+	// Splits the subtree of node, taking it apart, into the keys below key and those above.
+	// Moves the entry of key, if any, into found. Uses root along the way.
+	bool split_node(Node *node, const Key &key, Node *&left, Node *&right, Storage<Entry> &found)
+	{
+		if (!node) {
+			left = right = nullptr;
+			return false;
+		}
+
+		unsigned count = node->is_three() ? 2 : 1;
+		Node *children[3] = {detach(node->left), detach(count == 2 ? node->middle : node->right),
+				count == 2 ? detach(node->right) : nullptr};
+		Storage<Entry> entries[2];
+		entries[0].emplace(std::move(node->ldata));
+		if (count == 2)
+			entries[1].emplace(node->take_rdata());
+		destroy(node_allocator, node);
+
+		// Child i is the one key falls into, unless it is entry i
+		unsigned i = 0;
+		int order = 1;
+		while (i < count && (order = Compare::compare(key, entries[i]->key())) > 0)
+			++i;
+
+		bool at_entry = i < count && order == 0, has_key = at_entry;
+		Node *lower, *upper;
+		if (at_entry) {
+			found.emplace(std::move(*entries[i]));
+			entries[i].destroy();
+			lower = children[i];
+			upper = children[i + 1];
+		} else {
+			has_key = split_node(children[i], key, lower, upper, found);
+		}
+
+		left = lower;
+		for (auto j = i; j-- > 0; ) {
+			left = join_nodes(children[j], std::move(*entries[j]), left);
+			entries[j].destroy();
+		}
+
+		right = upper;
+		for (auto j = at_entry ? i + 1 : i; j < count; ++j) {
+			right = join_nodes(right, std::move(*entries[j]), children[j + 1]);
+			entries[j].destroy();
+		}
+
+		return has_key;
+	}
+
+	// Takes the root apart into left, its first entry, which is returned, and right, with
+	// a second entry going to a new root of right. Leaves the tree empty.
+	Entry take_root(Node *&left, Node *&right)
+	{
+		auto node = std::exchange(root, nullptr);
+		left = detach(node->left);
+		if (node->is_three()) {
+			right = construct(node_allocator, node->take_rdata());
+			right->set_left(node->middle);
+			right->set_right(node->right);
+			update(right);
+		} else {
+			right = detach(node->right);
+		}
+
+		Entry entry(std::move(node->ldata));
+		destroy(node_allocator, node);
+		return entry;
+	}
+
+	// The set operations below take other apart and leave the result in this tree. Each
+	// splits this tree by the root of other and recurses on the two sides, handing one side
+	// to another thread while depth lasts. Every recursion works on trees of its own, as
+	// the join and split helpers use root, and the cost is O(m log(n / m + 1)) for trees of
+	// m <= n entries.
+
+	void unite_impl(TwoThreeTree &other, unsigned depth)
+	{
+		if (!other.root)
+			return;
+		if (!root) {
+			std::swap(root, other.root);
+			return;
+		}
+
+		TwoThreeTree other_left, other_right, right;
+		auto pivot = other.take_root(other_left.root, other_right.root);
+
+		// The entry of other replaces the one here, as insert() would
+		Node *left;
+		Storage<Entry> found;
+		if (split_node(root, pivot.key(), left, right.root, found)) {
+			found->release(value_allocator);
+			found.destroy();
+		}
+		root = left;
+
+		fork_join(depth, [&](unsigned next) { unite_impl(other_left, next); },
+				[&](unsigned next) { right.unite_impl(other_right, next); });
+		root = join_nodes(root, std::move(pivot), std::exchange(right.root, nullptr));
+	}
+
+	void intersect_impl(TwoThreeTree &other, unsigned depth)
+	{
+		if (!root || !other.root) {
+			destroy_subtree(root);
+			root = nullptr;
+			return;
+		}
+
+		TwoThreeTree other_left, other_right, right;
+		auto pivot = other.take_root(other_left.root, other_right.root);
+		pivot.release(value_allocator);
+
+		Node *left;
+		Storage<Entry> found;
+		bool has_key = split_node(root, pivot.key(), left, right.root, found);
+		root = left;
+
+		fork_join(depth, [&](unsigned next) { intersect_impl(other_left, next); },
+				[&](unsigned next) { right.intersect_impl(other_right, next); });
+		if (has_key) {
+			root = join_nodes(root, std::move(*found), std::exchange(right.root, nullptr));
+			found.destroy();
+		} else {
+			root = join_nodes(root, std::exchange(right.root, nullptr));
+		}
+	}
+
+	void subtract_impl(TwoThreeTree &other, unsigned depth)
+	{
+		if (!root || !other.root)
+			return;
+
+		TwoThreeTree other_left, other_right, right;
+		auto pivot = other.take_root(other_left.root, other_right.root);
+		pivot.release(value_allocator);
+
+		Node *left;
+		Storage<Entry> found;
+		if (split_node(root, pivot.key(), left, right.root, found)) {
+			found->release(value_allocator);
+			found.destroy();
+		}
+		root = left;
+
+		fork_join(depth, [&](unsigned next) { subtract_impl(other_left, next); },
+				[&](unsigned next) { right.subtract_impl(other_right, next); });
+		root = join_nodes(root, std::exchange(right.root, nullptr));
+	}
+
+	using typename OrderedTree<TwoThreeTree, Key, Value, Compare>::Position;
+
+	static Position to_position(const std::pair<Node *, bool> &entry)
+	{
+		return Position{entry.first, entry.first && !entry.second ? 1u : 0u};
+	}
+
+	Position first_position() const
+	{
+		return root ? to_position(skip_forward(std::make_pair(root->min(), true))) : Position{nullptr, 0};
+	}
+
+	template<typename K>
+	Position lower_bound_position(const K &key) const
+	{
+		return to_position(skip_forward(lower_bound_entry(key)));
+	}
+
+	template<typename K>
+	Position upper_bound_position(const K &key) const
+	{
+		return to_position(skip_forward(upper_bound_entry(key)));
+	}
+
+	void next_position(Position &position) const
+	{
+		auto node = static_cast<Node *>(position.node);
+		position = to_position(skip_forward(node->successor(position.index == 0)));
+	}
+
+	void prev_position(Position &position) const
+	{
+		auto node = static_cast<Node *>(position.node);
+		if (node)
+			position = to_position(skip_backward(node->predecessor(position.index == 0)));
+		else if (root)
+			position = to_position(skip_backward(max_entry(root)));
+	}
+
+	const Key &key_at(const Position &position) const
+	{
+		auto node = static_cast<Node *>(position.node);
+		return position.index == 0 ? node->ldata.key() : node->rdata->key();
+	}
+
+	Value &value_at(const Position &position) const
+	{
+		auto node = static_cast<Node *>(position.node);
+		return position.index == 0 ? node->ldata.value() : node->rdata->value();
+	}
+
+public:
+	using key_type = Key;
+	using mapped_type = Value;
+	using key_compare = Compare;
+	using typename OrderedTree<TwoThreeTree, Key, Value, Compare>::iterator;
+
+	TwoThreeTree()
+		: root(nullptr)
+		, tombstone_fraction(0)
+		, tombstone_count(0)
+		, entry_count(0)
+		, version(0)
+	{}
+
+	TwoThreeTree(const TwoThreeTree &) = delete;
+	TwoThreeTree &operator=(const TwoThreeTree &) = delete;
+
+	~TwoThreeTree()
+	{
+		// Pooled nodes go away together with their chunks, only payloads may need destructors
+		if (!Allocator<Node>::releases_all || !std::is_trivially_destructible<Data<Key, Value>>::value)
+			destroy_subtree(root);
+	}
+
+	static SearchTreePtr<Key, Value, Compare> create()
+	{
+		return std::unique_ptr<SearchTreeAdapter<TwoThreeTree>>(new SearchTreeAdapter<TwoThreeTree>());
+	}
+
+	// Replaces the contents with (key, value) pairs in linear time. Input that is not sorted
+	// by key, or repeats a key, is sorted and deduplicated into a temporary copy first.
+	template<typename ForwardIterator>
+	void assign_sorted(ForwardIterator begin, ForwardIterator end)
+	{
+		destroy_subtree(root);
+		root = nullptr;
+		tombstone_count = 0;
+		++version;
+
+		if (keys_strictly_increasing<Compare>(begin, end)) {
+			build(begin, std::distance(begin, end));
+		} else {
+			auto entries = sorted_by_key<Key, Value, Compare>(begin, end);
+			build(std::make_move_iterator(entries.begin()), entries.size());
+		}
+	}
+
+	template<typename ForwardIterator>
+	static SearchTreePtr<Key, Value, Compare> build_from_sorted(ForwardIterator begin, ForwardIterator end)
+	{
+		std::unique_ptr<SearchTreeAdapter<TwoThreeTree>> tree(new SearchTreeAdapter<TwoThreeTree>());
+		tree->get().assign_sorted(begin, end);
+		return tree;
+	}
+
+	// Replaces the contents with a snapshot written by save(), in linear time. Returns false
+	// and keeps the current contents if the file is missing, damaged or out of key order.
+	bool load(const std::string &path)
+	{
+		SnapshotReader<Key, Value> reader(path);
+		if (!reader.ok())
+			return false;
+
+		auto old_root = root;
+		auto old_entries = entry_count;
+		build(reader.begin(), reader.size());
+		if (!reader.finished() || !keys_strictly_increasing<Compare>(this->begin(), this->end())) {
+			destroy_subtree(root);
+			root = old_root;
+			entry_count = old_entries;
+			return false;
+		}
+
+		destroy_subtree(old_root);
+		tombstone_count = 0;
+		++version;
+		return true;
+	}
+
+	void insert(const Key &key, const Value &value)
+	{
+		insert_impl(key, value);
+	}
+
+	void insert(const Key &key, Value &&value)
+	{
+		insert_impl(key, std::move(value));
+	}
+
+	void insert(Key &&key, const Value &value)
+	{
+		insert_impl(std::move(key), value);
+	}
+
+	void insert(Key &&key, Value &&value)
+	{
+		insert_impl(std::move(key), std::move(value));
+	}
+
+	Value *find(const Key &key)
+	{
+		return find_impl(key);
+	}
+
+	const Value *find(const Key &key) const
+	{
+		return find_impl(key);
+	}
+
+	// Lookup by any type Compare orders against Key, when Compare is transparent
+	template<typename K, typename C = Compare, typename = typename C::is_transparent>
+	Value *find(const K &key)
+	{
+		return find_impl(key);
+	}
+
+	template<typename K, typename C = Compare, typename = typename C::is_transparent>
+	const Value *find(const K &key) const
+	{
+		return find_impl(key);
+	}
+
+	void insert_batch(const std::vector<std::pair<Key, Value>> &pairs)
+	{
+		insert_batch_impl(pairs.begin(), sorted_order(pairs, KeyLess<Compare>()));
+	}
+
+	void insert_batch(std::vector<std::pair<Key, Value>> &&pairs)
+	{
+		insert_batch_impl(std::make_move_iterator(pairs.begin()), sorted_order(pairs, KeyLess<Compare>()));
+	}
+
+	void find_batch(const std::vector<Key> &keys, std::vector<Value *> &out)
+	{
+		auto order = sorted_order(keys, CompareLess<Compare>());
+		out.assign(keys.size(), nullptr);
+		std::vector<std::pair<Node *, std::size_t>> descents;
+		find_sorted(root, keys.data(), order.data(), order.data() + order.size(), out.data(), descents);
+		find_interleaved(descents, keys.data(), out.data());
+	}
+
+	Value *min()
+	{
+		return min_impl();
+	}
+
+	const Value *min() const
+	{
+		return min_impl();
+	}
+
+	Value *max()
+	{
+		return max_impl();
+	}
+
+	const Value *max() const
+	{
+		return max_impl();
+	}
+
+	bool remove(const Key &key)
+	{
+		return remove_impl(key);
+	}
+
+	// Lazy removal for delete-heavy phases. remove() then only marks the entry as a tombstone,
+	// skipped by lookups, iteration and the order statistics, and an insert of the same key
+	// takes the slot back. Once tombstones pass max_fraction of the entries, compact() runs.
+	// Tombstones keep their values until then. 0 makes removal immediate again and compacts.
+	void set_lazy_remove(double max_fraction)
+	{
+		tombstone_fraction = max_fraction;
+		entry_count = count_entries(root);
+		if (max_fraction <= 0)
+			compact();
+	}
+
+	std::size_t tombstones() const
+	{
+		return tombstone_count;
+	}
+
+	// Rebuilds the tree from the entries that are not tombstones, in linear time. Iterators
+	// are invalidated.
+	void compact()
+	{
+		if (!tombstone_count)
+			return;
+
+		std::vector<Entry> live;
+		live.reserve(entry_count - tombstone_count);
+		take_live(root, live);
+		destroy_subtree(root);
+		build(live.begin(), live.size());
+		tombstone_count = 0;
+		++version;
+		counters.compacted();
+	}
+
+	// Finger for lookups and updates near one another. Each find, insert or remove starts
+	// from the node the previous one ended at and climbs parent links only until the key is
+	// in reach, so a key d entries from the last one typically takes O(log d) steps. Removes
+	// that merge nodes, compaction, split, join, the set operations and loads send cursors
+	// back to the root. A cursor must not outlive its tree.
+	class Cursor
+	{
+		friend class TwoThreeTree;
+
+		TwoThreeTree *tree;
+		Node *finger;
+		std::uint64_t version;
+
+		explicit Cursor(TwoThreeTree *tree)
+			: tree(tree)
+			, finger(nullptr)
+			, version(tree->version)
+		{}
+
+		// Node whose subtree spans key, null for an empty tree
+		Node *start(const Key &key) const
+		{
+			if (!finger || version != tree->version)
+				return tree->root;
+			return tree->ancestor_near(finger, key);
+		}
+
+		void move_to(Node *node)
+		{
+			finger = node;
+			version = tree->version;
+		}
+
+	public:
+		Value *find(const Key &key)
+		{
+			auto node = start(key);
+			if (!node)
+				return nullptr;
+
+			int slot;
+			node = node->descend(key, slot, tree->counters);
+			move_to(node);
+			if (slot < 0 || is_dead(std::make_pair(node, slot == 0)))
+				return nullptr;
+			return slot == 0 ? &node->ldata.value() : &node->rdata->value();
+		}
+
+		template<typename KeyT, typename ValueT>
+		void insert(KeyT &&key, ValueT &&value)
+		{
+			auto node = start(key);
+			move_to(tree->insert_impl(std::forward<KeyT>(key), std::forward<ValueT>(value), node));
+		}
+
+		bool remove(const Key &key)
+		{
+			auto node = start(key);
+			if (!node)
+				return false;
+
+			int slot;
+			node = node->descend(key, slot, tree->counters);
+			if (slot < 0 || is_dead(std::make_pair(node, slot == 0))) {
+				move_to(node);
+				return false;
+			}
+
+			move_to(tree->remove_entry(node, slot == 0));
+			return true;
+		}
+	};
+
+	Cursor cursor()
+	{
+		return Cursor(this);
+	}
+
+	// Split, join and the set operations move nodes from one tree to another, so they need
+	// an allocator that does not tie nodes to the tree, such as HeapAllocator
+
+	// Moves the entries with keys above key into greater, which must be empty. O(log n).
+	void split(const Key &key, TwoThreeTree &greater)
+	{
+		static_assert(!Allocator<Node>::releases_all, "split() needs nodes that can change trees");
+		compact();
+		Node *left, *right;
+		Storage<Entry> found;
+		bool has_key = split_node(root, key, left, right, found);
+		root = left;
+		if (has_key) {
+			root = join_nodes(root, std::move(*found), nullptr);
+			found.destroy();
+		}
+		greater.root = right;
+		restructured();
+		greater.restructured();
+	}
+
+	// Appends (key, value) and then the entries of greater, which is left empty. Every key
+	// here must be below key and every key of greater above it. O(log n).
+	template<typename KeyT, typename ValueT>
+	void join(KeyT &&key, ValueT &&value, TwoThreeTree &greater)
+	{
+		static_assert(!Allocator<Node>::releases_all, "join() needs nodes that can change trees");
+		compact();
+		greater.compact();
+		root = join_nodes(root, Entry(value_allocator, std::forward<KeyT>(key), std::forward<ValueT>(value)),
+				std::exchange(greater.root, nullptr));
+		restructured();
+		greater.restructured();
+	}
+
+	// Appends the entries of greater, whose keys must all be above the ones here
+	void join(TwoThreeTree &greater)
+	{
+		static_assert(!Allocator<Node>::releases_all, "join() needs nodes that can change trees");
+		compact();
+		greater.compact();
+		root = join_nodes(root, std::exchange(greater.root, nullptr));
+		restructured();
+		greater.restructured();
+	}
+
+	// Adds the entries of other, whose values win on equal keys. Other is left empty.
+	void unite(TwoThreeTree &other)
+	{
+		static_assert(!Allocator<Node>::releases_all, "unite() needs nodes that can change trees");
+		compact();
+		other.compact();
+		unite_impl(other, parallel_depth());
+		restructured();
+		other.restructured();
+	}
+
+	// Keeps the entries whose keys are in other too. Other is left empty.
+	void intersect(TwoThreeTree &other)
+	{
+		static_assert(!Allocator<Node>::releases_all, "intersect() needs nodes that can change trees");
+		compact();
+		other.compact();
+		intersect_impl(other, parallel_depth());
+		destroy_subtree(std::exchange(other.root, nullptr));
+		restructured();
+		other.restructured();
+	}
+
+	// Removes the entries whose keys are in other. Other is left empty.
+	void subtract(TwoThreeTree &other)
+	{
+		static_assert(!Allocator<Node>::releases_all, "subtract() needs nodes that can change trees");
+		compact();
+		other.compact();
+		subtract_impl(other, parallel_depth());
+		destroy_subtree(std::exchange(other.root, nullptr));
+		restructured();
+		other.restructured();
+	}
+
+	// Order statistics and range aggregates, available when the tree is augmented
+
+	std::size_t rank(const Key &key) const
+	{
+		static_assert(is_augmented<Augment>::value, "rank() needs an augmented tree");
+		return rank_impl(key, false);
+	}
+
+	// Entry with the given zero-based rank, end() if there are not that many entries
+	iterator select(std::size_t index)
+	{
+		static_assert(is_augmented<Augment>::value, "select() needs an augmented tree");
+		return this->make_iterator(to_position(select_entry(index)));
+	}
+
+	// Number of keys in [lo, hi]
+	std::size_t count(const Key &lo, const Key &hi) const
+	{
+		static_assert(is_augmented<Augment>::value, "count() needs an augmented tree");
+		if (Compare::less(hi, lo))
+			return 0;
+
+		return rank_impl(hi, true) - rank_impl(lo, false);
+	}
+
+	// Values with keys in [lo, hi] combined in key order
+	Aggregate aggregate(const Key &lo, const Key &hi) const
+	{
+		static_assert(is_augmented<Augment>::value, "aggregate() needs an augmented tree");
+
+		// Descend to the first node holding a key inside the range, both bounds split off from there
+		auto node = root;
+		while (node) {
+			if (node->is_three() && Compare::less(node->rdata->key(), lo))
+				node = node->right;
+			else if (Compare::less(hi, node->ldata.key()))
+				node = node->left;
+			else if (!node->is_three() && Compare::less(node->ldata.key(), lo))
+				node = node->right;
+			else if (node->is_three() && Compare::less(node->ldata.key(), lo) && Compare::less(hi, node->rdata->key()))
+				node = node->middle;
+			else
+				break;
+		}
+
+		if (!node)
+			return Augment::identity();
+
+		if (Compare::less(node->ldata.key(), lo))
+			return Augment::combine(Augment::combine(aggregate_from(node->middle, lo), lift(node, false)),
+					aggregate_to(node->right, hi));
+
+		auto result = Augment::combine(aggregate_from(node->left, lo), lift(node, true));
+		if (!node->is_three())
+			return Augment::combine(result, aggregate_to(node->right, hi));
+		if (Compare::less(hi, node->rdata->key()))
+			return Augment::combine(result, aggregate_to(node->middle, hi));
+
+		result = Augment::combine(Augment::combine(result, aggregate_of(node->middle)), lift(node, false));
+		return Augment::combine(result, aggregate_to(node->right, hi));
+	}
+
+	// Counters since creation or the last reset_stats(), see stats.hpp
+	TreeStats stats() const
+	{
+		auto result = counters.get();
+		result.height = height_of(root);
+		return result;
+	}
+
+	void reset_stats()
+	{
+		counters.reset();
+	}
+
+	// Walks the whole tree, see memory-usage.hpp
+	MemoryUsage memory_usage() const
+	{
+		MemoryUsage usage;
+		add_usage(root, usage);
+		return usage;
 	}
 
-	virtual void print(std::ostream &stream) override final
+	void print(std::ostream &stream) const
 	{
 		if (root)
 			root->print(stream, "", true);
@@ -13,3 +13,112 @@ std::unique_ptr<T> make_unique( Args&& ...args )
 } // namespace std
 #endif // __cplusplus < 201402L
 #endif // !_WIN32
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <numeric>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "compare.hpp"
+
+namespace search_trees
+{
+
+// Orders (key, value) pairs by key
+template<typename Compare>
+struct KeyLess
+{
+	template<typename Pair>
+	bool operator()(const Pair &a, const Pair &b) const
+	{
+		return Compare::less(a.first, b.first);
+	}
+};
+
+// Whether the keys of the (key, value) pairs in [begin, end) are strictly increasing
+template<typename Compare, typename Iterator>
+bool keys_strictly_increasing(Iterator begin, Iterator end)
+{
+	return std::adjacent_find(begin, end, [](const auto &a, const auto &b) {
+		return !Compare::less(a.first, b.first);
+	}) == end;
+}
+
+// Copy of the (key, value) pairs in [begin, end) sorted by key. Of equal keys only the
+// last one is kept, as a sequence of inserts would leave it.
+template<typename Key, typename Value, typename Compare, typename Iterator>
+std::vector<std::pair<Key, Value>> sorted_by_key(Iterator begin, Iterator end)
+{
+	std::vector<std::pair<Key, Value>> entries(begin, end);
+	std::stable_sort(entries.begin(), entries.end(), KeyLess<Compare>());
+
+	auto out = entries.begin();
+	for (auto it = entries.begin(); it != entries.end(); ++it) {
+		if (it + 1 != entries.end() && !Compare::less(it->first, (it + 1)->first))
+			continue;
+		if (out != it)
+			*out = std::move(*it);
+		++out;
+	}
+	entries.erase(out, entries.end());
+
+	return entries;
+}
+
+// Indices of items in the order given by less, equal items keeping their relative order
+template<typename T, typename Less>
+std::vector<std::size_t> sorted_order(const std::vector<T> &items, Less less)
+{
+	std::vector<std::size_t> order(items.size());
+	std::iota(order.begin(), order.end(), std::size_t(0));
+	if (!std::is_sorted(items.begin(), items.end(), less)) {
+		std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+			return less(items[a], items[b]);
+		});
+	}
+
+	return order;
+}
+
+// Of the indices [first, last), whose keys are in increasing order, the ones whose key equals key
+template<typename Compare, typename Key>
+std::pair<const std::size_t *, const std::size_t *> equal_run(const Key *keys, const std::size_t *first,
+		const std::size_t *last, const Key &key)
+{
+	auto below = std::partition_point(first, last, [&](std::size_t i) {
+		return Compare::less(keys[i], key);
+	});
+	auto above = std::partition_point(below, last, [&](std::size_t i) {
+		return !Compare::less(key, keys[i]);
+	});
+	return std::make_pair(below, above);
+}
+
+// Runs first and second, each given the depth left below this level, the first on a
+// thread of its own unless depth is zero. Returns when both are done.
+template<typename First, typename Second>
+void fork_join(unsigned depth, First first, Second second)
+{
+	if (!depth) {
+		first(0u);
+		second(0u);
+		return;
+	}
+
+	std::thread thread(first, depth - 1);
+	second(depth - 1);
+	thread.join();
+}
+
+// Depth of fork_join recursion that gives every hardware thread a share of the work
+inline unsigned parallel_depth()
+{
+	unsigned depth = 0;
+	for (auto threads = std::thread::hardware_concurrency(); (1u << depth) < threads; ++depth);
+	return depth;
+}
+
+} // namespace search_trees
@@ -0,0 +1,514 @@
+// Throughput and latency of the trees against std::map over a grid of workloads, sizes
+// and key types. Prints one JSON array with an object per run. Build with optimization,
+// e.g. cmake -DCMAKE_BUILD_TYPE=Release, and narrow the grid with the options below.
+//
+//   bench [--trees=red-black,2-3,b+,compact-red-black,compact-2-3,std::map] [--keys=int,uint64,string]
+//         [--workloads=sequential_insert,...] [--sizes=1K,100K,10M,100M] [--seed=N]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "two-three-tree.hpp"
+#include "red-black-tree.hpp"
+#include "b-plus-tree.hpp"
+#include "compact-red-black-tree.hpp"
+#include "compact-two-three-tree.hpp"
+
+using namespace search_trees;
+
+using Value = std::uint64_t;
+
+// Keeps the results of lookups alive
+static volatile Value sink;
+
+// std::map behind the interface the trees share
+template<typename Key>
+class MapBaseline
+{
+	std::map<Key, Value> map;
+
+public:
+	void insert(const Key &key, const Value &value)
+	{
+		map[key] = value;
+	}
+
+	const Value *find(const Key &key) const
+	{
+		auto it = map.find(key);
+		return it != map.end() ? &it->second : nullptr;
+	}
+
+	bool remove(const Key &key)
+	{
+		return map.erase(key) != 0;
+	}
+};
+
+// Keys are increasing in i for every key type, so the sequential workload inserts in key order
+
+template<typename Key>
+static Key make_key(std::uint64_t i);
+
+template<>
+int make_key<int>(std::uint64_t i)
+{
+	return static_cast<int>(i);
+}
+
+// Spread over the whole range while staying in order
+template<>
+std::uint64_t make_key<std::uint64_t>(std::uint64_t i)
+{
+	return i * 0x9e3779b1ull;
+}
+
+// Zero-padded to 20 digits, past the small string buffer of the common libraries
+template<>
+std::string make_key<std::string>(std::uint64_t i)
+{
+	char buffer[24];
+	std::snprintf(buffer, sizeof(buffer), "%020llu", static_cast<unsigned long long>(i));
+	return buffer;
+}
+
+// Zipfian ranks in [0, n) with the skew of the YCSB default, rank 0 the most frequent.
+// Gray et al., "Quickly generating billion-record synthetic databases".
+class Zipfian
+{
+	double theta, alpha, zetan, eta;
+	std::uint64_t n;
+
+	static double zeta(std::uint64_t n, double theta)
+	{
+		double sum = 0;
+		for (std::uint64_t i = 1; i <= n; ++i)
+			sum += 1 / std::pow(static_cast<double>(i), theta);
+		return sum;
+	}
+
+public:
+	explicit Zipfian(std::uint64_t n, double theta = 0.99)
+		: theta(theta)
+		, alpha(1 / (1 - theta))
+		, zetan(zeta(n, theta))
+		, n(n)
+	{
+		eta = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta(2, theta) / zetan);
+	}
+
+	template<typename Random>
+	std::uint64_t operator()(Random &random)
+	{
+		auto u = std::uniform_real_distribution<double>()(random);
+		auto uz = u * zetan;
+		if (uz < 1)
+			return 0;
+		if (uz < 1 + std::pow(0.5, theta))
+			return 1;
+		return std::min(n - 1, static_cast<std::uint64_t>(n * std::pow(eta * u - eta + 1, alpha)));
+	}
+};
+
+enum class Workload
+{
+	SEQUENTIAL_INSERT,
+	RANDOM_INSERT,
+	UNIFORM_FIND,
+	ZIPF_FIND,
+	MIXED_90_10,
+	MIXED_50_50
+};
+
+static const char *const workload_names[] = {"sequential_insert", "random_insert", "uniform_find", "zipf_find",
+		"mixed_90_10", "mixed_50_50"};
+
+enum class OpKind : std::uint32_t
+{
+	FIND,
+	INSERT,
+	REMOVE
+};
+
+struct Op
+{
+	std::uint32_t index;
+	OpKind kind;
+};
+
+// Least number of operations a run times, small sizes repeat to get there
+static const std::size_t min_ops = 1000000;
+
+// Latency is sampled on at most this many operations per run
+static const std::size_t max_samples = 100000;
+
+// Operations of a workload over keys [0, 2 * size), of which the even ones are loaded first
+static std::vector<Op> make_ops(Workload workload, std::size_t size, std::mt19937_64 &random)
+{
+	std::vector<Op> ops;
+	switch (workload) {
+	case Workload::SEQUENTIAL_INSERT:
+	case Workload::RANDOM_INSERT:
+		for (std::size_t i = 0; i < size; ++i)
+			ops.push_back(Op{static_cast<std::uint32_t>(2 * i), OpKind::INSERT});
+		if (workload == Workload::RANDOM_INSERT)
+			std::shuffle(ops.begin(), ops.end(), random);
+		break;
+
+	case Workload::UNIFORM_FIND: {
+		std::uniform_int_distribution<std::size_t> uniform(0, size - 1);
+		for (std::size_t i = 0; i < std::max(size, min_ops); ++i)
+			ops.push_back(Op{static_cast<std::uint32_t>(2 * uniform(random)), OpKind::FIND});
+		break;
+	}
+
+	case Workload::ZIPF_FIND:
+	case Workload::MIXED_90_10:
+	case Workload::MIXED_50_50: {
+		// Hot ranks are scattered over the key space rather than bunched at its start
+		bool mixed = workload != Workload::ZIPF_FIND;
+		std::uint64_t space = mixed ? 2 * size : size;
+		Zipfian zipfian(space);
+		unsigned writes_per_10 = workload == Workload::MIXED_90_10 ? 1 : workload == Workload::MIXED_50_50 ? 5 : 0;
+		std::uniform_int_distribution<unsigned> tenths(0, 9);
+		bool insert_next = true;
+		for (std::size_t i = 0; i < std::max(size, min_ops); ++i) {
+			auto index = zipfian(random) * 0x9e3779b97f4a7c15ull % space;
+			if (!mixed)
+				index *= 2;
+
+			// Writes alternate between inserts and removes, so the size stays about the same
+			auto kind = OpKind::FIND;
+			if (tenths(random) < writes_per_10) {
+				kind = insert_next ? OpKind::INSERT : OpKind::REMOVE;
+				insert_next = !insert_next;
+			}
+			ops.push_back(Op{static_cast<std::uint32_t>(index), kind});
+		}
+		break;
+	}
+	}
+
+	return ops;
+}
+
+// Resident set size and its peak in bytes, 0 where unknown
+struct Memory
+{
+	std::uint64_t rss;
+	std::uint64_t peak_rss;
+};
+
+static Memory memory()
+{
+	Memory result{0, 0};
+#ifdef __linux__
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status, line)) {
+		if (!line.compare(0, 6, "VmRSS:"))
+			result.rss = std::stoull(line.substr(6)) * 1024;
+		else if (!line.compare(0, 6, "VmHWM:"))
+			result.peak_rss = std::stoull(line.substr(6)) * 1024;
+	}
+#elif !defined(_WIN32)
+	rusage usage;
+	if (!getrusage(RUSAGE_SELF, &usage))
+		result.peak_rss = static_cast<std::uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+	return result;
+}
+
+// Starts the peak over from the current size where the system allows it
+static void reset_peak_rss()
+{
+#ifdef __linux__
+	std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
+
+struct Result
+{
+	std::size_t ops;
+	double seconds;
+	std::uint64_t p50_ns;
+	std::uint64_t p99_ns;
+	Memory before;
+	Memory after;
+};
+
+template<typename Tree, typename Key>
+static void apply(Tree &tree, const std::vector<Key> &keys, const Op &op, Value &sum)
+{
+	auto &key = keys[op.index];
+	switch (op.kind) {
+	case OpKind::FIND: {
+		auto found = tree.find(key);
+		if (found)
+			sum += *found;
+		break;
+	}
+	case OpKind::INSERT:
+		tree.insert(key, op.index);
+		break;
+	case OpKind::REMOVE:
+		sum += tree.remove(key);
+		break;
+	}
+}
+
+template<typename Tree, typename Key>
+static Result run(Workload workload, const std::vector<Key> &keys, std::size_t size, std::mt19937_64 &random)
+{
+	auto ops = make_ops(workload, size, random);
+
+	// Insert workloads build a fresh tree per round, the others share one loaded tree
+	bool inserting = workload == Workload::SEQUENTIAL_INSERT || workload == Workload::RANDOM_INSERT;
+	auto rounds = inserting ? std::max<std::size_t>(1, min_ops / size) : 1;
+	auto total_ops = ops.size() * rounds;
+	auto stride = std::max<std::size_t>(16, total_ops / max_samples);
+
+	std::vector<std::uint32_t> samples;
+	samples.reserve(total_ops / stride + 1);
+
+	Result result;
+	result.ops = total_ops;
+	result.seconds = 0;
+	reset_peak_rss();
+	result.before = memory();
+
+	std::size_t count = 0;
+	Value sum = 0;
+	for (std::size_t round = 0; round < rounds; ++round) {
+		std::unique_ptr<Tree> tree(new Tree());
+		if (!inserting) {
+			std::vector<std::size_t> order(size);
+			for (std::size_t i = 0; i < size; ++i)
+				order[i] = 2 * i;
+			std::shuffle(order.begin(), order.end(), random);
+			for (auto i : order)
+				tree->insert(keys[i], i);
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		for (auto &op : ops) {
+			if (++count % stride) {
+				apply(*tree, keys, op, sum);
+				continue;
+			}
+
+			auto op_start = std::chrono::steady_clock::now();
+			apply(*tree, keys, op, sum);
+			auto op_finish = std::chrono::steady_clock::now();
+			samples.push_back(static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(op_finish - op_start).count()));
+		}
+		auto finish = std::chrono::steady_clock::now();
+		result.seconds += std::chrono::duration<double>(finish - start).count();
+
+		if (round + 1 == rounds)
+			result.after = memory();
+	}
+	sink = sum;
+
+	auto percentile = [&](double p) -> std::uint64_t {
+		if (samples.empty())
+			return 0;
+		auto nth = samples.begin() + static_cast<std::ptrdiff_t>(p * (samples.size() - 1));
+		std::nth_element(samples.begin(), nth, samples.end());
+		return *nth;
+	};
+	result.p50_ns = percentile(0.5);
+	result.p99_ns = percentile(0.99);
+	return result;
+}
+
+struct Options
+{
+	std::vector<std::string> trees = {"red-black", "2-3", "b+", "std::map"};
+	std::vector<std::string> keys = {"int", "uint64", "string"};
+	std::vector<std::string> workloads = std::vector<std::string>(std::begin(workload_names), std::end(workload_names));
+	std::vector<std::size_t> sizes = {1000, 10000, 100000, 1000000};
+	std::uint64_t seed = 1;
+};
+
+// Prints the results as elements of one JSON array
+class Report
+{
+	bool first = true;
+
+public:
+	Report()
+	{
+		std::cout << "[\n";
+	}
+
+	~Report()
+	{
+		std::cout << "\n]\n";
+	}
+
+	void add(const std::string &tree, const std::string &key, const std::string &workload, std::size_t size, const Result &result)
+	{
+		std::cout << (first ? "" : ",\n")
+				<< "{\"tree\": \"" << tree << "\", \"key\": \"" << key << "\", \"workload\": \"" << workload
+				<< "\", \"size\": " << size << ", \"ops\": " << result.ops << ", \"seconds\": " << result.seconds
+				<< ", \"ops_per_second\": " << static_cast<std::uint64_t>(result.ops / result.seconds)
+				<< ", \"p50_ns\": " << result.p50_ns << ", \"p99_ns\": " << result.p99_ns
+				<< ", \"rss_before_bytes\": " << result.before.rss << ", \"rss_after_bytes\": " << result.after.rss
+				<< ", \"peak_rss_bytes\": " << result.after.peak_rss << "}" << std::flush;
+		first = false;
+	}
+};
+
+template<typename Key>
+static void run_key_type(const Options &options, const std::string &key_name, Report &report)
+{
+	for (auto size : options.sizes) {
+		std::vector<Key> keys;
+		keys.reserve(2 * size);
+		for (std::size_t i = 0; i < 2 * size; ++i)
+			keys.push_back(make_key<Key>(i));
+
+		std::mt19937_64 random(options.seed);
+		for (auto &tree : options.trees) {
+			for (auto &workload_name : options.workloads) {
+				auto workload = static_cast<Workload>(std::find(std::begin(workload_names), std::end(workload_names),
+						workload_name) - std::begin(workload_names));
+
+				Result result;
+				if (tree == "red-black")
+					result = run<RedBlackTree<Key, Value>>(workload, keys, size, random);
+				else if (tree == "2-3")
+					result = run<TwoThreeTree<Key, Value>>(workload, keys, size, random);
+				else if (tree == "b+")
+					result = run<BPlusTree<Key, Value>>(workload, keys, size, random);
+				else if (tree == "compact-red-black")
+					result = run<CompactRedBlackTree<Key, Value>>(workload, keys, size, random);
+				else if (tree == "compact-2-3")
+					result = run<CompactTwoThreeTree<Key, Value>>(workload, keys, size, random);
+				else
+					result = run<MapBaseline<Key>>(workload, keys, size, random);
+
+				report.add(tree, key_name, workload_name, size, result);
+			}
+		}
+	}
+}
+
+static std::vector<std::string> split_list(const std::string &list)
+{
+	std::vector<std::string> items;
+	std::size_t start = 0;
+	for (;;) {
+		auto comma = list.find(',', start);
+		items.push_back(list.substr(start, comma - start));
+		if (comma == std::string::npos)
+			return items;
+		start = comma + 1;
+	}
+}
+
+// Accepts plain counts and K or M suffixes, as in 100K or 100M
+static bool parse_size(const std::string &text, std::size_t &size)
+{
+	char *end;
+	auto value = std::strtoull(text.c_str(), &end, 10);
+	if (end == text.c_str())
+		return false;
+	if (*end == 'K' || *end == 'k')
+		value *= 1000, ++end;
+	else if (*end == 'M' || *end == 'm')
+		value *= 1000000, ++end;
+
+	// Key indices are 32-bit and twice the size
+	if (*end || !value || value > 1000000000)
+		return false;
+	size = value;
+	return true;
+}
+
+static bool parse_options(int argc, char **argv, Options &options)
+{
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		auto equals = arg.find('=');
+		if (equals == std::string::npos)
+			return false;
+
+		auto name = arg.substr(0, equals);
+		auto value = arg.substr(equals + 1);
+		if (name == "--trees") {
+			options.trees = split_list(value);
+		} else if (name == "--keys") {
+			options.keys = split_list(value);
+		} else if (name == "--workloads") {
+			options.workloads = split_list(value);
+			for (auto &workload : options.workloads) {
+				if (std::find(std::begin(workload_names), std::end(workload_names), workload) == std::end(workload_names))
+					return false;
+			}
+		} else if (name == "--sizes") {
+			options.sizes.clear();
+			for (auto &item : split_list(value)) {
+				std::size_t size;
+				if (!parse_size(item, size))
+					return false;
+				options.sizes.push_back(size);
+			}
+		} else if (name == "--seed") {
+			options.seed = std::strtoull(value.c_str(), nullptr, 10);
+		} else {
+			return false;
+		}
+	}
+
+	for (auto &tree : options.trees) {
+		if (tree != "red-black" && tree != "2-3" && tree != "b+" && tree != "compact-red-black" && tree != "compact-2-3"
+				&& tree != "std::map")
+			return false;
+	}
+	for (auto &key : options.keys) {
+		if (key != "int" && key != "uint64" && key != "string")
+			return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	Options options;
+	if (!parse_options(argc, argv, options)) {
+		std::cerr << "usage: " << argv[0] << " [--trees=red-black,2-3,b+,compact-red-black,compact-2-3,std::map]\n"
+				<< "       [--keys=int,uint64,string]\n"
+				<< "       [--workloads=sequential_insert,random_insert,uniform_find,zipf_find,mixed_90_10,mixed_50_50]\n"
+				<< "       [--sizes=1K,10K,100K,1M] [--seed=1]\n";
+		return 1;
+	}
+
+	Report report;
+	for (auto &key : options.keys) {
+		if (key == "int")
+			run_key_type<int>(options, key, report);
+		else if (key == "uint64")
+			run_key_type<std::uint64_t>(options, key, report);
+		else
+			run_key_type<std::string>(options, key, report);
+	}
+
+	return 0;
+}
@@ -1,262 +1,888 @@
-#include <memory>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
-#include <fstream>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <sstream>
-#include <string.h>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include "two-three-tree.hpp"
 #include "red-black-tree.hpp"
+#include "b-plus-tree.hpp"
+#include "compact-red-black-tree.hpp"
+#include "compact-two-three-tree.hpp"
 
 using namespace search_trees;
 
-template<typename Key, typename Value>
-class Add;
-
-template<typename Key, typename Value>
-class Delete;
-
-template<typename Key, typename Value>
-class Search;
-
-template<typename Key, typename Value>
-class Min;
-
-template<typename Key, typename Value>
-class Max;
-
-template<typename Key, typename Value>
-class Print;
-
-template<typename Key, typename Value>
-class Command
+// Reads a file in large blocks and hands out its lines in place, without the line break.
+// A line stays valid until the next call.
+class LineReader
 {
+	std::FILE *file;
+	std::vector<char> buffer;
+	std::size_t start, filled;
+	bool at_end;
+
 public:
-	virtual ~Command() = default;
-
-	virtual bool parse_args(const std::string &args) = 0;
-
-	virtual void exec(const SearchTreePtr<Key, Value> &tree, std::ostream &os) = 0;
-
-	static std::unique_ptr<Command> parse(const std::string &line)
-	{
-		std::unique_ptr<Command> cmd;
-		std::string args;
-
-		if (strncmp(line.c_str(), "add", 3) == 0) {
-			cmd = std::make_unique<Add<Key, Value>>();
-			args = line.substr(3);
-		} else if (strncmp(line.c_str(), "delete", 6) == 0) {
-			cmd = std::make_unique<Delete<Key, Value>>();
-			args = line.substr(6);
-		} else if (strncmp(line.c_str(), "search", 6) == 0) {
-			cmd = std::make_unique<Search<Key, Value>>();
-			args = line.substr(6);
-		} else if (strncmp(line.c_str(), "min", 3) == 0) {
-			cmd = std::make_unique<Min<Key, Value>>();
-			args = line.substr(3);
-		} else if (strncmp(line.c_str(), "max", 3) == 0) {
-			cmd = std::make_unique<Max<Key, Value>>();
-			args = line.substr(3);
-		} else if (strncmp(line.c_str(), "print", 5) == 0) {
-			cmd = std::make_unique<Print<Key, Value>>();
-			args = line.substr(5);
+	explicit LineReader(std::FILE *file)
+		: file(file)
+		, buffer(1 << 20)
+		, start(0)
+		, filled(0)
+		, at_end(false)
+	{}
+
+	bool next(const char *&begin, const char *&end)
+	{
+		for (;;) {
+			auto data = buffer.data();
+			auto newline = static_cast<const char *>(std::memchr(data + start, '\n', filled - start));
+			if (newline || (at_end && start < filled)) {
+				begin = data + start;
+				end = newline ? newline : data + filled;
+				start = newline ? newline - data + 1 : filled;
+				if (end > begin && end[-1] == '\r')
+					--end;
+				return true;
+			}
+
+			if (at_end)
+				return false;
+			refill();
 		}
+	}
 
-		if (!cmd || !cmd->parse_args(args)) {
-			std::cerr << "Unrecognized command: '" << line << "'\n";
-			return nullptr;
+	// Same for all complete lines in the buffer at once, line breaks included
+	bool next_block(const char *&begin, const char *&end)
+	{
+		for (;;) {
+			auto data = buffer.data();
+			auto last = data + filled;
+			while (last > data + start && last[-1] != '\n')
+				--last;
+			if (last > data + start || (at_end && start < filled)) {
+				begin = data + start;
+				end = last > data + start ? last : data + filled;
+				start = end - data;
+				return true;
+			}
+
+			if (at_end)
+				return false;
+			refill();
 		}
+	}
 
-		return cmd;
+private:
+	// Keeps the partial line, making room for at least as much again
+	void refill()
+	{
+		filled -= start;
+		std::memmove(buffer.data(), buffer.data() + start, filled);
+		start = 0;
+		if (filled == buffer.size())
+			buffer.resize(2 * buffer.size());
+
+		auto read = std::fread(buffer.data() + filled, 1, buffer.size() - filled, file);
+		filled += read;
+		at_end = read == 0;
 	}
 };
 
-template<typename Key, typename Value>
-class Add final: public Command<Key, Value>
+// Collects output in one large block, written out when full and on destruction
+class OutputBuffer
 {
+	std::FILE *file;
+	std::vector<char> buffer;
+	std::size_t used;
+
 public:
-	Add() = default;
+	explicit OutputBuffer(std::FILE *file)
+		: file(file)
+		, buffer(1 << 20)
+		, used(0)
+	{}
 
-	bool parse_args(const std::string &args) override final
+	OutputBuffer(const OutputBuffer &) = delete;
+	OutputBuffer &operator=(const OutputBuffer &) = delete;
+
+	~OutputBuffer()
 	{
-		std::istringstream iss(args);
+		flush();
+	}
 
-		return !!(iss >> key >> value);
+	void flush()
+	{
+		std::fwrite(buffer.data(), 1, used, file);
+		used = 0;
 	}
 
-	void exec(const SearchTreePtr<Key, Value> &tree, std::ostream &os) override final
+	void append(const char *text, std::size_t length)
 	{
-		tree->insert(key, value);
-		os << "Inserted";
+		if (used + length > buffer.size()) {
+			flush();
+			if (length > buffer.size()) {
+				std::fwrite(text, 1, length, file);
+				return;
+			}
+		}
+
+		std::memcpy(buffer.data() + used, text, length);
+		used += length;
 	}
 
-private:
-	Key key;
-	Value value;
+	void append(const char *text)
+	{
+		append(text, std::strlen(text));
+	}
+
+	void append(char c)
+	{
+		if (used == buffer.size())
+			flush();
+		buffer[used++] = c;
+	}
+
+	template<typename T>
+	void append_number(T number)
+	{
+		static_assert(std::is_integral<T>::value, "values are printed as integers");
+
+		char digits[24];
+		auto end = digits + sizeof(digits), p = end;
+		auto magnitude = static_cast<unsigned long long>(number);
+		if (number < 0)
+			magnitude = 0 - magnitude;
+		do {
+			*--p = '0' + magnitude % 10;
+			magnitude /= 10;
+		} while (magnitude);
+		if (number < 0)
+			*--p = '-';
+		append(p, end - p);
+	}
 };
 
+static void skip_blanks(const char *&p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t'))
+		++p;
+}
+
+// Parses a decimal integer after optional blanks and moves p past it. Fails on overflow.
+template<typename T>
+static bool parse_number(const char *&p, const char *end, T &number)
+{
+	static_assert(std::is_integral<T>::value, "keys and values are parsed as integers");
+
+	skip_blanks(p, end);
+	bool negative = std::is_signed<T>::value && p < end && *p == '-';
+	if (negative || (p < end && *p == '+'))
+		++p;
+	if (p == end || *p < '0' || *p > '9')
+		return false;
+
+	// Negative numbers are accumulated as such, so that the minimum of T can be reached
+	using Wide = std::conditional_t<std::is_signed<T>::value, long long, unsigned long long>;
+	const Wide low = std::numeric_limits<T>::min(), high = std::numeric_limits<T>::max();
+	Wide result = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+		int digit = *p - '0';
+		if (negative ? result < (low + digit) / 10 : result > (high - digit) / 10)
+			return false;
+		result = negative ? result * 10 - digit : result * 10 + digit;
+	}
+
+	number = static_cast<T>(result);
+	return true;
+}
+
+// Moves p past word if the line continues with it, followed by a blank or the end
+static bool parse_word(const char *&p, const char *end, const char *word)
+{
+	auto length = std::strlen(word);
+	if (std::size_t(end - p) < length || std::memcmp(p, word, length) != 0)
+		return false;
+	if (p + length < end && p[length] != ' ' && p[length] != '\t')
+		return false;
+
+	p += length;
+	return true;
+}
+
+// One line of input. Parsing and running it allocate nothing, except for print, save and load.
 template<typename Key, typename Value>
-class Delete final: public Command<Key, Value>
+struct Command
 {
-public:
-	Delete() = default;
+	enum class Op {
+		ADD,
+		DELETE,
+		SEARCH,
+		MIN,
+		MAX,
+		PRINT,
+		STATS,
+		SAVE,
+		LOAD
+	} op;
+
+	Key key;
+	Value value;
+
+	// File name of save and load, pointing into the line
+	const char *path, *path_end;
 
-	bool parse_args(const std::string &args) override final
+	// Outcome of delete and search, kept until printed
+	bool found;
+	Value result;
+
+	bool parse_path(const char *&p, const char *end)
 	{
-		std::istringstream iss(args);
+		skip_blanks(p, end);
+		path = p;
+		while (p < end && *p != ' ' && *p != '\t')
+			++p;
+		path_end = p;
+		return path != path_end;
+	}
+
+	// Fills in the command from a line, false if the line is not one
+	bool parse(const char *p, const char *end)
+	{
+		skip_blanks(p, end);
+		if (parse_word(p, end, "add")) {
+			op = Op::ADD;
+			if (!parse_number(p, end, key) || !parse_number(p, end, value))
+				return false;
+		} else if (parse_word(p, end, "delete")) {
+			op = Op::DELETE;
+			if (!parse_number(p, end, key))
+				return false;
+		} else if (parse_word(p, end, "search")) {
+			op = Op::SEARCH;
+			if (!parse_number(p, end, key))
+				return false;
+		} else if (parse_word(p, end, "min")) {
+			op = Op::MIN;
+		} else if (parse_word(p, end, "max")) {
+			op = Op::MAX;
+		} else if (parse_word(p, end, "print")) {
+			op = Op::PRINT;
+		} else if (parse_word(p, end, "stats")) {
+			op = Op::STATS;
+		} else if (parse_word(p, end, "save")) {
+			op = Op::SAVE;
+			if (!parse_path(p, end))
+				return false;
+		} else if (parse_word(p, end, "load")) {
+			op = Op::LOAD;
+			if (!parse_path(p, end))
+				return false;
+		} else {
+			return false;
+		}
 
-		return !!(iss >> key);
+		skip_blanks(p, end);
+		return p == end;
 	}
 
-	void exec(const SearchTreePtr<Key, Value> &tree, std::ostream &os) override final
+	// Add, delete and search touch a single key, the rest the whole tree
+	bool keyed() const
 	{
-		if (tree->remove(key))
-			os << "Removed";
-		else
-			os << "Not found";
-		os << '\n';
+		return op == Op::ADD || op == Op::DELETE || op == Op::SEARCH;
 	}
 
-private:
-	Key key;
-};
+	// Runs a keyed command, leaving its outcome for print()
+	void run(SearchTree<Key, Value> &tree)
+	{
+		switch (op) {
+		case Op::ADD:
+			tree.insert(key, value);
+			break;
+		case Op::DELETE:
+			found = tree.remove(key);
+			break;
+		case Op::SEARCH: {
+			auto value = tree.find(key);
+			found = value;
+			if (value)
+				result = *value;
+			break;
+		}
+		default:
+			break;
+		}
+	}
 
-template<typename Key, typename Value>
-class Search final: public Command<Key, Value>
-{
-public:
-	Search() = default;
+	void print(OutputBuffer &out) const
+	{
+		switch (op) {
+		case Op::ADD:
+			out.append("Inserted");
+			return;
+		case Op::DELETE:
+			out.append(found ? "Removed" : "Not found");
+			break;
+		case Op::SEARCH:
+			print_value(found ? &result : nullptr, out);
+			break;
+		default:
+			return;
+		}
+
+		out.append('\n');
+	}
 
-	bool parse_args(const std::string &args) override final
+	void exec(SearchTree<Key, Value> &tree, OutputBuffer &out)
 	{
-		std::istringstream iss(args);
+		switch (op) {
+		case Op::ADD:
+		case Op::DELETE:
+		case Op::SEARCH:
+			run(tree);
+			print(out);
+			return;
+		case Op::MIN:
+			print_value(tree.min(), out);
+			break;
+		case Op::MAX:
+			print_value(tree.max(), out);
+			break;
+		case Op::PRINT: {
+			std::ostringstream oss;
+			tree.print(oss);
+			auto text = oss.str();
+			out.append(text.data(), text.size());
+			return;
+		}
+		case Op::STATS:
+			print_stats(tree.stats(), out);
+			tree.reset_stats();
+			return;
+		case Op::SAVE:
+			out.append(tree.save(std::string(path, path_end)) ? "Saved" : "Failed to save");
+			break;
+		case Op::LOAD:
+			out.append(tree.load(std::string(path, path_end)) ? "Loaded" : "Failed to load");
+			break;
+		}
 
-		return !!(iss >> key);
+		out.append('\n');
 	}
 
-	void exec(const SearchTreePtr<Key, Value> &tree, std::ostream &os) override final
+	static void print_value(const Value *value, OutputBuffer &out)
 	{
-		auto value = tree->find(key);
 		if (value)
-			os << *value;
+			out.append_number(*value);
 		else
-			os << "Not found";
-		os << '\n';
+			out.append("Not found");
 	}
 
-private:
-	Key key;
+	// Counters gathered since the previous stats command, which resets them
+	static void print_stats(const TreeStats &stats, OutputBuffer &out)
+	{
+		const std::pair<const char *, std::uint64_t> counters[] = {
+			{"comparisons ", stats.comparisons},
+			{"nodes_visited ", stats.nodes_visited},
+			{"red_red_fixes ", stats.red_red_fixes},
+			{"double_black_fixes ", stats.double_black_fixes},
+			{"rotations ", stats.rotations},
+			{"splits ", stats.splits},
+			{"merges ", stats.merges},
+			{"longest_cascade ", stats.longest_cascade},
+			{"height ", stats.height}
+		};
+
+		for (auto &counter : counters) {
+			out.append(counter.first);
+			out.append_number(counter.second);
+			out.append('\n');
+		}
+	}
 };
 
-template<typename Key, typename Value>
-class Min final: public Command<Key, Value>
+// Threads running one task at a time, each calling it with its own index
+class Workers
 {
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	std::function<void(unsigned)> task;
+	std::uint64_t generation;
+	unsigned pending;
+	bool stopping;
+
+	void work(unsigned index)
+	{
+		std::uint64_t seen = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			wake.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping)
+				return;
+
+			seen = generation;
+			lock.unlock();
+			task(index);
+			lock.lock();
+			if (--pending == 0)
+				done.notify_one();
+		}
+	}
+
 public:
-	Min() = default;
+	explicit Workers(unsigned count)
+		: generation(0)
+		, pending(0)
+		, stopping(false)
+	{
+		for (unsigned i = 0; i < count; ++i)
+			threads.emplace_back(&Workers::work, this, i);
+	}
 
-	bool parse_args(const std::string &args) override final
+	~Workers()
 	{
-		return true;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto &thread : threads)
+			thread.join();
 	}
 
-	void exec(const SearchTreePtr<Key, Value> &tree, std::ostream &os) override final
+	unsigned size() const
 	{
-		auto value = tree->min();
-		if (value)
-			os << *value;
-		else
-			os << "Not found";
-		os << '\n';
+		return threads.size();
+	}
+
+	// Runs task on every worker and waits for all of them
+	void run(std::function<void(unsigned)> task)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		this->task = std::move(task);
+		pending = threads.size();
+		++generation;
+		wake.notify_all();
+		done.wait(lock, [&] { return pending == 0; });
 	}
 };
 
+// Replays commands on one tree per worker, each holding a key range. Input is taken a block
+// at a time: workers parse a slice of it each, then each runs the keyed commands of its
+// range in input order, so commands on a key keep their order. Output is printed in input
+// order. Min, max, print, stats, save and load wait for the commands before them and look
+// at the shards in key order, so they answer as a single tree would, except that print
+// shows each nonempty shard's tree.
 template<typename Key, typename Value>
-class Max final: public Command<Key, Value>
+class ParallelReplay
 {
-public:
-	Max() = default;
+	struct Job
+	{
+		Command<Key, Value> cmd;
+		const char *line, *line_end;
+		bool valid;
+	};
+
+	Workers workers;
+	SearchTreePtr<Key, Value> (*create)();
+	std::vector<SearchTreePtr<Key, Value>> shards;
+
+	// Shard s holds the keys from splitters[s - 1] up to splitters[s]
+	std::vector<Key> splitters;
+	bool split;
+
+	// Per slice of the block: its jobs, where they start in the block, the jobs of each
+	// shard and the commands on whole trees, both as indices into the slice
+	std::vector<std::vector<Job>> jobs;
+	std::vector<std::size_t> slice_start;
+	std::vector<std::vector<std::vector<std::uint32_t>>> routed;
+	std::vector<std::vector<std::uint32_t>> barriers;
+
+	// Next routed job of every slice for every shard
+	std::vector<std::vector<std::size_t>> cursors;
+
+	std::size_t shard_of(const Key &key) const
+	{
+		return std::upper_bound(splitters.begin(), splitters.end(), key) - splitters.begin();
+	}
 
-	bool parse_args(const std::string &args) override final
+	void parse_slice(const char *begin, const char *end, std::vector<Job> &slice)
 	{
+		slice.clear();
+		while (begin < end) {
+			auto newline = static_cast<const char *>(std::memchr(begin, '\n', end - begin));
+			auto line_end = newline ? newline : end;
+			auto next = newline ? newline + 1 : end;
+			if (line_end > begin && line_end[-1] == '\r')
+				--line_end;
+
+			if (line_end > begin) {
+				slice.emplace_back();
+				auto &job = slice.back();
+				job.line = begin;
+				job.line_end = line_end;
+				job.valid = job.cmd.parse(begin, line_end);
+			}
+			begin = next;
+		}
+	}
+
+	// Keys at even ranks of the first block's keyed commands
+	void choose_splitters()
+	{
+		std::vector<Key> keys;
+		for (auto &slice : jobs) {
+			for (auto &job : slice) {
+				if (job.valid && job.cmd.keyed())
+					keys.push_back(job.cmd.key);
+			}
+		}
+
+		std::sort(keys.begin(), keys.end());
+		keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+		for (std::size_t s = 1; s < shards.size() && !keys.empty(); ++s)
+			splitters.push_back(keys[s * keys.size() / shards.size()]);
+		split = true;
+	}
+
+	void route_slice(unsigned slice)
+	{
+		auto &lists = routed[slice];
+		for (auto &list : lists)
+			list.clear();
+		barriers[slice].clear();
+
+		for (std::uint32_t i = 0; i < jobs[slice].size(); ++i) {
+			auto &job = jobs[slice][i];
+			if (!job.valid)
+				continue;
+			if (job.cmd.keyed())
+				lists[shard_of(job.cmd.key)].push_back(i);
+			else
+				barriers[slice].push_back(i);
+		}
+	}
+
+	// Runs the keyed jobs of a shard that come before position end of the block
+	void run_shard(unsigned shard, std::size_t end)
+	{
+		auto &tree = *shards[shard];
+		for (std::size_t slice = 0; slice < jobs.size() && slice_start[slice] < end; ++slice) {
+			auto &list = routed[slice][shard];
+			auto &cursor = cursors[shard][slice];
+			for (; cursor < list.size() && slice_start[slice] + list[cursor] < end; ++cursor)
+				jobs[slice][list[cursor]].cmd.run(tree);
+		}
+	}
+
+	Job &job_at(std::size_t position)
+	{
+		auto slice = std::upper_bound(slice_start.begin() + 1, slice_start.end(), position) - slice_start.begin() - 1;
+		return jobs[slice][position - slice_start[slice]];
+	}
+
+	// Entries of all shards in key order, for saving them as one snapshot
+	class Entries
+	{
+		std::vector<SearchTreePtr<Key, Value>> *shards;
+		std::size_t shard;
+		typename SearchTree<Key, Value>::iterator it;
+
+		void skip_empty()
+		{
+			while (shard < shards->size() && it == (*shards)[shard]->end()) {
+				if (++shard < shards->size())
+					it = (*shards)[shard]->begin();
+			}
+		}
+
+	public:
+		Entries(std::vector<SearchTreePtr<Key, Value>> *shards, std::size_t shard)
+			: shards(shards)
+			, shard(shard)
+		{
+			if (shard < shards->size())
+				it = (*shards)[shard]->begin();
+			skip_empty();
+		}
+
+		typename SearchTree<Key, Value>::iterator::reference operator*() const
+		{
+			return *it;
+		}
+
+		Entries &operator++()
+		{
+			++it;
+			skip_empty();
+			return *this;
+		}
+
+		bool operator!=(const Entries &other) const
+		{
+			return shard != other.shard || it != other.it;
+		}
+	};
+
+	bool load(const std::string &path)
+	{
+		SnapshotReader<Key, Value> reader(path);
+		if (!reader.ok())
+			return false;
+
+		std::vector<std::vector<std::pair<Key, Value>>> parts(shards.size());
+		auto it = reader.begin();
+		for (std::uint64_t i = 0; i < reader.size(); ++i, ++it) {
+			std::pair<Key, Value> entry = *it;
+			parts[shard_of(entry.first)].push_back(std::move(entry));
+		}
+		if (!reader.finished())
+			return false;
+
+		workers.run([&](unsigned shard) {
+			auto tree = create();
+			tree->insert_batch(std::move(parts[shard]));
+			shards[shard] = std::move(tree);
+		});
 		return true;
 	}
 
-	void exec(const SearchTreePtr<Key, Value> &tree, std::ostream &os) override final
+	void exec_barrier(Command<Key, Value> &cmd, OutputBuffer &out)
 	{
-		auto value = tree->max();
-		if (value)
-			os << *value;
-		else
-			os << "Not found";
-		os << '\n';
+		using Op = typename Command<Key, Value>::Op;
+
+		switch (cmd.op) {
+		case Op::MIN: {
+			const Value *value = nullptr;
+			for (auto shard = shards.begin(); !value && shard != shards.end(); ++shard)
+				value = (*shard)->min();
+			cmd.print_value(value, out);
+			break;
+		}
+		case Op::MAX: {
+			const Value *value = nullptr;
+			for (auto shard = shards.rbegin(); !value && shard != shards.rend(); ++shard)
+				value = (*shard)->max();
+			cmd.print_value(value, out);
+			break;
+		}
+		case Op::PRINT: {
+			std::ostringstream oss;
+			bool printed = false;
+			for (auto &shard : shards) {
+				if (shard->begin() != shard->end()) {
+					shard->print(oss);
+					printed = true;
+				}
+			}
+			if (!printed)
+				shards[0]->print(oss);
+			auto text = oss.str();
+			out.append(text.data(), text.size());
+			return;
+		}
+		case Op::STATS: {
+			TreeStats total;
+			for (auto &shard : shards) {
+				auto stats = shard->stats();
+				total.comparisons += stats.comparisons;
+				total.nodes_visited += stats.nodes_visited;
+				total.red_red_fixes += stats.red_red_fixes;
+				total.double_black_fixes += stats.double_black_fixes;
+				total.rotations += stats.rotations;
+				total.splits += stats.splits;
+				total.merges += stats.merges;
+				total.longest_cascade = std::max(total.longest_cascade, stats.longest_cascade);
+				total.height = std::max(total.height, stats.height);
+				shard->reset_stats();
+			}
+			cmd.print_stats(total, out);
+			return;
+		}
+		case Op::SAVE: {
+			auto saved = save_snapshot<Key, Value>(std::string(cmd.path, cmd.path_end), Entries(&shards, 0),
+					Entries(&shards, shards.size()));
+			out.append(saved ? "Saved" : "Failed to save");
+			break;
+		}
+		case Op::LOAD:
+			out.append(load(std::string(cmd.path, cmd.path_end)) ? "Loaded" : "Failed to load");
+			break;
+		default:
+			return;
+		}
+
+		out.append('\n');
+	}
+
+	void print_range(std::size_t begin, std::size_t end, OutputBuffer &out)
+	{
+		for (auto position = begin; position < end; ++position) {
+			auto &job = job_at(position);
+			if (job.valid)
+				job.cmd.print(out);
+			else
+				std::cerr << "Unrecognized command: '" << std::string(job.line, job.line_end) << "'\n";
+		}
 	}
-};
 
-template<typename Key, typename Value>
-class Print final: public Command<Key, Value>
-{
 public:
-	Print() = default;
+	ParallelReplay(unsigned threads, SearchTreePtr<Key, Value> (*create)())
+		: workers(threads)
+		, create(create)
+		, split(false)
+		, jobs(threads)
+		, slice_start(threads + 1)
+		, routed(threads, std::vector<std::vector<std::uint32_t>>(threads))
+		, barriers(threads)
+		, cursors(threads, std::vector<std::size_t>(threads))
+	{
+		for (unsigned i = 0; i < threads; ++i)
+			shards.push_back(create());
+	}
 
-	bool parse_args(const std::string &args) override final
+	void run(LineReader &lines, OutputBuffer &out)
 	{
-		return true;
+		const char *begin, *end;
+		while (lines.next_block(begin, end)) {
+			// Slices end at line breaks
+			std::vector<const char *> bounds{begin};
+			for (unsigned i = 1; i < workers.size(); ++i) {
+				auto bound = std::max(bounds.back(), begin + (end - begin) * i / workers.size());
+				auto newline = static_cast<const char *>(std::memchr(bound, '\n', end - bound));
+				bounds.push_back(newline ? newline + 1 : end);
+			}
+			bounds.push_back(end);
+
+			workers.run([&](unsigned slice) {
+				parse_slice(bounds[slice], bounds[slice + 1], jobs[slice]);
+			});
+			if (!split)
+				choose_splitters();
+			workers.run([&](unsigned slice) {
+				route_slice(slice);
+			});
+
+			for (unsigned slice = 0; slice < jobs.size(); ++slice)
+				slice_start[slice + 1] = slice_start[slice] + jobs[slice].size();
+			for (auto &shard : cursors)
+				std::fill(shard.begin(), shard.end(), 0);
+
+			// Keyed commands up to each barrier run in parallel, then the barrier on its own
+			std::size_t done = 0;
+			for (unsigned slice = 0; slice <= jobs.size(); ++slice) {
+				auto count = slice < jobs.size() ? barriers[slice].size() : 1;
+				for (std::size_t i = 0; i < count; ++i) {
+					auto barrier = slice < jobs.size() ? slice_start[slice] + barriers[slice][i] : slice_start.back();
+					workers.run([&](unsigned shard) {
+						run_shard(shard, barrier);
+					});
+					print_range(done, barrier, out);
+					if (barrier < slice_start.back())
+						exec_barrier(job_at(barrier).cmd, out);
+					done = barrier + 1;
+				}
+			}
+		}
 	}
+};
 
-	void exec(const SearchTreePtr<Key, Value> &tree, std::ostream &os) override final
+struct CloseFile
+{
+	void operator()(std::FILE *file) const
 	{
-		tree->print(os);
+		std::fclose(file);
 	}
 };
 
+using FilePtr = std::unique_ptr<std::FILE, CloseFile>;
+
 using KeyT = int;
 using ValueT = int;
 
+// With --threads=N the commands are replayed on N threads, see ParallelReplay
 int main(int argc, char *argv[])
 {
 	const char *tree_type, *input_file, *output_file = nullptr;
-	SearchTreePtr<KeyT, ValueT> tree;
+	SearchTreePtr<KeyT, ValueT> (*create)();
+	unsigned threads = 0;
+
+	std::vector<const char *> args;
+	for (int i = 1; i < argc; ++i) {
+		if (strncmp(argv[i], "--threads=", 10) == 0)
+			threads = std::strtoul(argv[i] + 10, nullptr, 10);
+		else
+			args.push_back(argv[i]);
+	}
 
-	if (argc >= 3) {
-		tree_type = argv[1];
-		input_file = argv[2];
-		if (argc >= 4)
-			output_file = argv[3];
+	if (args.size() >= 2) {
+		tree_type = args[0];
+		input_file = args[1];
+		if (args.size() >= 3)
+			output_file = args[2];
 	} else {
-		std::cerr << "Usage: " << argv[0] << " {rb,23} input.txt [output.txt]\n";
+		std::cerr << "Usage: " << argv[0] << " {rb,23,bp,crb,c23} input.txt [output.txt] [--threads=N]\n";
 		return -1;
 	}
 
 	if (strcmp(tree_type, "rb") == 0) {
-		tree = RedBlackTree<KeyT, ValueT>::create();
+		create = RedBlackTree<KeyT, ValueT>::create;
 	} else if (strcmp(tree_type, "23") == 0) {
-		tree = TwoThreeTree<KeyT, ValueT>::create();
+		create = TwoThreeTree<KeyT, ValueT>::create;
+	} else if (strcmp(tree_type, "bp") == 0) {
+		create = BPlusTree<KeyT, ValueT>::create;
+	} else if (strcmp(tree_type, "crb") == 0) {
+		create = CompactRedBlackTree<KeyT, ValueT>::create;
+	} else if (strcmp(tree_type, "c23") == 0) {
+		create = CompactTwoThreeTree<KeyT, ValueT>::create;
 	} else {
-		std::cerr << "Invalid tree type '" << tree_type << "'. Available types: rb, 23\n";
+		std::cerr << "Invalid tree type '" << tree_type << "'. Available types: rb, 23, bp, crb, c23\n";
 		return -1;
 	}
 
-	std::ifstream ifs(input_file);
-	if (!ifs) {
+	FilePtr input(std::fopen(input_file, "rb"));
+	if (!input) {
 		std::cerr << "Failed to open file '" << input_file << "'\n";
 		return -1;
 	}
 
-	std::ostream *os = &std::cout;
-	std::ofstream ofs;
+	FilePtr output;
 	if (output_file) {
-		ofs.open(output_file);
-		if (!ofs) {
+		output.reset(std::fopen(output_file, "wb"));
+		if (!output) {
 			std::cerr << "Failed to open file '" << output_file << "'\n";
 			return -1;
 		}
-		os = &ofs;
 	}
 
-	std::string line;
-	while (std::getline(ifs, line)) {
-		auto cmd = Command<KeyT, ValueT>::parse(line);
-		cmd->exec(tree, *os);
+	LineReader lines(input.get());
+	OutputBuffer out(output ? output.get() : stdout);
+	if (threads > 0) {
+		ParallelReplay<KeyT, ValueT>(threads, create).run(lines, out);
+		return 0;
+	}
+
+	auto tree = create();
+	Command<KeyT, ValueT> cmd;
+	const char *begin, *end;
+	while (lines.next(begin, end)) {
+		if (begin == end)
+			continue;
+		if (cmd.parse(begin, end))
+			cmd.exec(*tree, out);
+		else
+			std::cerr << "Unrecognized command: '" << std::string(begin, end) << "'\n";
 	}
 
 	return 0;
@@ -7,11 +7,24 @@
 #include <vector>
 #include <random>
 #include <algorithm>
+#include <numeric>
 #include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <type_traits>
 #include <assert.h>
 
 #include "two-three-tree.hpp"
 #include "red-black-tree.hpp"
+#include "b-plus-tree.hpp"
+#include "compact-red-black-tree.hpp"
+#include "compact-two-three-tree.hpp"
+#include "concurrent-search-tree.hpp"
+#include "persistent-red-black-tree.hpp"
+#include "mapped-tree.hpp"
+#include "durable-search-tree.hpp"
 
 using namespace search_trees;
 
@@ -42,7 +55,7 @@ static void big_test(SearchTreeFactory<int, int> factory, std::ostream &stream,
 
 	std::vector<int> elems(nodes_count);
 	for (int i = 1; i <= nodes_count; ++i)
-		elems[i - 1] = i - 1;
+		elems[i - 1] = i;
 	std::random_device rd;
 	std::mt19937 g(rd());
 	std::shuffle(elems.begin(), elems.end(), g);
@@ -66,6 +79,81 @@ static void big_test(SearchTreeFactory<int, int> factory, std::ostream &stream,
 	finish = std::chrono::high_resolution_clock::now();
 	stream << "Finding all nodes took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
 
+	start = std::chrono::high_resolution_clock::now();
+
+	for (auto elem : elems) {
+		auto found = tree->find(elem);
+		assert(found && *found == 2 * elem);
+	}
+
+	finish = std::chrono::high_resolution_clock::now();
+	stream << "Finding all nodes in random order took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	start = std::chrono::high_resolution_clock::now();
+
+	const int batch_size = 256;
+	std::vector<int> batch;
+	std::vector<int *> batch_found;
+	for (int i = 0; i < nodes_count; i += batch_size) {
+		batch.assign(elems.begin() + i, elems.begin() + std::min(i + batch_size, nodes_count));
+		tree->find_batch(batch, batch_found);
+		for (std::size_t j = 0; j < batch.size(); ++j)
+			assert(batch_found[j] && *batch_found[j] == 2 * batch[j]);
+	}
+
+	finish = std::chrono::high_resolution_clock::now();
+	stream << "Finding all nodes in random batches of " << batch_size << " took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	start = std::chrono::high_resolution_clock::now();
+
+	auto batched = factory();
+	std::vector<std::pair<int, int>> pairs;
+	for (int i = 0; i < nodes_count; i += batch_size) {
+		pairs.clear();
+		for (int j = i; j < std::min(i + batch_size, nodes_count); ++j)
+			pairs.emplace_back(elems[j], 2 * elems[j]);
+		batched->insert_batch(std::move(pairs));
+	}
+
+	finish = std::chrono::high_resolution_clock::now();
+	stream << "Inserting all nodes in random batches of " << batch_size << " took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	// A batch over the whole key range after removals, which leave stale separators behind
+	pairs.clear();
+	for (int i = 1; i <= nodes_count; i += 3) {
+		assert(batched->remove(i));
+		pairs.emplace_back(i, 2 * i);
+	}
+	batched->insert_batch(pairs);
+
+	int batched_expected = 1;
+	for (auto it = batched->begin(); it != batched->end(); ++it, ++batched_expected)
+		assert(it.key() == batched_expected && it.value() == 2 * batched_expected);
+	assert(batched_expected == nodes_count + 1);
+	batched.reset();
+
+	start = std::chrono::high_resolution_clock::now();
+
+	int expected = 1;
+	for (auto it = tree->begin(); it != tree->end(); ++it, ++expected)
+		assert(it.key() == expected && it.value() == 2 * expected);
+	assert(expected == nodes_count + 1);
+
+	finish = std::chrono::high_resolution_clock::now();
+	stream << "Iterating over all nodes took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	assert(tree->lower_bound(0).key() == 1);
+	assert(tree->lower_bound(nodes_count / 2).key() == nodes_count / 2);
+	assert(tree->upper_bound(nodes_count / 2).key() == nodes_count / 2 + 1);
+	assert(tree->upper_bound(nodes_count) == tree->end());
+	assert((--tree->end()).key() == nodes_count);
+
+	const auto &view = *tree;
+	SearchTree<int, int>::const_iterator first = tree->begin();
+	static_assert(std::is_same<decltype(first.value()), const int &>::value, "const_iterator reads only");
+	assert(first == view.begin() && view.lower_bound(nodes_count / 2).value() == nodes_count);
+	assert(view.upper_bound(nodes_count) == view.end() && (--view.end()).key() == nodes_count);
+
 	auto min = tree->min();
 	assert(min && *min == 2);
 	auto max = tree->max();
@@ -90,10 +178,867 @@ static void big_test(SearchTreeFactory<int, int> factory, std::ostream &stream,
 	}
 }
 
-int main()
+static void freeze_test(SearchTreeFactory<int, int> factory, std::ostream &stream)
+{
+	const int nodes_count = 1024 * 1024;
+
+	std::vector<int> elems(nodes_count);
+	for (int i = 1; i <= nodes_count; ++i)
+		elems[i - 1] = i;
+	std::random_device rd;
+	std::mt19937 g(rd());
+	std::shuffle(elems.begin(), elems.end(), g);
+
+	auto tree = factory();
+	for (auto elem : elems)
+		tree->insert(elem, 2 * elem);
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	auto frozen = tree->freeze();
+
+	auto finish = std::chrono::high_resolution_clock::now();
+	stream << "Freezing tree with " << nodes_count << " nodes took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	start = std::chrono::high_resolution_clock::now();
+
+	for (auto elem : elems) {
+		auto found = frozen.find(elem);
+		assert(found && *found == 2 * elem);
+	}
+
+	finish = std::chrono::high_resolution_clock::now();
+	stream << "Finding all nodes in random order took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	assert(frozen.size() == static_cast<std::size_t>(nodes_count));
+	assert(!frozen.find(0) && !frozen.find(nodes_count + 1));
+	assert(*frozen.min() == 2 && *frozen.max() == 2 * nodes_count);
+}
+
+template<typename Tree>
+static void build_test(std::ostream &stream)
+{
+	const int nodes_count = 1024 * 1024;
+
+	std::vector<std::pair<int, int>> elems(nodes_count);
+	for (int i = 1; i <= nodes_count; ++i)
+		elems[i - 1] = std::make_pair(i, 2 * i);
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	auto tree = Tree::build_from_sorted(elems.begin(), elems.end());
+
+	auto finish = std::chrono::high_resolution_clock::now();
+	stream << "Building tree with " << nodes_count << " nodes from sorted input took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	for (int i = 1; i <= nodes_count; ++i) {
+		auto found = tree->find(i);
+		assert(found && *found == 2 * i);
+	}
+
+	std::random_device rd;
+	std::mt19937 g(rd());
+	std::shuffle(elems.begin(), elems.end(), g);
+
+	start = std::chrono::high_resolution_clock::now();
+
+	tree = Tree::build_from_sorted(elems.begin(), elems.end());
+
+	finish = std::chrono::high_resolution_clock::now();
+	stream << "Building tree with " << nodes_count << " nodes from shuffled input took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	int expected = 1;
+	for (auto it = tree->begin(); it != tree->end(); ++it, ++expected)
+		assert(it.key() == expected && it.value() == 2 * expected);
+	assert(expected == nodes_count + 1);
+}
+
+template<typename Tree>
+static void augment_test(std::ostream &stream)
+{
+	const int nodes_count = 64 * 1024;
+
+	std::vector<int> elems(nodes_count);
+	for (int i = 1; i <= nodes_count; ++i)
+		elems[i - 1] = i;
+	std::random_device rd;
+	std::mt19937 g(rd());
+	std::shuffle(elems.begin(), elems.end(), g);
+
+	Tree tree;
+	for (auto elem : elems)
+		tree.insert(elem, elem);
+	for (int i = 2; i <= nodes_count; i += 2)
+		assert(tree.remove(i));
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// Odd keys 1, 3, ... remain, key 2 * i + 1 has rank i
+	for (int i = 0; i < nodes_count / 2; ++i) {
+		assert(tree.rank(2 * i + 1) == static_cast<std::size_t>(i));
+		assert(tree.select(i).key() == 2 * i + 1);
+	}
+	assert(tree.select(nodes_count / 2) == tree.end());
+
+	for (int i = 1; i <= nodes_count; i += 97) {
+		long long lo = i, hi = std::min(i + 1000, nodes_count);
+		long long first = lo | 1, last = (hi - 1) | 1;
+		long long count = (last - first) / 2 + 1;
+		assert(tree.count(i, static_cast<int>(hi)) == static_cast<std::size_t>(count));
+		assert(tree.aggregate(i, static_cast<int>(hi)) == count * (first + last) / 2);
+	}
+	assert(tree.count(10, 5) == 0);
+
+	auto finish = std::chrono::high_resolution_clock::now();
+	stream << "Rank, select and range queries took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+}
+
+template<typename Tree>
+static void dispatch_test(std::ostream &stream)
+{
+	const int nodes_count = 1024 * 1024;
+
+	std::vector<int> elems(nodes_count);
+	for (int i = 1; i <= nodes_count; ++i)
+		elems[i - 1] = i;
+	std::random_device rd;
+	std::mt19937 g(rd());
+	std::shuffle(elems.begin(), elems.end(), g);
+
+	// The same tree seen through the virtual interface and as its concrete type
+	SearchTreePtr<int, int> erased = Tree::create();
+	auto &tree = static_cast<SearchTreeAdapter<Tree> &>(*erased).get();
+	for (auto elem : elems)
+		tree.insert(elem, 2 * elem);
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	long long erased_sum = 0;
+	for (auto elem : elems) {
+		auto found = erased->find(elem);
+		assert(found && *found == 2 * elem);
+		erased_sum += *found;
+	}
+
+	auto finish = std::chrono::high_resolution_clock::now();
+	stream << "Finding all nodes through SearchTree took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	start = std::chrono::high_resolution_clock::now();
+
+	long long direct_sum = 0;
+	for (auto elem : elems) {
+		auto found = tree.find(elem);
+		assert(found && *found == 2 * elem);
+		direct_sum += *found;
+	}
+
+	finish = std::chrono::high_resolution_clock::now();
+	stream << "Finding all nodes directly took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	// Using the sums keeps the lookups from being optimized away
+	long long iterated_sum = 0;
+	for (auto it = tree.begin(); it != tree.end(); ++it)
+		iterated_sum += it.value();
+	if (erased_sum != iterated_sum || direct_sum != iterated_sum)
+		stream << "Lookups disagree with iteration\n";
+}
+
+template<typename Tree>
+static void string_test(std::ostream &stream)
+{
+	const int nodes_count = 256 * 1024;
+
+	// A long shared prefix makes every key comparison expensive
+	std::vector<std::string> keys(nodes_count);
+	for (int i = 0; i < nodes_count; ++i)
+		keys[i] = "/usr/share/search-trees/keys/" + std::to_string(i);
+	std::random_device rd;
+	std::mt19937 g(rd());
+	std::shuffle(keys.begin(), keys.end(), g);
+
+	Tree tree;
+	for (int i = 0; i < nodes_count; ++i)
+		tree.insert(keys[i], i);
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	for (int i = 0; i < nodes_count; ++i) {
+		auto found = tree.find(keys[i]);
+		assert(found && *found == i);
+	}
+
+	auto finish = std::chrono::high_resolution_clock::now();
+	stream << "Finding all nodes took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	start = std::chrono::high_resolution_clock::now();
+
+	for (int i = 0; i < nodes_count; ++i) {
+		auto found = tree.find(keys[i].c_str());
+		assert(found && *found == i);
+	}
+
+	finish = std::chrono::high_resolution_clock::now();
+	stream << "Finding all nodes by C string took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	assert(!tree.find("/usr/share/search-trees/keys/") && !tree.find("/usr/share/search-trees/keys/x"));
+	assert(tree.lower_bound("/usr/share/search-trees/keys/").key() == "/usr/share/search-trees/keys/0");
+	assert(tree.upper_bound("/usr/share/search-trees/keys/x") == tree.end());
+}
+
+template<typename Tree>
+static void reverse_order_test()
+{
+	Tree tree;
+	for (int i = 1; i <= 1000; ++i)
+		tree.insert(i, 2 * i);
+
+	int expected = 1000;
+	for (auto it = tree.begin(); it != tree.end(); ++it, --expected)
+		assert(it.key() == expected && it.value() == 2 * expected);
+	assert(expected == 0);
+
+	auto frozen = tree.freeze();
+	for (int i = 1; i <= 1000; ++i)
+		assert(*tree.find(i) == 2 * i && *frozen.find(i) == 2 * i);
+	assert(*tree.min() == 2000 && *frozen.min() == 2000);
+}
+
+// Heights stay logarithmic through an ascending insert burst, the worst case for rebalancing
+template<typename Tree>
+static void stats_test(unsigned max_height)
+{
+	Tree tree;
+	assert(tree.stats().height == 0);
+	for (int i = 0; i < 1024 * 1024; ++i)
+		tree.insert(i, i);
+	for (int i = 0; i < 1024 * 1024; i += 2)
+		assert(tree.remove(i));
+
+	auto stats = tree.stats();
+	assert(stats.height > 1 && stats.height <= max_height);
+#ifdef SEARCH_TREES_STATS
+	assert(stats.comparisons >= stats.nodes_visited && stats.nodes_visited > 1024 * 1024);
+	assert(stats.longest_cascade > 0);
+
+	tree.reset_stats();
+	tree.find(1);
+	stats = tree.stats();
+	assert(stats.nodes_visited > 0 && stats.nodes_visited <= stats.height);
+#else
+	assert(stats.comparisons == 0 && stats.nodes_visited == 0 && stats.longest_cascade == 0);
+#endif
+}
+
+static void make_key(int i, int &key)
+{
+	key = i;
+}
+
+// Too long for the short string buffer, so every key owns a heap block
+static void make_key(int i, std::string &key)
+{
+	key = std::to_string(i);
+	key.insert(0, 20 - key.size(), '0');
+}
+
+template<typename Tree>
+static void memory_test(const char *name, int count, std::ostream &stream)
+{
+	using Key = typename Tree::key_type;
+
+	std::vector<int> order(count);
+	std::iota(order.begin(), order.end(), 0);
+	std::shuffle(order.begin(), order.end(), std::mt19937());
+
+	Tree tree;
+	assert(tree.memory_usage().total_bytes() == 0);
+	for (auto i : order) {
+		Key key;
+		make_key(i, key);
+		tree.insert(std::move(key), i);
+	}
+
+	auto usage = tree.memory_usage();
+	assert(usage.entries == static_cast<std::size_t>(count) && usage.nodes > 0);
+	assert(usage.key_bytes >= count * sizeof(Key) && usage.value_bytes >= count * sizeof(int));
+	assert(usage.total_bytes() == usage.key_bytes + usage.value_bytes + usage.overhead_bytes);
+
+	stream << name << ": " << usage.nodes << " nodes, " << usage.value_blocks << " value blocks, "
+			<< usage.key_bytes << " key bytes, " << usage.value_bytes << " value bytes, "
+			<< usage.overhead_bytes << " overhead bytes, " << usage.bytes_per_key() << " bytes/key\n";
+}
+
+// Bytes per key of each tree for int and string keys
+static void memory_report(int count, std::ostream &stream)
+{
+	memory_test<TwoThreeTree<int, int>>("2-3 tree, int keys", count, stream);
+	memory_test<TwoThreeTree<int, int, HeapAllocator, HotLayout>>("2-3 tree, int keys, hot layout", count, stream);
+	memory_test<TwoThreeTree<std::string, int>>("2-3 tree, string keys", count, stream);
+	memory_test<RedBlackTree<int, int>>("Red-Black tree, int keys", count, stream);
+	memory_test<RedBlackTree<int, int, HeapAllocator, HotLayout>>("Red-Black tree, int keys, hot layout", count, stream);
+	memory_test<RedBlackTree<std::string, int>>("Red-Black tree, string keys", count, stream);
+	memory_test<CompactTwoThreeTree<int, int>>("Compact 2-3 tree, int keys", count, stream);
+	memory_test<CompactTwoThreeTree<std::string, int>>("Compact 2-3 tree, string keys", count, stream);
+	memory_test<CompactRedBlackTree<int, int>>("Compact Red-Black tree, int keys", count, stream);
+	memory_test<CompactRedBlackTree<std::string, int>>("Compact Red-Black tree, string keys", count, stream);
+	memory_test<BPlusTree<int, int>>("B+ tree, int keys", count, stream);
+	memory_test<BPlusTree<std::string, int>>("B+ tree, string keys", count, stream);
+}
+
+// Round trip through save and load, then loads of damaged snapshots, which must fail and
+// leave the tree as it was
+template<typename Tree>
+static void snapshot_test(std::ostream &stream)
+{
+	using Key = typename Tree::key_type;
+
+	const int nodes_count = 1024 * 1024;
+	const std::string path = "snapshot-test.bin";
+
+	std::vector<std::pair<Key, int>> entries(nodes_count);
+	for (int i = 0; i < nodes_count; ++i) {
+		make_key(i, entries[i].first);
+		entries[i].second = 2 * i;
+	}
+
+	Tree tree;
+	for (auto &entry : entries)
+		tree.insert(entry.first, entry.second);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	assert(tree.save(path));
+	auto finish = std::chrono::high_resolution_clock::now();
+	stream << "Saving " << nodes_count << " nodes took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	start = std::chrono::high_resolution_clock::now();
+	auto loaded = Tree::create();
+	assert(loaded->load(path));
+	finish = std::chrono::high_resolution_clock::now();
+	stream << "Loading them took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	int i = 0;
+	for (auto it = loaded->begin(); it != loaded->end(); ++it, ++i)
+		assert(it.key() == entries[i].first && it.value() == 2 * i);
+	assert(i == nodes_count);
+	assert(*loaded->find(entries[nodes_count / 2].first) == nodes_count);
+
+	std::reverse(entries.begin(), entries.begin() + 2);
+	assert((save_snapshot<Key, int>(path, entries.begin(), entries.begin() + 2)));
+	assert(!loaded->load(path));
+
+	assert((save_snapshot<Key, int>(path, entries.begin() + 1, entries.begin() + 3)));
+	std::string bytes;
+	{
+		std::ifstream in(path, std::ios::binary);
+		bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+	for (std::size_t size : {std::size_t(0), std::size_t(16), bytes.size() - 1}) {
+		std::ofstream(path, std::ios::binary).write(bytes.data(), size);
+		assert(!loaded->load(path));
+	}
+	std::ofstream(path, std::ios::binary).write(bytes.data(), bytes.size()).put(0);
+	assert(!loaded->load(path));
+	assert(!loaded->load(path + ".missing"));
+
+	assert(*loaded->min() == 0 && *loaded->max() == 2 * (nodes_count - 1));
+	std::remove(path.c_str());
+
+	Tree empty;
+	assert(empty.save(path) && loaded->load(path) && !loaded->min());
+	std::remove(path.c_str());
+}
+
+// Tree written to a file and served from two mappings of it, as separate processes would
+static void mapped_test(std::ostream &stream)
+{
+	using Mapped = MappedTree<int, int>;
+
+	const int nodes_count = 1024 * 1024;
+	const std::string path = "mapped-test.bin";
+
+	RedBlackTree<int, int> tree;
+	for (int i = 1; i <= nodes_count; ++i)
+		tree.insert(2 * i, i);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	assert(Mapped::write(path, tree.begin(), tree.end()));
+	auto finish = std::chrono::high_resolution_clock::now();
+	stream << "Writing " << nodes_count << " nodes took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	Mapped first, second;
+	assert(first.open(path) && second.open(path));
+	assert(first.size() == nodes_count);
+
+	start = std::chrono::high_resolution_clock::now();
+	for (int i = 1; i <= nodes_count; ++i) {
+		auto found = first.find(2 * i);
+		assert(found && *found == i);
+		assert(!first.find(2 * i + 1));
+	}
+	finish = std::chrono::high_resolution_clock::now();
+	stream << "Finding all nodes took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	int expected = 1;
+	for (auto it = second.begin(); it != second.end(); ++it, ++expected)
+		assert(it.key() == 2 * expected && it.value() == expected);
+	assert(expected == nodes_count + 1);
+	assert(*second.min() == 1 && *second.max() == nodes_count);
+	assert(second.lower_bound(3).key() == 4 && second.upper_bound(4).key() == 6);
+	assert(second.upper_bound(2 * nodes_count) == second.end());
+	assert((--second.end()).key() == 2 * nodes_count);
+	const Mapped &view = second;
+	assert(view.begin().key() == 2 && view.lower_bound(3).value() == 2);
+
+	std::vector<std::pair<int, int>> unordered{{2, 0}, {1, 0}};
+	assert(!Mapped::write(path, unordered.begin(), unordered.end()));
+	assert((!MappedTree<int, long long>().open(path)));
+	std::remove(path.c_str());
+	assert(!Mapped().open(path));
+}
+
+// Delete-heavy churn, each batch of removed keys put back afterwards, with immediate and
+// with lazy removal, then the tombstones against what the tree reports
+template<typename Tree>
+static void lazy_remove_test(std::ostream &stream)
+{
+	const int nodes_count = 1024 * 1024;
+	const int batch = 1024;
+
+	std::vector<int> keys(nodes_count);
+	std::iota(keys.begin(), keys.end(), 0);
+	std::shuffle(keys.begin(), keys.end(), std::mt19937(1));
+
+	for (double fraction : {0.0, 0.25}) {
+		Tree tree;
+		for (int i = 0; i < nodes_count; ++i)
+			tree.insert(i, i);
+		tree.set_lazy_remove(fraction);
+
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int first = 0; first < nodes_count; first += batch) {
+			for (int i = first; i < first + batch; ++i)
+				assert(tree.remove(keys[i]));
+			for (int i = first; i < first + batch; ++i)
+				tree.insert(keys[i], -keys[i]);
+		}
+		auto finish = std::chrono::high_resolution_clock::now();
+		stream << "Churning " << nodes_count << " nodes with " << (fraction > 0 ? "lazy" : "immediate") << " removal took "
+				<< std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+		assert(!tree.tombstones());
+	}
+
+	Tree tree;
+	for (int i = 0; i < nodes_count; ++i)
+		tree.insert(i, i);
+	tree.set_lazy_remove(0.5);
+	for (int i = 0; i < nodes_count / 4; ++i)
+		assert(tree.remove(keys[i]) && !tree.remove(keys[i]));
+	assert(tree.tombstones() == nodes_count / 4);
+	assert(!tree.find(keys[0]) && tree.find(keys[nodes_count / 4]));
+
+	int count = 0, previous = -1;
+	for (auto it = tree.begin(); it != tree.end(); ++it, ++count) {
+		assert(it.key() > previous && it.value() == it.key());
+		previous = it.key();
+	}
+	assert(count == nodes_count - nodes_count / 4);
+	assert(tree.memory_usage().entries == std::size_t(count));
+
+	// Past half of the entries the tree compacts
+	for (int i = nodes_count / 4; i < nodes_count / 2 + 1; ++i)
+		tree.remove(keys[i]);
+	assert(tree.tombstones() < nodes_count / 4);
+	tree.set_lazy_remove(0);
+	assert(!tree.tombstones() && tree.find(keys[nodes_count - 1]));
+}
+
+// Ascending lookups from the root and through a cursor, then a sliding window of inserts
+// and removes through the cursor
+template<typename Tree>
+static void cursor_test(std::ostream &stream)
+{
+	const int nodes_count = 1024 * 1024;
+	const int window = 1024;
+
+	Tree tree;
+	for (int i = 0; i < nodes_count; ++i)
+		tree.insert(2 * i, i);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < nodes_count; ++i)
+		assert(*tree.find(2 * i) == i && !tree.find(2 * i + 1));
+	auto middle = std::chrono::high_resolution_clock::now();
+	auto cursor = tree.cursor();
+	for (int i = 0; i < nodes_count; ++i)
+		assert(*cursor.find(2 * i) == i && !cursor.find(2 * i + 1));
+	auto finish = std::chrono::high_resolution_clock::now();
+	stream << "Ascending lookups of " << nodes_count << " nodes took "
+			<< std::chrono::duration_cast<std::chrono::milliseconds>(middle - start).count() << " ms, through a cursor "
+			<< std::chrono::duration_cast<std::chrono::milliseconds>(finish - middle).count() << " ms\n";
+
+	for (int i = 0; i < nodes_count; ++i) {
+		cursor.insert(2 * i + 1, -i);
+		if (i >= window)
+			assert(cursor.remove(2 * (i - window) + 1));
+	}
+	assert(!cursor.remove(1) && *cursor.find(2 * nodes_count - 1) == 1 - nodes_count);
+
+	int count = 0, previous = -1;
+	for (auto it = tree.begin(); it != tree.end(); ++it, ++count) {
+		assert(it.key() > previous);
+		previous = it.key();
+	}
+	assert(count == nodes_count + window);
+}
+
+// Operations through the log, a full and an incremental checkpoint, more operations and a
+// torn group at the end of the log, then recovery into a new tree
+static void durable_test(std::ostream &stream)
+{
+	using Durable = DurableSearchTree<int, int>;
+
+	const int nodes_count = 1024 * 1024;
+	const std::string prefix = "durable-test";
+
+	auto remove_files = [&] {
+		std::remove((prefix + ".manifest").c_str());
+		for (int generation = 0; generation < 8; ++generation)
+			for (auto kind : {".log-", ".base-", ".delta-"})
+				std::remove((prefix + kind + std::to_string(generation)).c_str());
+	};
+	remove_files();
+
+	auto expected = RedBlackTree<int, int>::create();
+	{
+		Durable tree(RedBlackTree<int, int>::create(), prefix);
+		bool opened = tree.open();
+		assert(opened);
+
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < nodes_count; ++i)
+			tree.insert(i, i);
+		bool synced = tree.sync();
+		assert(synced);
+		auto finish = std::chrono::high_resolution_clock::now();
+		stream << "Inserting " << nodes_count << " nodes took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+		for (int i = 0; i < nodes_count; ++i)
+			expected->insert(i, i);
+
+		start = std::chrono::high_resolution_clock::now();
+		bool checkpointed = tree.checkpoint();
+		assert(checkpointed);
+		finish = std::chrono::high_resolution_clock::now();
+		stream << "Full checkpoint took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+		for (int i = 0; i < nodes_count; i += 7) {
+			bool removed = tree.remove(i) && expected->remove(i);
+			bool removed_again = tree.remove(i);
+			assert(removed && !removed_again);
+		}
+		for (int i = 0; i < nodes_count; i += 5) {
+			tree.insert(i, -i);
+			expected->insert(i, -i);
+		}
+
+		start = std::chrono::high_resolution_clock::now();
+		checkpointed = tree.checkpoint();
+		assert(checkpointed);
+		finish = std::chrono::high_resolution_clock::now();
+		stream << "Incremental checkpoint took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+		for (int i = 1; i < nodes_count; i += 11) {
+			tree.remove(i);
+			expected->remove(i);
+			tree.insert(nodes_count + i, i);
+			expected->insert(nodes_count + i, i);
+		}
+		assert(tree.ok());
+	}
+
+	// A group header whose records never made it to the device
+	std::ofstream(prefix + ".log-3", std::ios::binary | std::ios::app).write("\x40\0\0\0\x12\x34\x56\x78\x01", 9);
+
+	Durable recovered(RedBlackTree<int, int>::create(), prefix);
+	auto start = std::chrono::high_resolution_clock::now();
+	bool opened = recovered.open();
+	assert(opened);
+	auto finish = std::chrono::high_resolution_clock::now();
+	stream << "Recovery took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	for (int i = 0; i < 2 * nodes_count; ++i) {
+		auto found = recovered.find(i);
+		auto wanted = expected->find(i);
+		assert(found ? wanted && *found == *wanted : !wanted);
+	}
+
+	const auto &view = recovered.get();
+	auto it = view.begin();
+	for (auto wanted = expected->begin(); wanted != expected->end(); ++wanted, ++it)
+		assert(it != view.end() && it.key() == wanted.key() && it.value() == wanted.value());
+	assert(it == view.end() && view.lower_bound(nodes_count).key() == nodes_count + 1);
+
+	// Recovered trees go on logging where they left off
+	recovered.insert(-1, -1);
+	bool checkpointed = recovered.checkpoint() && recovered.sync();
+	assert(checkpointed && *recovered.min() == -1);
+
+	remove_files();
+
+	// Without open() nothing drains the log, so operations are refused instead of waiting on it
+	DurabilityOptions small;
+	small.group_bytes = 64;
+	Durable unopened(RedBlackTree<int, int>::create(), prefix, small);
+	for (int i = 0; i < 1024; ++i)
+		unopened.insert(i, i);
+	assert(!unopened.ok() && !unopened.sync() && !unopened.checkpoint());
+}
+
+template<typename Tree>
+static void set_operations_test(std::ostream &stream)
+{
+	const int nodes_count = 1024 * 1024;
+
+	// Multiples of 2 with value 2 and of 3 with value 3, as trees a and b
+	auto fill = [&](Tree &a, Tree &b) {
+		for (int i = 0; i < nodes_count; i += 2)
+			a.insert(i, 2);
+		for (int i = 0; i < nodes_count; i += 3)
+			b.insert(i, 3);
+	};
+	auto check = [&](Tree &tree, std::function<bool(int)> expected, std::function<int(int)> value) {
+		int i = 0;
+		for (auto it = tree.begin(); it != tree.end(); ++it, ++i) {
+			for (; !expected(i); ++i);
+			assert(it.key() == i && it.value() == value(i));
+		}
+		for (; i < nodes_count; ++i)
+			assert(!expected(i));
+	};
+
+	Tree a, b;
+	fill(a, b);
+	auto start = std::chrono::high_resolution_clock::now();
+	a.unite(b);
+	auto finish = std::chrono::high_resolution_clock::now();
+	check(a, [](int i) { return i % 2 == 0 || i % 3 == 0; }, [](int i) { return i % 3 == 0 ? 3 : 2; });
+	assert(b.begin() == b.end());
+	stream << "Union took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	Tree c, d;
+	fill(c, d);
+	c.intersect(d);
+	check(c, [](int i) { return i % 6 == 0; }, [](int) { return 2; });
+
+	Tree e, f;
+	fill(e, f);
+	e.subtract(f);
+	check(e, [](int i) { return i % 2 == 0 && i % 3 != 0; }, [](int) { return 2; });
+
+	Tree greater;
+	a.split(nodes_count / 2, greater);
+	check(a, [](int i) { return i <= nodes_count / 2 && (i % 2 == 0 || i % 3 == 0); }, [](int i) { return i % 3 == 0 ? 3 : 2; });
+	check(greater, [](int i) { return i > nodes_count / 2 && (i % 2 == 0 || i % 3 == 0); }, [](int i) { return i % 3 == 0 ? 3 : 2; });
+	a.join(greater);
+	check(a, [](int i) { return i % 2 == 0 || i % 3 == 0; }, [](int i) { return i % 3 == 0 ? 3 : 2; });
+
+	Tree low, high;
+	low.insert(1, 1);
+	for (int i = 3; i < 1000; ++i)
+		high.insert(i, i);
+	low.join(2, 2, high);
+	check(low, [](int i) { return i >= 1 && i < 1000; }, [](int i) { return i; });
+}
+
+static void concurrent_test(std::size_t shard_count, std::ostream &stream)
+{
+	const int nodes_count = 1024 * 1024;
+	const int threads_count = 4;
+
+	std::vector<int> elems(nodes_count);
+	for (int i = 1; i <= nodes_count; ++i)
+		elems[i - 1] = i;
+	std::random_device rd;
+	std::mt19937 g(rd());
+	std::shuffle(elems.begin(), elems.end(), g);
+
+	ConcurrentSearchTree<int, int> tree(shard_count);
+
+	// Each thread inserts its slice of the keys, then looks up all of them
+	auto work = [&](int thread) {
+		for (int i = thread; i < nodes_count; i += threads_count)
+			tree.insert(elems[i], 2 * elems[i]);
+		for (int i = thread; i < nodes_count; i += threads_count) {
+			int value;
+			if (!tree.find(elems[(i + nodes_count / 2) % nodes_count], value))
+				tree.insert(elems[(i + nodes_count / 2) % nodes_count], value = 0);
+		}
+	};
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < threads_count; ++i)
+		threads.emplace_back(work, i);
+	for (auto &thread : threads)
+		thread.join();
+
+	auto finish = std::chrono::high_resolution_clock::now();
+	stream << "Inserting and finding " << nodes_count << " nodes from " << threads_count << " threads with " << shard_count << " shards took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	// A lookup may have run before the insert of its key, all keys are there in the end
+	int expected = 1;
+	tree.for_each([&](int key, int value) {
+		assert(key == expected && (value == 2 * key || value == 0));
+		++expected;
+	});
+	assert(expected == nodes_count + 1);
+
+	expected = 100;
+	tree.for_each(100, 199, [&](int key, int) {
+		assert(key == expected);
+		++expected;
+	});
+	assert(expected == 200);
+
+	int min, max;
+	assert(tree.min(min) && tree.max(max) && (min == 2 || min == 0) && (max == 2 * nodes_count || max == 0));
+
+	std::uint64_t waits = 0;
+	for (auto &stats : tree.stats())
+		waits += stats.read_waits + stats.write_waits;
+	stream << "Lock acquisitions that had to wait: " << waits << '\n';
+}
+
+static void persistent_test(std::ostream &stream)
+{
+	const int nodes_count = 1024 * 1024;
+
+	std::vector<int> elems(nodes_count);
+	for (int i = 1; i <= nodes_count; ++i)
+		elems[i - 1] = i;
+	std::random_device rd;
+	std::mt19937 g(rd());
+	std::shuffle(elems.begin(), elems.end(), g);
+
+	PersistentRedBlackTree<int, int> tree;
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	for (auto elem : elems)
+		tree.insert(elem, 2 * elem);
+
+	auto finish = std::chrono::high_resolution_clock::now();
+	stream << "Creation of tree with " << nodes_count << " nodes took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	auto snapshot = tree.snapshot();
+
+	// A reader scans the snapshot while the writer removes the even keys
+	long long scanned = 0;
+	std::thread reader([&] {
+		int expected = 1;
+		snapshot.for_each([&](int key, int value) {
+			assert(key == expected && value == 2 * key);
+			++expected;
+			scanned += value;
+		});
+		assert(expected == nodes_count + 1);
+	});
+
+	start = std::chrono::high_resolution_clock::now();
+
+	for (int i = 2; i <= nodes_count; i += 2)
+		assert(tree.remove(i));
+
+	finish = std::chrono::high_resolution_clock::now();
+	stream << "Removing half of the nodes alongside a reader took " << std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count() << " ms\n";
+
+	reader.join();
+	assert(scanned == static_cast<long long>(nodes_count) * (nodes_count + 1));
+
+	for (int i = 1; i <= nodes_count; ++i) {
+		assert(*snapshot.find(i) == 2 * i);
+		assert(!tree.find(i) == (i % 2 == 0));
+	}
+
+	auto latest = tree.snapshot();
+	int expected = 101;
+	latest.for_each(100, 199, [&](int key, int) {
+		assert(key == expected);
+		expected += 2;
+	});
+	assert(expected == 201);
+	assert(*latest.min() == 2 && *latest.max() == 2 * (nodes_count - 1));
+	assert(*snapshot.max() == 2 * nodes_count);
+}
+
+// Readers sharing one tree, as those of a ConcurrentSearchTree shard do. With
+// SEARCH_TREES_STATS, every lookup of every reader must show up in the counters.
+template<typename Tree>
+static void shared_readers_test()
+{
+	const int nodes_count = 64 * 1024;
+	const int threads_count = 4;
+
+	Tree tree;
+	for (int i = 0; i < nodes_count; ++i)
+		tree.insert(i, 2 * i);
+
+	const Tree &view = tree;
+	auto lookups = [&] {
+		for (int i = 0; i < nodes_count; ++i) {
+			auto found = view.find(i);
+			assert(found && *found == 2 * i);
+		}
+	};
+
+	tree.reset_stats();
+	lookups();
+	auto single = tree.stats();
+
+	tree.reset_stats();
+	std::vector<std::thread> threads;
+	for (int i = 0; i < threads_count; ++i)
+		threads.emplace_back(lookups);
+	for (auto &thread : threads)
+		thread.join();
+
+	auto shared = tree.stats();
+	assert(shared.nodes_visited == threads_count * single.nodes_visited);
+	assert(shared.comparisons == threads_count * single.comparisons);
+}
+
+static void threaded_tests(std::ostream &stream)
+{
+	stream << "\nConcurrent Red-Black tree:\n";
+	concurrent_test(1, stream);
+	concurrent_test(16, stream);
+
+	shared_readers_test<RedBlackTree<int, int>>();
+	shared_readers_test<TwoThreeTree<int, int>>();
+	shared_readers_test<BPlusTree<int, int>>();
+	shared_readers_test<CompactRedBlackTree<int, int>>();
+	shared_readers_test<CompactTwoThreeTree<int, int>>();
+
+	stream << "\nPersistent Red-Black tree:\n";
+	persistent_test(stream);
+}
+
+// Pass "memory" to print only the bytes per key of each tree, "threads" to run only the
+// tests with threads, say in a build with -fsanitize=thread and SEARCH_TREES_STATS
+int main(int argc, char *argv[])
 {
 	std::ostream &stream = std::cout;
 
+	if (argc > 1 && std::string(argv[1]) == "memory") {
+		memory_report(1000 * 1000, stream);
+		return 0;
+	}
+
+	if (argc > 1 && std::string(argv[1]) == "threads") {
+		threaded_tests(stream);
+		return 0;
+	}
+
 	SearchTreeFactory<char, int> char_factory = TwoThreeTree<char, int>::create;
 	SearchTreeFactory<int, int> int_factory = TwoThreeTree<int, int>::create;
 	stream << "2-3 tree:\n";
@@ -106,6 +1051,128 @@ int main()
 	//visual_test(char_factory, stream);
 	big_test(int_factory, stream);
 
+	int_factory = TwoThreeTree<int, int, PoolAllocator>::create;
+	stream << "\n2-3 tree (pool allocator):\n";
+	big_test(int_factory, stream);
+
+	int_factory = RedBlackTree<int, int, PoolAllocator>::create;
+	stream << "\nRed-Black tree (pool allocator):\n";
+	big_test(int_factory, stream);
+
+	int_factory = TwoThreeTree<int, int, PoolAllocator, HotLayout>::create;
+	stream << "\n2-3 tree (pool allocator, hot layout):\n";
+	big_test(int_factory, stream);
+
+	int_factory = RedBlackTree<int, int, PoolAllocator, HotLayout>::create;
+	stream << "\nRed-Black tree (pool allocator, hot layout):\n";
+	big_test(int_factory, stream);
+
+	int_factory = BPlusTree<int, int>::create;
+	stream << "\nB+ tree:\n";
+	big_test(int_factory, stream);
+
+	int_factory = BPlusTree<int, int, 256, PoolAllocator>::create;
+	stream << "\nB+ tree (pool allocator):\n";
+	big_test(int_factory, stream);
+
+	int_factory = CompactTwoThreeTree<int, int>::create;
+	stream << "\nCompact 2-3 tree:\n";
+	big_test(int_factory, stream);
+
+	int_factory = CompactRedBlackTree<int, int>::create;
+	stream << "\nCompact Red-Black tree:\n";
+	big_test(int_factory, stream);
+
+	stream << "\nFrozen 2-3 tree:\n";
+	freeze_test(TwoThreeTree<int, int>::create, stream);
+
+	stream << "\n2-3 tree (bulk build):\n";
+	build_test<TwoThreeTree<int, int>>(stream);
+
+	stream << "\nRed-Black tree (bulk build):\n";
+	build_test<RedBlackTree<int, int>>(stream);
+
+	stream << "\n2-3 tree (sum augmentation):\n";
+	augment_test<TwoThreeTree<int, int, HeapAllocator, InlineLayout, Sum<long long>>>(stream);
+
+	stream << "\nRed-Black tree (sum augmentation):\n";
+	augment_test<RedBlackTree<int, int, HeapAllocator, InlineLayout, Sum<long long>>>(stream);
+
+	stream << "\n2-3 tree (virtual and direct calls):\n";
+	dispatch_test<TwoThreeTree<int, int>>(stream);
+
+	stream << "\nRed-Black tree (virtual and direct calls):\n";
+	dispatch_test<RedBlackTree<int, int>>(stream);
+
+	stream << "\nB+ tree (virtual and direct calls):\n";
+	dispatch_test<BPlusTree<int, int>>(stream);
+
+	stream << "\n2-3 tree (string keys):\n";
+	string_test<TwoThreeTree<std::string, int>>(stream);
+
+	stream << "\nRed-Black tree (string keys):\n";
+	string_test<RedBlackTree<std::string, int>>(stream);
+
+	stream << "\nB+ tree (string keys):\n";
+	string_test<BPlusTree<std::string, int>>(stream);
+
+	reverse_order_test<TwoThreeTree<int, int, HeapAllocator, InlineLayout, NoAugment, LessCompare<std::greater<int>>>>();
+	reverse_order_test<RedBlackTree<int, int, HeapAllocator, InlineLayout, NoAugment, LessCompare<std::greater<int>>>>();
+	reverse_order_test<BPlusTree<int, int, 256, HeapAllocator, LessCompare<std::greater<int>>>>();
+
+	stats_test<TwoThreeTree<int, int>>(20);
+	stats_test<RedBlackTree<int, int>>(40);
+	stats_test<BPlusTree<int, int>>(10);
+	stats_test<CompactTwoThreeTree<int, int>>(20);
+	stats_test<CompactRedBlackTree<int, int>>(40);
+
+	stream << "\n2-3 tree (set operations):\n";
+	set_operations_test<TwoThreeTree<int, int>>(stream);
+
+	stream << "\nRed-Black tree (set operations):\n";
+	set_operations_test<RedBlackTree<int, int>>(stream);
+
+	stream << "\n2-3 tree (snapshot):\n";
+	snapshot_test<TwoThreeTree<int, int>>(stream);
+
+	stream << "\nRed-Black tree (snapshot, string keys):\n";
+	snapshot_test<RedBlackTree<std::string, int>>(stream);
+
+	stream << "\nCompact 2-3 tree (snapshot, string keys):\n";
+	snapshot_test<CompactTwoThreeTree<std::string, int>>(stream);
+
+	stream << "\nCompact Red-Black tree (snapshot):\n";
+	snapshot_test<CompactRedBlackTree<int, int>>(stream);
+
+	stream << "\nB+ tree (snapshot):\n";
+	snapshot_test<BPlusTree<int, int>>(stream);
+
+	stream << "\nB+ tree (snapshot, string keys):\n";
+	snapshot_test<BPlusTree<std::string, int>>(stream);
+
+	stream << "\n2-3 tree (lazy removal):\n";
+	lazy_remove_test<TwoThreeTree<int, int>>(stream);
+
+	stream << "\nRed-Black tree (lazy removal):\n";
+	lazy_remove_test<RedBlackTree<int, int>>(stream);
+
+	stream << "\n2-3 tree (cursor):\n";
+	cursor_test<TwoThreeTree<int, int>>(stream);
+
+	stream << "\nRed-Black tree (cursor):\n";
+	cursor_test<RedBlackTree<int, int>>(stream);
+
+	stream << "\nMapped tree:\n";
+	mapped_test(stream);
+
+	stream << "\nDurable Red-Black tree:\n";
+	durable_test(stream);
+
+	stream << "\nMemory usage:\n";
+	memory_report(100 * 1000, stream);
+
+	threaded_tests(stream);
+
 #ifdef _WIN32
 	_CrtDumpMemoryLeaks();
 #endif